@@ -1,21 +1,178 @@
-
 /* auto_delete.c */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <libgen.h>
 #include <limits.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <syslog.h>
 #include <sqlite3.h>
 #include "auto_delete.h"
+#include "remove_tree.h"
+
+// From linux/ioprio.h, which glibc does not wrap
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_LOWEST_BE   7
+
+static const char* statement_sql[STMT_COUNT] = {
+    [STMT_INSERT] =
+        "INSERT INTO deleted_files (original_path, delete_timestamp, scheduled_deletion, file_type, "
+        "recycled_name, bin_id, size) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7)",
+    [STMT_SELECT_BY_ID] =
+        "SELECT d.original_path, d.recycled_name, b.path, d.codec "
+        "FROM deleted_files d LEFT JOIN recycle_bins b ON b.id = d.bin_id WHERE d.id = ?1",
+    [STMT_DELETE_BY_ID] =
+        "DELETE FROM deleted_files WHERE id = ?1",
+    [STMT_SELECT_EXPIRED] =
+        "SELECT d.id, d.recycled_name, d.original_path, d.scheduled_deletion, b.path, d.size "
+        "FROM deleted_files d LEFT JOIN recycle_bins b ON b.id = d.bin_id "
+        "WHERE d.scheduled_deletion <= ?1 AND (d.scheduled_deletion, d.id) > (?2, ?3) "
+        "ORDER BY d.scheduled_deletion, d.id LIMIT ?4",
+    [STMT_SELECT_NEXT_DEADLINE] =
+        "SELECT MIN(scheduled_deletion) FROM deleted_files",
+    [STMT_BEGIN] =
+        "BEGIN IMMEDIATE",
+    [STMT_COMMIT] =
+        "COMMIT",
+    [STMT_ROLLBACK] =
+        "ROLLBACK",
+    [STMT_SAVEPOINT] =
+        "SAVEPOINT nested",
+    [STMT_RELEASE] =
+        "RELEASE nested",
+    [STMT_ROLLBACK_TO] =
+        "ROLLBACK TO nested",
+    [STMT_INSERT_BIN] =
+        "INSERT OR IGNORE INTO recycle_bins (path, mount_point, device) VALUES (?1, ?2, ?3)",
+    [STMT_SELECT_BIN_ID] =
+        "SELECT id FROM recycle_bins WHERE path = ?1",
+    [STMT_SELECT_BINS] =
+        "SELECT id, path FROM recycle_bins",
+    [STMT_SELECT_USAGE] =
+        "SELECT total_bytes FROM bin_usage WHERE id = 0",
+    // Oldest first is rowid order, so these walk the primary key (or
+    // idx_deleted_files_bin, which ends in the rowid) without sorting
+    [STMT_SELECT_OLDEST] =
+        "SELECT d.id, d.recycled_name, d.size, b.path "
+        "FROM deleted_files d LEFT JOIN recycle_bins b ON b.id = d.bin_id "
+        "WHERE d.id > ?1 ORDER BY d.id LIMIT ?2",
+    [STMT_SELECT_OLDEST_IN_BIN] =
+        "SELECT d.id, d.recycled_name, d.size, b.path "
+        "FROM deleted_files d LEFT JOIN recycle_bins b ON b.id = d.bin_id "
+        "WHERE d.bin_id IS ?1 AND d.id > ?2 ORDER BY d.id LIMIT ?3",
+    [STMT_SELECT_DEDUP_PENDING] =
+        "SELECT d.id, d.recycled_name, b.path, d.bin_id, d.size "
+        "FROM deleted_files d LEFT JOIN recycle_bins b ON b.id = d.bin_id "
+        "WHERE d.dedup_state = 0 ORDER BY d.id LIMIT ?1",
+    // A linked row's bytes are accounted to its blob instead
+    [STMT_MARK_DEDUPED] =
+        "UPDATE deleted_files SET dedup_state = 1, blob_id = ?1, "
+        "size = CASE WHEN ?1 IS NULL THEN size ELSE 0 END WHERE id = ?2 AND dedup_state = 0",
+    [STMT_SELECT_BLOB] =
+        "SELECT id FROM blobs WHERE hash = ?2 AND length = ?3 AND bin_id IS ?1",
+    [STMT_INSERT_BLOB] =
+        "INSERT INTO blobs (bin_id, hash, length, size, refcount) VALUES (?1, ?2, ?3, ?4, 1)",
+    [STMT_REF_BLOB] =
+        "UPDATE blobs SET refcount = refcount + 1 WHERE id = ?1 AND refcount > 0",
+    [STMT_SELECT_UNREFERENCED_BLOBS] =
+        "SELECT o.id, o.hash, o.length, r.path, o.size "
+        "FROM blobs o LEFT JOIN recycle_bins r ON r.id = o.bin_id WHERE o.refcount <= 0",
+    [STMT_DELETE_BLOB] =
+        "DELETE FROM blobs WHERE id = ?1",
+    // Rows the dedup pass may still link are left alone (?2 = dedup enabled)
+    [STMT_SELECT_COLD] =
+        "SELECT d.id, d.recycled_name, b.path "
+        "FROM deleted_files d LEFT JOIN recycle_bins b ON b.id = d.bin_id "
+        "WHERE d.codec IS NULL AND d.delete_timestamp <= ?1 AND d.blob_id IS NULL "
+        "AND (d.dedup_state = 1 OR ?2 = 0) AND lower(d.file_type) NOT IN ("
+        "'.gz', '.tgz', '.bz2', '.xz', '.txz', '.zst', '.lz4', '.br', '.zip', '.7z', '.rar', "
+        "'.jar', '.apk', '.whl', '.deb', '.rpm', '.docx', '.xlsx', '.pptx', '.odt', '.pdf', "
+        "'.jpg', '.jpeg', '.png', '.gif', '.webp', '.heic', '.mp3', '.ogg', '.flac', '.aac', "
+        "'.mp4', '.mkv', '.webm', '.avi', '.mov') "
+        "ORDER BY d.delete_timestamp LIMIT ?3",
+    // Only applies if nothing restored, purged or linked the row meanwhile
+    [STMT_SET_CODEC] =
+        "UPDATE deleted_files SET codec = ?1, recycled_name = COALESCE(?2, recycled_name), "
+        "size = COALESCE(?3, size), dedup_state = 1 "
+        "WHERE id = ?4 AND codec IS NULL AND blob_id IS NULL",
+    [STMT_SELECT_BIN_ROWS] =
+        "SELECT id, recycled_name FROM deleted_files WHERE bin_id IS ?1",
+    // Both check the name so a row renamed meanwhile (compression) survives
+    [STMT_DELETE_BY_NAME] =
+        "DELETE FROM deleted_files WHERE bin_id IS ?1 AND recycled_name = ?2",
+    [STMT_DELETE_BY_ID_NAME] =
+        "DELETE FROM deleted_files WHERE id = ?1 AND recycled_name = ?2",
+    // Reserves ?1 names. All changes happen on the first step, so resetting
+    // after the row is fine.
+    [STMT_RESERVE_NAMES] =
+        "UPDATE name_sequence SET next = next + ?1 WHERE id = 0 RETURNING next - ?1",
+    [STMT_INSERT_MANIFEST] =
+        "INSERT OR REPLACE INTO manifests (file_id, entries, data) VALUES (?1, ?2, ?3)",
+    [STMT_SELECT_MANIFEST] =
+        "SELECT entries, data FROM manifests WHERE file_id = ?1",
+    [STMT_SHRINK_ENTRY] =
+        "UPDATE deleted_files SET size = max(size - ?2, 0) WHERE id = ?1",
+    [STMT_INDEX_LOG_BOUND] =
+        "SELECT max(seq) FROM (SELECT seq FROM path_index_log ORDER BY seq LIMIT ?1)",
+    [STMT_APPLY_INDEX_LOG] =
+        "INSERT INTO path_index (path_index, rowid, original_path) "
+        "SELECT CASE WHEN removed THEN 'delete' END, id, original_path FROM path_index_log "
+        "WHERE seq <= ?1 ORDER BY seq",
+    [STMT_CLEAR_INDEX_LOG] =
+        "DELETE FROM path_index_log WHERE seq <= ?1",
+};
+
+// Reads a byte count such as "500M" or "20G" from the environment; 0 when
+// unset or invalid
+static long long limit_from_env(const char* name) {
+    const char* value = getenv(name);
+    long long bytes = 0;
+    if (value != NULL && *value != '\0' && !parse_size(value, &bytes)) {
+        fprintf(stderr, "Warning: ignoring invalid %s=%s\n", name, value);
+        bytes = 0;
+    }
+    return bytes;
+}
+
+// The policy file from POLICY_ENV or ~/POLICY_FILE, compiled on first use
+static const RetentionPolicy* retention_policy(AutoDeleteSystem* system) {
+    if (!system->policy_loaded) {
+        const char* path = getenv(POLICY_ENV);
+        char* default_path = NULL;
+        if (path == NULL || *path == '\0') {
+            default_path = path_join(system->home_dir, POLICY_FILE);
+            path = default_path;
+        }
+        system->policy = path ? load_policy(path) : NULL;
+        system->policy_loaded = 1;
+        free(default_path);
+    }
+    return system->policy;
+}
+
+// Makes the next delete re-read the policy file
+void reload_policy(AutoDeleteSystem* system) {
+    free_policy(system->policy);
+    system->policy = NULL;
+    system->policy_loaded = 0;
+}
 
 int init_system(AutoDeleteSystem* system) {
+    memset(system, 0, sizeof(*system));
+
     system->home_dir = getenv("HOME");
     if (system->home_dir == NULL) {
         fprintf(stderr, "Error: Cannot determine home directory\n");
@@ -26,21 +183,37 @@ int init_system(AutoDeleteSystem* system) {
     if (system->recycle_bin == NULL) {
         return 0;
     }
+    system->quota_bytes = limit_from_env(QUOTA_ENV);
+    system->min_free_bytes = limit_from_env(MIN_FREE_ENV);
+    system->dedup = getenv(DEDUP_ENV) != NULL && strcmp(getenv(DEDUP_ENV), "1") == 0;
+    const char* compress_after = getenv(COMPRESS_ENV);
+    if (compress_after != NULL && *compress_after != '\0' &&
+        !parse_duration(compress_after, &system->compress_after)) {
+        fprintf(stderr, "Warning: ignoring invalid %s=%s\n", COMPRESS_ENV, compress_after);
+        system->compress_after = 0;
+    }
+    // Masked lines are dropped before they are formatted
+    const char* log_level = getenv(LOG_LEVEL_ENV);
+    int level = DEFAULT_LOG_LEVEL;
+    if (log_level != NULL && *log_level != '\0' && !parse_log_level(log_level, &level)) {
+        fprintf(stderr, "Warning: ignoring invalid %s=%s\n", LOG_LEVEL_ENV, log_level);
+    }
+    setlogmask(LOG_UPTO(level));
     
     if (!create_directory(system->recycle_bin)) {
-        free(system->recycle_bin);
+        cleanup_system(system);
         return 0;
     }
     
     system->db_path = path_join(system->recycle_bin, "tracking.db");
-    if (system->db_path == NULL) {
-        free(system->recycle_bin);
+    system->wakeup_socket = path_join(system->recycle_bin, "wakeup.sock");
+    if (system->db_path == NULL || system->wakeup_socket == NULL) {
+        cleanup_system(system);
         return 0;
     }
     
     if (!init_database(system)) {
-        free(system->recycle_bin);
-        free(system->db_path);
+        cleanup_system(system);
         return 0;
     }
     
@@ -48,467 +221,1936 @@ int init_system(AutoDeleteSystem* system) {
 }
 
 void cleanup_system(AutoDeleteSystem* system) {
+    free_recycle_bins(system);
+    reload_policy(system);
+    for (int i = 0; i < STMT_COUNT; i++) {
+        if (system->stmts[i]) {
+            sqlite3_finalize(system->stmts[i]);
+            system->stmts[i] = NULL;
+        }
+    }
+    if (system->db) {
+        sqlite3_close(system->db);
+        system->db = NULL;
+    }
     if (system->recycle_bin) {
         free(system->recycle_bin);
+        system->recycle_bin = NULL;
     }
     if (system->db_path) {
         free(system->db_path);
+        system->db_path = NULL;
+    }
+    if (system->wakeup_socket) {
+        free(system->wakeup_socket);
+        system->wakeup_socket = NULL;
+    }
+}
+
+static int get_schema_version(sqlite3* db) {
+    sqlite3_stmt* stmt;
+    int version = 0;
+    
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+// Each entry upgrades the schema from version i to version i + 1
+static const char* schema_migrations[SCHEMA_VERSION] = {
+    "CREATE TABLE IF NOT EXISTS deleted_files ("
+    "id INTEGER PRIMARY KEY,"
+    "original_path TEXT,"
+    "delete_timestamp INTEGER,"
+    "scheduled_deletion INTEGER,"
+    "file_type TEXT"
+    ");",
+    
+    // Store the recycle bin name instead of rebuilding it per row, and index
+    // the expiry column so purges are range scans
+    "ALTER TABLE deleted_files ADD COLUMN recycled_name TEXT;"
+    "CREATE INDEX IF NOT EXISTS idx_deleted_files_scheduled "
+    "ON deleted_files(scheduled_deletion);",
+    
+    // Bins at the top of other mounts; rows with a NULL bin_id live in the
+    // home bin
+    "CREATE TABLE IF NOT EXISTS recycle_bins ("
+    "id INTEGER PRIMARY KEY,"
+    "path TEXT UNIQUE,"
+    "mount_point TEXT,"
+    "device INTEGER"
+    ");"
+    "ALTER TABLE deleted_files ADD COLUMN bin_id INTEGER REFERENCES recycle_bins(id);",
+    
+    // Per-row disk usage with a running total kept by triggers, so quota
+    // checks read one row instead of summing the table
+    "ALTER TABLE deleted_files ADD COLUMN size INTEGER NOT NULL DEFAULT 0;"
+    "CREATE INDEX IF NOT EXISTS idx_deleted_files_bin ON deleted_files(bin_id);"
+    "CREATE TABLE IF NOT EXISTS bin_usage ("
+    "id INTEGER PRIMARY KEY CHECK (id = 0),"
+    "total_bytes INTEGER NOT NULL"
+    ");"
+    "INSERT OR IGNORE INTO bin_usage (id, total_bytes) VALUES (0, 0);"
+    "CREATE TRIGGER IF NOT EXISTS deleted_files_usage_insert AFTER INSERT ON deleted_files BEGIN "
+    "UPDATE bin_usage SET total_bytes = total_bytes + NEW.size WHERE id = 0; END;"
+    "CREATE TRIGGER IF NOT EXISTS deleted_files_usage_delete AFTER DELETE ON deleted_files BEGIN "
+    "UPDATE bin_usage SET total_bytes = total_bytes - OLD.size WHERE id = 0; END;"
+    "CREATE TRIGGER IF NOT EXISTS deleted_files_usage_update AFTER UPDATE OF size ON deleted_files BEGIN "
+    "UPDATE bin_usage SET total_bytes = total_bytes + NEW.size - OLD.size WHERE id = 0; END;",
+    
+    // Deduplicated content: rows linked to a blob share its stored copy,
+    // which is reference-counted by trigger as rows go away
+    "CREATE TABLE IF NOT EXISTS blobs ("
+    "id INTEGER PRIMARY KEY,"
+    "bin_id INTEGER REFERENCES recycle_bins(id),"
+    "hash TEXT NOT NULL,"
+    "length INTEGER NOT NULL,"
+    "size INTEGER NOT NULL,"
+    "refcount INTEGER NOT NULL"
+    ");"
+    "CREATE INDEX IF NOT EXISTS idx_blobs_hash ON blobs(hash, length);"
+    "CREATE INDEX IF NOT EXISTS idx_blobs_unreferenced ON blobs(id) WHERE refcount <= 0;"
+    "ALTER TABLE deleted_files ADD COLUMN blob_id INTEGER REFERENCES blobs(id);"
+    "ALTER TABLE deleted_files ADD COLUMN dedup_state INTEGER NOT NULL DEFAULT 0;"
+    "CREATE INDEX IF NOT EXISTS idx_deleted_files_dedup_pending ON deleted_files(id) "
+    "WHERE dedup_state = 0;"
+    "CREATE TRIGGER IF NOT EXISTS deleted_files_unref_blob AFTER DELETE ON deleted_files "
+    "WHEN OLD.blob_id IS NOT NULL BEGIN "
+    "UPDATE blobs SET refcount = refcount - 1 WHERE id = OLD.blob_id; END;"
+    "CREATE TRIGGER IF NOT EXISTS blobs_usage_insert AFTER INSERT ON blobs BEGIN "
+    "UPDATE bin_usage SET total_bytes = total_bytes + NEW.size WHERE id = 0; END;"
+    "CREATE TRIGGER IF NOT EXISTS blobs_usage_delete AFTER DELETE ON blobs BEGIN "
+    "UPDATE bin_usage SET total_bytes = total_bytes - OLD.size WHERE id = 0; END;",
+    
+    // How the recycled copy is stored; NULL until the compression pass
+    // has looked at it
+    "ALTER TABLE deleted_files ADD COLUMN codec TEXT;"
+    "CREATE INDEX IF NOT EXISTS idx_deleted_files_uncompressed "
+    "ON deleted_files(delete_timestamp) WHERE codec IS NULL;",
+    
+    // Lookups by original path (restore --path/--prefix/--glob, list
+    // --path-prefix) become index range scans
+    "CREATE INDEX IF NOT EXISTS idx_deleted_files_original ON deleted_files(original_path);",
+    
+    // Reconciliation looks rows up by the name they have in their bin
+    "CREATE INDEX IF NOT EXISTS idx_deleted_files_recycled "
+    "ON deleted_files(bin_id, recycled_name);",
+    
+    // Entries are named from a counter that never goes back, and spread over
+    // shard directories instead of sitting flat in the bin
+    "CREATE TABLE IF NOT EXISTS name_sequence ("
+    "id INTEGER PRIMARY KEY CHECK (id = 0),"
+    "next INTEGER NOT NULL"
+    ");"
+    "INSERT OR IGNORE INTO name_sequence (id, next) VALUES (0, 1);",
+    
+    // What is inside each recycled directory, so single entries can be
+    // restored out of it (see manifest.c)
+    "CREATE TABLE IF NOT EXISTS manifests ("
+    "file_id INTEGER PRIMARY KEY,"
+    "entries INTEGER NOT NULL,"
+    "data BLOB NOT NULL"
+    ");"
+    "CREATE TRIGGER IF NOT EXISTS deleted_files_drop_manifest AFTER DELETE ON deleted_files BEGIN "
+    "DELETE FROM manifests WHERE file_id = OLD.id; END;",
+    
+    // The trigram path index for search; see create_path_index
+    "",
+};
+
+// Trigram full-text index over original paths for search. It reads the
+// paths from deleted_files rather than storing a second copy. Updating it
+// costs a segment write per transaction, so the triggers only log the
+// change and update_path_index applies the log in batches.
+static const char* path_index_schema =
+    "CREATE VIRTUAL TABLE IF NOT EXISTS path_index USING fts5("
+    "original_path, content='deleted_files', content_rowid='id', tokenize='trigram');"
+    "CREATE TABLE IF NOT EXISTS path_index_log ("
+    "seq INTEGER PRIMARY KEY,"
+    "id INTEGER NOT NULL,"
+    "original_path TEXT,"
+    "removed INTEGER NOT NULL"
+    ");"
+    "CREATE TRIGGER IF NOT EXISTS deleted_files_index_insert AFTER INSERT ON deleted_files BEGIN "
+    "INSERT INTO path_index_log (id, original_path, removed) "
+    "VALUES (NEW.id, NEW.original_path, 0); END;"
+    "CREATE TRIGGER IF NOT EXISTS deleted_files_index_delete AFTER DELETE ON deleted_files BEGIN "
+    "INSERT INTO path_index_log (id, original_path, removed) "
+    "VALUES (OLD.id, OLD.original_path, 1); END;"
+    "CREATE TRIGGER IF NOT EXISTS deleted_files_index_update AFTER UPDATE OF original_path "
+    "ON deleted_files BEGIN "
+    "INSERT INTO path_index_log (id, original_path, removed) "
+    "VALUES (OLD.id, OLD.original_path, 1), (NEW.id, NEW.original_path, 0); END;"
+    "INSERT INTO path_index (path_index) VALUES ('rebuild');";
+
+// Fills recycled_name for rows written before version 2, using the
+// "<delete_timestamp>_<basename>" naming those rows were created with
+static int backfill_recycled_names(sqlite3* db) {
+    sqlite3_stmt* select_stmt;
+    sqlite3_stmt* update_stmt;
+    
+    if (sqlite3_prepare_v2(db, "SELECT id, original_path, delete_timestamp FROM deleted_files "
+                               "WHERE recycled_name IS NULL", -1, &select_stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    if (sqlite3_prepare_v2(db, "UPDATE deleted_files SET recycled_name = ?1 WHERE id = ?2",
+                           -1, &update_stmt, NULL) != SQLITE_OK) {
+        sqlite3_finalize(select_stmt);
+        return 0;
+    }
+    
+    int ok = 1;
+    int rc;
+    while ((rc = sqlite3_step(select_stmt)) == SQLITE_ROW) {
+        int file_id = sqlite3_column_int(select_stmt, 0);
+        const char* original_path = (const char*)sqlite3_column_text(select_stmt, 1);
+        time_t timestamp = (time_t)sqlite3_column_int64(select_stmt, 2);
+        
+        char* filename = get_basename(original_path ? original_path : "");
+        char* recycled_name = filename ? format_string("%ld_%s", timestamp, filename) : NULL;
+        free(filename);
+        if (recycled_name == NULL) {
+            ok = 0;
+            break;
+        }
+        
+        sqlite3_bind_text(update_stmt, 1, recycled_name, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(update_stmt, 2, file_id);
+        rc = sqlite3_step(update_stmt);
+        sqlite3_reset(update_stmt);
+        free(recycled_name);
+        
+        if (rc != SQLITE_DONE) {
+            ok = 0;
+            break;
+        }
+    }
+    if (ok && rc != SQLITE_DONE) {
+        ok = 0;
+    }
+    
+    sqlite3_finalize(select_stmt);
+    sqlite3_finalize(update_stmt);
+    return ok;
+}
+
+// Measures rows recorded before version 4; the usage trigger folds each
+// size into the running total
+static int backfill_sizes(sqlite3* db, const char* home_bin) {
+    sqlite3_stmt* select_stmt;
+    sqlite3_stmt* update_stmt;
+    
+    if (sqlite3_prepare_v2(db, "SELECT d.id, d.recycled_name, b.path FROM deleted_files d "
+                               "LEFT JOIN recycle_bins b ON b.id = d.bin_id",
+                           -1, &select_stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    if (sqlite3_prepare_v2(db, "UPDATE deleted_files SET size = ?1 WHERE id = ?2",
+                           -1, &update_stmt, NULL) != SQLITE_OK) {
+        sqlite3_finalize(select_stmt);
+        return 0;
+    }
+    
+    int ok = 1;
+    int rc;
+    while ((rc = sqlite3_step(select_stmt)) == SQLITE_ROW) {
+        const char* recycled_name = (const char*)sqlite3_column_text(select_stmt, 1);
+        const char* bin_path = (const char*)sqlite3_column_text(select_stmt, 2);
+        char* recycled_path = path_join(bin_path ? bin_path : home_bin,
+                                        recycled_name ? recycled_name : "");
+        if (recycled_path == NULL) {
+            ok = 0;
+            break;
+        }
+        
+        sqlite3_bind_int64(update_stmt, 1, disk_usage(recycled_path));
+        sqlite3_bind_int(update_stmt, 2, sqlite3_column_int(select_stmt, 0));
+        rc = sqlite3_step(update_stmt);
+        sqlite3_reset(update_stmt);
+        free(recycled_path);
+        
+        if (rc != SQLITE_DONE) {
+            ok = 0;
+            break;
+        }
+    }
+    if (ok && rc != SQLITE_DONE) {
+        ok = 0;
+    }
+    
+    sqlite3_finalize(select_stmt);
+    sqlite3_finalize(update_stmt);
+    return ok;
+}
+
+// Moves the flat "<timestamp>_<basename>" entries of older bins to sharded
+// names. Sequence numbers are handed out in row order, so if a crash rolls
+// the migration back after some files moved, the rerun picks the same names
+// and adopts the files already sitting there.
+static int shard_recycled_names(sqlite3* db, const char* home_bin) {
+    sqlite3_stmt* select_stmt;
+    sqlite3_stmt* update_stmt;
+    
+    if (sqlite3_prepare_v2(db, "SELECT d.id, d.recycled_name, b.path FROM deleted_files d "
+                               "LEFT JOIN recycle_bins b ON b.id = d.bin_id "
+                               "WHERE instr(d.recycled_name, '/') = 0 ORDER BY d.id",
+                           -1, &select_stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    if (sqlite3_prepare_v2(db, "UPDATE deleted_files SET recycled_name = ?1 WHERE id = ?2",
+                           -1, &update_stmt, NULL) != SQLITE_OK) {
+        sqlite3_finalize(select_stmt);
+        return 0;
+    }
+    
+    long long seq = 1;
+    int moved = 0;
+    int rc;
+    int ok = 1;
+    while (ok && (rc = sqlite3_step(select_stmt)) == SQLITE_ROW) {
+        const char* old_name = (const char*)sqlite3_column_text(select_stmt, 1);
+        const char* bin_path = (const char*)sqlite3_column_text(select_stmt, 2);
+        char* new_name = shard_recycled_name(seq++);
+        char* old_path = path_join(bin_path ? bin_path : home_bin, old_name ? old_name : "");
+        char* new_path = new_name ? path_join(bin_path ? bin_path : home_bin, new_name) : NULL;
+        if (old_path == NULL || new_path == NULL) {
+            ok = 0;
+        } else {
+            struct stat st;
+            int err = lstat(old_path, &st) == 0 ? move_into_bin(old_path, new_path)
+                    : lstat(new_path, &st) == 0 ? 0 : ENOENT;
+            // Entries that are gone or will not move keep their old name
+            if (err == 0) {
+                sqlite3_bind_text(update_stmt, 1, new_name, -1, SQLITE_STATIC);
+                sqlite3_bind_int64(update_stmt, 2, sqlite3_column_int64(select_stmt, 0));
+                ok = sqlite3_step(update_stmt) == SQLITE_DONE;
+                sqlite3_reset(update_stmt);
+                moved++;
+            } else if (err != ENOENT) {
+                fprintf(stderr, "Warning: could not move %s into a shard: %s\n", old_path,
+                        strerror(err));
+            }
+        }
+        free(new_name);
+        free(old_path);
+        free(new_path);
+    }
+    if (ok && rc != SQLITE_DONE) {
+        ok = 0;
+    }
+    sqlite3_finalize(select_stmt);
+    sqlite3_finalize(update_stmt);
+    
+    if (ok) {
+        char* sql = sqlite3_mprintf("UPDATE name_sequence SET next = %lld WHERE id = 0", seq);
+        ok = sql != NULL && sqlite3_exec(db, sql, 0, 0, NULL) == SQLITE_OK;
+        sqlite3_free(sql);
+    }
+    if (ok && moved > 0) {
+        syslog(LOG_NOTICE, "Moved %d recycled entries into shard directories", moved);
+    }
+    return ok;
+}
+
+// Whether this SQLite has FTS5 and its trigram tokenizer (3.34+)
+static int has_trigram(sqlite3* db) {
+    if (sqlite3_exec(db, "CREATE VIRTUAL TABLE temp.trigram_probe USING fts5(x, tokenize='trigram')",
+                     0, 0, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_exec(db, "DROP TABLE temp.trigram_probe", 0, 0, NULL);
+    return 1;
+}
+
+// Creates the path index if this SQLite can. Without the tokenizer search
+// falls back to LIKE, so that is no error; see create_missing_path_index.
+static int create_path_index(sqlite3* db) {
+    if (!has_trigram(db)) {
+        syslog(LOG_NOTICE, "SQLite lacks the FTS5 trigram tokenizer; search will scan with LIKE");
+        return 1;
+    }
+    return sqlite3_exec(db, path_index_schema, 0, 0, NULL) == SQLITE_OK;
+}
+
+// Brings the database up to SCHEMA_VERSION in one transaction. The version is
+// re-read under the write lock in case another process migrated first.
+static int migrate_schema(AutoDeleteSystem* system) {
+    sqlite3* db = system->db;
+    char* err_msg = NULL;
+    
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return 0;
+    }
+    
+    int version = get_schema_version(db);
+    if (version < 0) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+        return 0;
+    }
+    
+    for (; version < SCHEMA_VERSION; version++) {
+        if (sqlite3_exec(db, schema_migrations[version], 0, 0, &err_msg) != SQLITE_OK) {
+            fprintf(stderr, "SQL error migrating to version %d: %s\n", version + 1, err_msg);
+            sqlite3_free(err_msg);
+            sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+            return 0;
+        }
+        if (version + 1 == 2 && !backfill_recycled_names(db)) {
+            fprintf(stderr, "SQL error migrating to version 2: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+            return 0;
+        }
+        if (version + 1 == 4 && !backfill_sizes(db, system->recycle_bin)) {
+            fprintf(stderr, "SQL error migrating to version 4: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+            return 0;
+        }
+        if (version + 1 == 9 && !shard_recycled_names(db, system->recycle_bin)) {
+            fprintf(stderr, "SQL error migrating to version 9: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+            return 0;
+        }
+        if (version + 1 == 11 && !create_path_index(db)) {
+            fprintf(stderr, "SQL error migrating to version 11: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+            return 0;
+        }
     }
+    
+    char* sql = sqlite3_mprintf("PRAGMA user_version = %d; COMMIT;", SCHEMA_VERSION);
+    int rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Randomized exponential backoff: many writers waiting on one lock wake at
+// scattered times instead of retrying in step. Gives up after BUSY_TIMEOUT_MS.
+static int busy_backoff(void* arg, int attempts) {
+    AutoDeleteSystem* system = arg;
+    double now = monotonic_seconds();
+    if (attempts == 0) {
+        system->busy_since = now;
+    } else if ((now - system->busy_since) * 1000 >= BUSY_TIMEOUT_MS) {
+        return 0;
+    }
+    int shift = attempts < 16 ? attempts : 16;
+    long ceiling = (long)BUSY_BACKOFF_MIN_US << shift;
+    if (ceiling > BUSY_BACKOFF_MAX_US) {
+        ceiling = BUSY_BACKOFF_MAX_US;
+    }
+    usleep(ceiling / 2 + rand_r(&system->busy_seed) % (ceiling / 2 + 1));
+    system->stats.busy_waits++;
+    return 1;
 }
 
 int init_database(AutoDeleteSystem* system) {
-    sqlite3* db;
     char* err_msg = NULL;
     int rc;
     
-    rc = sqlite3_open(system->db_path, &db);
+    rc = sqlite3_open(system->db_path, &system->db);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
+        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(system->db));
+        sqlite3_close(system->db);
+        system->db = NULL;
         return 0;
     }
     
-    // Create table if it doesn't exist
-    const char* sql = "CREATE TABLE IF NOT EXISTS deleted_files ("
-                      "id INTEGER PRIMARY KEY,"
-                      "original_path TEXT,"
-                      "delete_timestamp INTEGER,"
-                      "scheduled_deletion INTEGER,"
-                      "file_type TEXT"
-                      ");";
-    
-    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+    // WAL lets the CLI keep inserting and listing while the daemon purges
+    system->busy_seed = (unsigned)getpid() ^ (unsigned)time(NULL);
+    sqlite3_busy_handler(system->db, busy_backoff, system);
+    rc = sqlite3_exec(system->db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;",
+                      0, 0, &err_msg);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "SQL error: %s\n", err_msg);
         sqlite3_free(err_msg);
-        sqlite3_close(db);
         return 0;
     }
     
-    sqlite3_close(db);
+    // The schema only needs creating once; later opens just read the header
+    int version = get_schema_version(system->db);
+    if (version < 0) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(system->db));
+        return 0;
+    }
+    if (version >= SCHEMA_VERSION) {
+        return 1;
+    }
+    
+    return migrate_schema(system);
+}
+
+sqlite3_stmt* get_statement(AutoDeleteSystem* system, StatementId id) {
+    sqlite3_stmt* stmt = system->stmts[id];
+    
+    if (stmt == NULL) {
+        if (sqlite3_prepare_v3(system->db, statement_sql[id], -1, SQLITE_PREPARE_PERSISTENT,
+                               &stmt, NULL) != SQLITE_OK) {
+            return NULL;
+        }
+        system->stmts[id] = stmt;
+        return stmt;
+    }
+    
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return stmt;
+}
+
+static int step_statement(AutoDeleteSystem* system, StatementId id) {
+    sqlite3_stmt* stmt = get_statement(system, id);
+    if (stmt == NULL) {
+        return 0;
+    }
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE;
+}
+
+// Transactions nest: the outermost begin/commit is a real transaction and
+// each inner level a savepoint, so a caller (e.g. the daemon's group
+// commit) can wrap several delete_files and one failing rolls back only
+// its own rows
+int begin_transaction(AutoDeleteSystem* system) {
+    if (system->transaction_depth > 0) {
+        // The outer transaction is gone if SQLite already rolled it back
+        if (sqlite3_get_autocommit(system->db) || !step_statement(system, STMT_SAVEPOINT)) {
+            return 0;
+        }
+        system->transaction_depth++;
+        return 1;
+    }
+    if (!step_statement(system, STMT_BEGIN)) {
+        return 0;
+    }
+    system->transaction_depth = 1;
     return 1;
 }
 
-char* delete_file(AutoDeleteSystem* system, const char* file_path, int retention_secs) {
-    char* abs_path = get_abs_path(file_path);
-    if (abs_path == NULL) {
-        return format_string("Error: Could not get absolute path for %s", file_path);
+int commit_transaction(AutoDeleteSystem* system) {
+    if (system->transaction_depth > 1) {
+        // On failure the savepoint is still open for rollback_transaction
+        if (!step_statement(system, STMT_RELEASE)) {
+            return 0;
+        }
+        system->transaction_depth--;
+        return 1;
+    }
+    system->transaction_depth = 0;
+    return step_statement(system, STMT_COMMIT);
+}
+
+void rollback_transaction(AutoDeleteSystem* system) {
+    if (system->transaction_depth > 1) {
+        system->transaction_depth--;
+        if (!sqlite3_get_autocommit(system->db)) {
+            step_statement(system, STMT_ROLLBACK_TO);
+            step_statement(system, STMT_RELEASE);
+        }
+        return;
+    }
+    system->transaction_depth = 0;
+    if (!sqlite3_get_autocommit(system->db)) {
+        step_statement(system, STMT_ROLLBACK);
+    }
+}
+
+// One path already moved into its bin, waiting for its row
+typedef struct {
+    char* abs_path;
+    char* recycled_name;
+    char* recycled_path;
+    char* file_type;
+    int bin_id;
+    time_t deleted;
+    long retention;
+    long long size;
+    Manifest manifest;         // Directories only; empty data otherwise
+} StagedEntry;
+
+static void free_staged(StagedEntry* entry) {
+    free(entry->abs_path);
+    free(entry->recycled_name);
+    free(entry->recycled_path);
+    free(entry->file_type);
+    free_manifest(&entry->manifest);
+}
+
+// Deletes staged for one daemon request, waiting for the group's
+// transaction (see staged_batch_record)
+struct StagedBatch {
+    StagedEntry* entries;
+    int count;
+    int capacity;
+    int recorded;              // Rows written in a transaction not yet committed
+    int put_back;              // Files moved back out of the bin
+};
+
+// Puts a staged file back where it came from, for when its row could not
+// be written. Says where it is if even that fails.
+static void unstage(const StagedEntry* entry) {
+    int err = move_path(entry->recycled_path, entry->abs_path);
+    if (err != 0) {
+        fprintf(stderr, "Error: %s could not be put back and is untracked at %s: %s\n",
+                entry->abs_path, entry->recycled_path, strerror(err));
+        syslog(LOG_ERR, "%s could not be put back and is untracked at %s: %s",
+               entry->abs_path, entry->recycled_path, strerror(err));
+    }
+}
+
+// Reserves count consecutive recycled names; the first is returned in *seq
+static int reserve_names(AutoDeleteSystem* system, int count, long long* seq) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_RESERVE_NAMES);
+    if (stmt == NULL) {
+        return 0;
+    }
+    sqlite3_bind_int(stmt, 1, count);
+    int ok = sqlite3_step(stmt) == SQLITE_ROW;
+    if (ok) {
+        *seq = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    return ok;
+}
+
+// Moves one path into its bin under the name for seq, without touching the
+// database, so no lock is held while a cross-device copy runs
+static int stage_path(AutoDeleteSystem* system, const char* file_path, long retention_secs,
+                      long long seq, StagedEntry* entry, char** error) {
+    memset(entry, 0, sizeof(*entry));
+    entry->abs_path = get_abs_path(file_path);
+    if (entry->abs_path == NULL) {
+        *error = format_string("Error: Could not get absolute path for %s", file_path);
+        return 0;
     }
     
     // Check if file exists
     struct stat st;
-    if (stat(abs_path, &st) != 0) {
-        char* result = format_string("Error: File %s does not exist", file_path);
-        free(abs_path);
-        return result;
+    if (stat(entry->abs_path, &st) != 0) {
+        *error = format_string("Error: File %s does not exist", file_path);
+        free_staged(entry);
+        return 0;
+    }
+    
+    if (retention_secs == RETENTION_POLICY) {
+        const RetentionPolicy* policy = retention_policy(system);
+        retention_secs = policy ? policy_retention(policy, entry->abs_path, &st)
+                                : DEFAULT_RETENTION_SECS;
+    }
+    entry->retention = retention_secs;
+    entry->deleted = time(NULL);
+    
+    // Prefer the bin on the file's own mount so the move is a rename
+    const RecycleBin* bin = find_recycle_bin(system, entry->abs_path);
+    entry->bin_id = bin ? bin->id : 0;
+    entry->recycled_name = shard_recycled_name(seq);
+    entry->recycled_path = entry->recycled_name
+        ? path_join(bin ? bin->path : system->recycle_bin, entry->recycled_name) : NULL;
+    entry->file_type = get_extension(entry->abs_path);
+    if (entry->file_type == NULL) {
+        entry->file_type = strdup("");
+    }
+    if (entry->recycled_path == NULL || entry->file_type == NULL) {
+        *error = strdup("Error: Could not create recycled path");
+        free_staged(entry);
+        return 0;
     }
     
-    // Generate unique filename in recycle bin
-    char* filename = get_basename(abs_path);
-    if (filename == NULL) {
-        free(abs_path);
-        return strdup("Error: Could not get basename");
+    int err = move_into_bin(entry->abs_path, entry->recycled_path);
+    if (err != 0) {
+        *error = format_string("Error moving file: %s", strerror(err));
+        free_staged(entry);
+        return 0;
     }
     
-    time_t timestamp = time(NULL);
-    char* unique_name = format_string("%ld_%s", timestamp, filename);
-    free(filename);
+    // Measured in the bin: for a copied file that is the new allocation. A
+    // directory is listed by the same walk; without a manifest it can still
+    // be restored whole.
+    if (S_ISDIR(st.st_mode)) {
+        build_manifest(entry->recycled_path, &entry->manifest, &entry->size);
+    } else {
+        entry->size = disk_usage(entry->recycled_path);
+    }
+    return 1;
+}
+
+static int record_staged(AutoDeleteSystem* system, const StagedEntry* entry) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_INSERT);
+    if (stmt == NULL) {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, entry->abs_path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, entry->deleted);
+    sqlite3_bind_int64(stmt, 3, entry->deleted + entry->retention);
+    sqlite3_bind_text(stmt, 4, entry->file_type, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, entry->recycled_name, -1, SQLITE_STATIC);
+    if (entry->bin_id != 0) {
+        sqlite3_bind_int(stmt, 6, entry->bin_id);
+    } else {
+        sqlite3_bind_null(stmt, 6);
+    }
+    sqlite3_bind_int64(stmt, 7, entry->size);
+    if (entry->manifest.data == NULL) {
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        return rc == SQLITE_DONE;
+    }
     
-    if (unique_name == NULL) {
-        free(abs_path);
-        return strdup("Error: Could not create unique filename");
+    // The row and its manifest go in together
+    if (!begin_transaction(system)) {
+        sqlite3_reset(stmt);
+        return 0;
+    }
+    int ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+    ok = ok && store_manifest(system, (int)sqlite3_last_insert_rowid(system->db), &entry->manifest);
+    if (!ok || !commit_transaction(system)) {
+        rollback_transaction(system);
+        return 0;
+    }
+    return 1;
+}
+
+// Writes the rows for entries[0..count) in one transaction. If that fails
+// the files are moved back rather than left in the bin untracked.
+static int record_entries(AutoDeleteSystem* system, StagedEntry* entries, int count,
+                          char** error) {
+    int began = begin_transaction(system);
+    int ok = began;
+    for (int i = 0; ok && i < count; i++) {
+        ok = record_staged(system, &entries[i]);
+    }
+    if (ok && commit_transaction(system)) {
+        system->stats.files_recycled += count;
+        return 1;
+    }
+    *error = format_string("Error recording deleted files: %s", sqlite3_errmsg(system->db));
+    if (began) {
+        rollback_transaction(system);
+    }
+    for (int i = 0; i < count; i++) {
+        unstage(&entries[i]);
+    }
+    return 0;
+}
+
+// Records staged entries, or hands them to the daemon's batch when it is
+// collecting a group; handed-over entries are left zeroed
+static int finish_staged(AutoDeleteSystem* system, StagedEntry* entries, int count,
+                         char** error) {
+    StagedBatch* batch = system->staging;
+    if (batch == NULL) {
+        return record_entries(system, entries, count, error);
+    }
+    if (batch->count + count > batch->capacity) {
+        int new_capacity = batch->capacity ? batch->capacity : 64;
+        while (new_capacity < batch->count + count) {
+            new_capacity *= 2;
+        }
+        StagedEntry* grown = realloc(batch->entries, new_capacity * sizeof(StagedEntry));
+        if (grown == NULL) {
+            return record_entries(system, entries, count, error);
+        }
+        batch->entries = grown;
+        batch->capacity = new_capacity;
+    }
+    memcpy(batch->entries + batch->count, entries, count * sizeof(StagedEntry));
+    memset(entries, 0, count * sizeof(StagedEntry));
+    batch->count += count;
+    return 1;
+}
+
+StagedBatch* staged_batch_create(void) {
+    return calloc(1, sizeof(StagedBatch));
+}
+
+// Writes the batch's rows. Inside the daemon's group transaction they only
+// become durable with its commit; if that fails, staged_batch_unstage.
+int staged_batch_record(AutoDeleteSystem* system, StagedBatch* batch, char** error) {
+    if (batch->count == 0) {
+        return 1;
+    }
+    batch->recorded = record_entries(system, batch->entries, batch->count, error);
+    batch->put_back = !batch->recorded;
+    return batch->recorded;
+}
+
+// Moves the batch's files back after its rows were rolled back with the
+// group. Returns 0 if they had already been put back (or there were none).
+int staged_batch_unstage(AutoDeleteSystem* system, StagedBatch* batch) {
+    if (batch->put_back || batch->count == 0) {
+        return 0;
+    }
+    for (int i = 0; i < batch->count; i++) {
+        unstage(&batch->entries[i]);
+    }
+    if (batch->recorded) {
+        system->stats.files_recycled -= batch->count;
+    }
+    batch->recorded = 0;
+    batch->put_back = 1;
+    return 1;
+}
+
+void staged_batch_free(StagedBatch* batch) {
+    if (batch == NULL) {
+        return;
+    }
+    for (int i = 0; i < batch->count; i++) {
+        free_staged(&batch->entries[i]);
+    }
+    free(batch->entries);
+    free(batch);
+}
+
+// Moves one path into its bin and records it. RETENTION_POLICY asks the
+// policy file. Returns the retention applied, or -1 with *error set.
+long recycle_path(AutoDeleteSystem* system, const char* file_path, long retention_secs,
+                  char** error) {
+    long long seq;
+    if (!reserve_names(system, 1, &seq)) {
+        *error = format_string("Error allocating a recycled name: %s", sqlite3_errmsg(system->db));
+        return -1;
+    }
+    StagedEntry entry;
+    if (!stage_path(system, file_path, retention_secs, seq, &entry, error)) {
+        return -1;
+    }
+    long applied = entry.retention;
+    int ok = finish_staged(system, &entry, 1, error);
+    free_staged(&entry);
+    return ok ? applied : -1;
+}
+
+char* delete_file(AutoDeleteSystem* system, const char* file_path, int retention_secs) {
+    char* error = NULL;
+    long applied = recycle_path(system, file_path, retention_secs, &error);
+    if (applied < 0) {
+        return error;
     }
+    notify_daemon(system, time(NULL) + applied);
     
-    char* recycled_path = path_join(system->recycle_bin, unique_name);
-    free(unique_name);
+    return format_string("File %s moved to recycle bin. Will be deleted after %ld secs.",
+                         file_path, applied);
+}
+
+// "300" or "300-604800" for a mix of retentions
+static char* retention_range(long shortest, long longest) {
+    if (shortest == longest) {
+        return format_string("%ld", shortest);
+    }
+    return format_string("%ld-%ld", shortest, longest);
+}
+
+// Recycles every path: names are reserved in one statement, the files are
+// moved with no lock held, and the rows go in with one short transaction
+// (the daemon's group one, when it is collecting).
+// If that fails the files are moved back. Per-file errors go to errors;
+// the returned string is a one-line summary.
+char* delete_files(AutoDeleteSystem* system, char** file_paths, int count, int retention_secs,
+                   FILE* errors) {
+    long long seq;
+    if (!reserve_names(system, count, &seq)) {
+        return format_string("Error allocating recycled names: %s", sqlite3_errmsg(system->db));
+    }
+    StagedEntry* staged = malloc(count * sizeof(StagedEntry));
+    if (staged == NULL) {
+        return strdup("Error: Memory allocation failed");
+    }
     
-    if (recycled_path == NULL) {
-        free(abs_path);
-        return strdup("Error: Could not create recycled path");
+    int moved_count = 0;
+    int failed_count = 0;
+    long shortest = LONG_MAX;
+    long longest = 0;
+    
+    for (int i = 0; i < count; i++) {
+        char* error = NULL;
+        if (stage_path(system, file_paths[i], retention_secs, seq + i, &staged[moved_count], &error)) {
+            long applied = staged[moved_count++].retention;
+            shortest = applied < shortest ? applied : shortest;
+            longest = applied > longest ? applied : longest;
+        } else {
+            fprintf(errors, "%s\n", error ? error : "Error: Memory allocation failed");
+            free(error);
+            failed_count++;
+        }
     }
     
-    // Move file to recycle bin
-    if (rename(abs_path, recycled_path) != 0) {
-        char* result = format_string("Error moving file: %s", strerror(errno));
-        free(abs_path);
-        free(recycled_path);
+    char* result = NULL;
+    if (moved_count > 0) {
+        finish_staged(system, staged, moved_count, &result);
+    }
+    for (int i = 0; i < moved_count; i++) {
+        free_staged(&staged[i]);
+    }
+    free(staged);
+    if (result != NULL) {
         return result;
     }
     
-    // Add to database
-    sqlite3* db;
-    int rc = sqlite3_open(system->db_path, &db);
-    if (rc != SQLITE_OK) {
-        free(abs_path);
-        free(recycled_path);
-        return format_string("Error opening database: %s", sqlite3_errmsg(db));
+    if (moved_count == 0) {
+        shortest = longest = retention_secs < 0 ? 0 : retention_secs;
+    } else {
+        notify_daemon(system, time(NULL) + shortest);
+    }
+    
+    char* range = retention_range(shortest, longest);
+    if (failed_count == 0) {
+        result = format_string("Moved %d files to recycle bin. Will be deleted after %s secs.",
+                               moved_count, range ? range : "?");
+    } else {
+        result = format_string("Moved %d files to recycle bin, failed to move %d files. "
+                               "Will be deleted after %s secs.",
+                               moved_count, failed_count, range ? range : "?");
+    }
+    free(range);
+    return result;
+}
+
+void init_list_options(ListOptions* options) {
+    memset(options, 0, sizeof(*options));
+    options->limit = -1;
+    options->expiring_within = -1;
+    options->format = LIST_FORMAT_TABLE;
+}
+
+// Smallest string greater than every string starting with prefix, so a
+// prefix match becomes an index-friendly range. NULL if there is none.
+static char* prefix_upper_bound(const char* prefix) {
+    char* upper = strdup(prefix);
+    if (upper == NULL) {
+        return NULL;
+    }
+    for (size_t len = strlen(upper); len > 0; len--) {
+        unsigned char* last = (unsigned char*)&upper[len - 1];
+        if (*last < 0xff) {
+            (*last)++;
+            upper[len] = '\0';
+            return upper;
+        }
+    }
+    free(upper);
+    return NULL;
+}
+
+static void write_json_string(FILE* out, const char* text) {
+    fputc('"', out);
+    for (const unsigned char* p = (const unsigned char*)text; *p; p++) {
+        switch (*p) {
+            case '"':  fputs("\\\"", out); break;
+            case '\\': fputs("\\\\", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\r': fputs("\\r", out); break;
+            case '\t': fputs("\\t", out); break;
+            default:
+                if (*p < 0x20) {
+                    fprintf(out, "\\u%04x", *p);
+                } else {
+                    fputc(*p, out);
+                }
+        }
+    }
+    fputc('"', out);
+}
+
+static void write_csv_field(FILE* out, const char* text) {
+    if (strpbrk(text, ",\"\r\n") == NULL) {
+        fputs(text, out);
+        return;
+    }
+    fputc('"', out);
+    for (const char* p = text; *p; p++) {
+        if (*p == '"') {
+            fputc('"', out);
+        }
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+// Whether the schema has the path index, which migrating skips when SQLite
+// lacks the trigram tokenizer. Looked up once per process.
+static int has_path_index(AutoDeleteSystem* system) {
+    if (system->path_index == 0) {
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(system->db, "SELECT 1 FROM sqlite_master WHERE name = 'path_index'",
+                               -1, &stmt, NULL) != SQLITE_OK) {
+            return 0;
+        }
+        system->path_index = sqlite3_step(stmt) == SQLITE_ROW ? 1 : -1;
+        sqlite3_finalize(stmt);
+    }
+    return system->path_index > 0;
+}
+
+// A database migrated by a SQLite without the trigram tokenizer has no path
+// index. The daemons call this at startup so it is built once a SQLite
+// with the tokenizer opens the database. Returns 0 on error.
+int create_missing_path_index(AutoDeleteSystem* system) {
+    if (has_path_index(system) || !has_trigram(system->db)) {
+        return 1;
+    }
+    if (!begin_transaction(system)) {
+        return 0;
+    }
+    if (sqlite3_exec(system->db, path_index_schema, 0, 0, NULL) != SQLITE_OK ||
+        !commit_transaction(system)) {
+        syslog(LOG_ERR, "Error creating the path index: %s", sqlite3_errmsg(system->db));
+        rollback_transaction(system);
+        return 0;
+    }
+    system->path_index = 1;
+    syslog(LOG_NOTICE, "Created the trigram path index for search");
+    return 1;
+}
+
+// Terms the path index can answer; the rest are checked with LIKE
+static int indexed_term(AutoDeleteSystem* system, const char* term) {
+    return strlen(term) >= SEARCH_MIN_TERM && has_path_index(system);
+}
+
+// Applies up to max_rows (< 0 for all) logged changes to the path index,
+// oldest first, in one transaction. Returns 1 while more are pending, 0
+// when the index is current, -1 on error.
+int update_path_index(AutoDeleteSystem* system, int max_rows) {
+    if (!has_path_index(system)) {
+        return 0;
+    }
+    sqlite3_stmt* bound_stmt = get_statement(system, STMT_INDEX_LOG_BOUND);
+    sqlite3_stmt* apply_stmt = get_statement(system, STMT_APPLY_INDEX_LOG);
+    sqlite3_stmt* clear_stmt = get_statement(system, STMT_CLEAR_INDEX_LOG);
+    if (bound_stmt == NULL || apply_stmt == NULL || clear_stmt == NULL ||
+        !begin_transaction(system)) {
+        return -1;
+    }
+    
+    sqlite3_bind_int(bound_stmt, 1, max_rows);
+    int ok = sqlite3_step(bound_stmt) == SQLITE_ROW;
+    sqlite3_int64 last = ok ? sqlite3_column_int64(bound_stmt, 0) : 0;
+    int empty = ok && sqlite3_column_type(bound_stmt, 0) == SQLITE_NULL;
+    sqlite3_reset(bound_stmt);
+    if (ok && !empty) {
+        sqlite3_bind_int64(apply_stmt, 1, last);
+        ok = sqlite3_step(apply_stmt) == SQLITE_DONE;
+        sqlite3_reset(apply_stmt);
+    }
+    int cleared = 0;
+    if (ok && !empty) {
+        sqlite3_bind_int64(clear_stmt, 1, last);
+        ok = sqlite3_step(clear_stmt) == SQLITE_DONE;
+        cleared = sqlite3_changes(system->db);
+        sqlite3_reset(clear_stmt);
+    }
+    if (!ok || !commit_transaction(system)) {
+        syslog(LOG_ERR, "Error updating the path index: %s", sqlite3_errmsg(system->db));
+        rollback_transaction(system);
+        return -1;
+    }
+    return cleared > 0 && cleared == max_rows;
+}
+
+// FTS5 query matching paths that contain every indexed search term, each
+// quoted as a phrase; NULL if there are none
+static char* search_expression(AutoDeleteSystem* system, const ListOptions* options) {
+    sqlite3_str* query = sqlite3_str_new(NULL);
+    for (int i = 0; i < options->term_count; i++) {
+        const char* term = options->terms[i];
+        if (!indexed_term(system, term)) {
+            continue;
+        }
+        sqlite3_str_appendall(query, sqlite3_str_length(query) ? " \"" : "\"");
+        for (const char* p = term; *p; p++) {
+            sqlite3_str_appendchar(query, *p == '"' ? 2 : 1, *p);
+        }
+        sqlite3_str_appendchar(query, 1, '"');
+    }
+    return sqlite3_str_finish(query);
+}
+
+// "%term%" for LIKE, with the wildcards in term escaped by '\'
+static char* like_pattern(const char* term) {
+    char* pattern = malloc(strlen(term) * 2 + 3);
+    if (pattern == NULL) {
+        return NULL;
+    }
+    char* out = pattern;
+    *out++ = '%';
+    for (const char* p = term; *p; p++) {
+        if (*p == '%' || *p == '_' || *p == '\\') {
+            *out++ = '\\';
+        }
+        *out++ = *p;
+    }
+    *out++ = '%';
+    *out = '\0';
+    return pattern;
+}
+
+// Streams matching rows to out in a single pass. Returns NULL when rows were
+// written, otherwise a message for the caller to print. With search terms
+// the trigram index finds the rows and ranks them; terms too short for it,
+// or all of them when there is no index, are checked with LIKE. Rows whose
+// changes the daemon has not applied to the index yet are checked with LIKE
+// too, and come first, so searching never has to write.
+char* list_recycled(AutoDeleteSystem* system, const ListOptions* options, FILE* out) {
+    char* upper = NULL;
+    if (options->path_prefix != NULL && options->path_prefix[0] != '\0') {
+        upper = prefix_upper_bound(options->path_prefix);
+    }
+    char* match = search_expression(system, options);
+    
+    // Short terms filter every row; the indexed ones only the unindexed tail
+    sqlite3_str* short_terms = sqlite3_str_new(NULL);
+    sqlite3_str* tail_terms = sqlite3_str_new(NULL);
+    for (int i = 0; i < options->term_count; i++) {
+        sqlite3_str_appendf(indexed_term(system, options->terms[i]) ? tail_terms : short_terms,
+                            "AND d.original_path LIKE ?%d ESCAPE '\\' ", 8 + i);
+    }
+    char* like_sql = sqlite3_str_finish(short_terms);
+    char* tail_sql = sqlite3_str_finish(tail_terms);
+    char* filters = sqlite3_mprintf(
+        "d.delete_timestamp >= ?1 AND d.scheduled_deletion <= ?2 %s%s%s",
+        options->path_prefix ? "AND d.original_path >= ?3 " : "",
+        upper ? "AND d.original_path < ?4 " : "",
+        like_sql ? like_sql : "");
+    sqlite3_free(like_sql);
+    
+    char* sql = NULL;
+    if (filters != NULL && match != NULL) {
+        sql = sqlite3_mprintf(
+            "SELECT d.id, d.original_path, d.delete_timestamp, d.scheduled_deletion, "
+            "path_index.rank AS score "
+            "FROM path_index JOIN deleted_files d ON d.id = path_index.rowid "
+            "WHERE path_index MATCH ?7 AND d.id NOT IN (SELECT id FROM path_index_log) AND %s"
+            "UNION ALL "
+            "SELECT d.id, d.original_path, d.delete_timestamp, d.scheduled_deletion, NULL "
+            "FROM deleted_files d WHERE d.id IN (SELECT id FROM path_index_log) AND %s%s"
+            "ORDER BY score, id DESC LIMIT ?5 OFFSET ?6",
+            filters, filters, tail_sql ? tail_sql : "");
+    } else if (filters != NULL) {
+        sql = sqlite3_mprintf(
+            "SELECT d.id, d.original_path, d.delete_timestamp, d.scheduled_deletion "
+            "FROM deleted_files d WHERE %sORDER BY %s LIMIT ?5 OFFSET ?6",
+            filters, options->term_count > 0 ? "d.id DESC" : "d.id");
+    }
+    sqlite3_free(tail_sql);
+    sqlite3_free(filters);
+    if (sql == NULL) {
+        free(upper);
+        sqlite3_free(match);
+        return strdup("Error: Memory allocation failed");
+    }
+    
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(system->db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        free(upper);
+        sqlite3_free(match);
+        return format_string("Error preparing SQL: %s", sqlite3_errmsg(system->db));
+    }
+    if (match != NULL) {
+        sqlite3_bind_text(stmt, 7, match, -1, sqlite3_free);
+    }
+    for (int i = 0; i < options->term_count; i++) {
+        sqlite3_bind_text(stmt, 8 + i, like_pattern(options->terms[i]), -1, free);
+    }
+    
+    sqlite3_int64 latest = options->expiring_within >= 0
+        ? (sqlite3_int64)wall_clock_now() + options->expiring_within
+        : INT64_MAX;
+    sqlite3_bind_int64(stmt, 1, options->since);
+    sqlite3_bind_int64(stmt, 2, latest);
+    if (options->path_prefix) {
+        sqlite3_bind_text(stmt, 3, options->path_prefix, -1, SQLITE_STATIC);
+    }
+    if (upper) {
+        sqlite3_bind_text(stmt, 4, upper, -1, SQLITE_STATIC);
+    }
+    sqlite3_bind_int64(stmt, 5, options->limit);
+    sqlite3_bind_int64(stmt, 6, options->offset);
+    
+    long row_count = 0;
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int id = sqlite3_column_int(stmt, 0);
+        const char* path = (const char*)sqlite3_column_text(stmt, 1);
+        time_t del_time = (time_t)sqlite3_column_int64(stmt, 2);
+        time_t sched_time = (time_t)sqlite3_column_int64(stmt, 3);
+        if (path == NULL) {
+            path = "";
+        }
+        
+        switch (options->format) {
+            case LIST_FORMAT_TABLE: {
+                if (row_count == 0) {
+                    fputs("ID | Original Path | Deleted On | Scheduled Deletion\n", out);
+                    fputs("------------------------------------------------------------\n", out);
+                }
+                
+                char del_date[20], sched_date[20];
+                struct tm tm_info;
+                
+                localtime_r(&del_time, &tm_info);
+                strftime(del_date, sizeof(del_date), "%Y-%m-%d %H:%M", &tm_info);
+                
+                localtime_r(&sched_time, &tm_info);
+                strftime(sched_date, sizeof(sched_date), "%Y-%m-%d %H:%M", &tm_info);
+                
+                fprintf(out, "%d | %s | %s | %s\n", id, path, del_date, sched_date);
+                break;
+            }
+            case LIST_FORMAT_JSON:
+                fputs(row_count == 0 ? "[\n" : ",\n", out);
+                fprintf(out, "{\"id\":%d,\"original_path\":", id);
+                write_json_string(out, path);
+                fprintf(out, ",\"delete_timestamp\":%ld,\"scheduled_deletion\":%ld}",
+                        (long)del_time, (long)sched_time);
+                break;
+            case LIST_FORMAT_CSV:
+                if (row_count == 0) {
+                    fputs("id,original_path,delete_timestamp,scheduled_deletion\n", out);
+                }
+                fprintf(out, "%d,", id);
+                write_csv_field(out, path);
+                fprintf(out, ",%ld,%ld\n", (long)del_time, (long)sched_time);
+                break;
+            case LIST_FORMAT_NUL:
+                fprintf(out, "%d\t%s", id, path);
+                fputc('\0', out);
+                break;
+            case LIST_FORMAT_IDS:
+                fprintf(out, "%d\n", id);
+                break;
+        }
+        row_count++;
+    }
+    
+    sqlite3_finalize(stmt);
+    free(upper);
+    
+    if (rc != SQLITE_DONE) {
+        return format_string("Error reading recycle bin: %s", sqlite3_errmsg(system->db));
+    }
+    
+    if (options->format == LIST_FORMAT_JSON) {
+        fputs(row_count == 0 ? "[]\n" : "\n]\n", out);
+    } else if (row_count == 0 && options->format == LIST_FORMAT_TABLE) {
+        return strdup(options->term_count > 0 ? "No matching files in recycle bin"
+                                              : "No files in recycle bin");
+    }
+    
+    fflush(out);
+    return NULL;
+}
+
+// Makes a path given on the command line absolute without resolving it;
+// the file is in the recycle bin, so realpath cannot be used
+static char* absolute_original(const char* path) {
+    char* result;
+    if (path[0] == '/') {
+        result = strdup(path);
+    } else {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            return NULL;
+        }
+        result = path_join(cwd, path[0] == '.' && path[1] == '/' ? path + 2 : path);
+    }
+    
+    size_t len = result ? strlen(result) : 0;
+    while (len > 1 && result[len - 1] == '/') {
+        result[--len] = '\0';
+    }
+    return result;
+}
+
+// Restores every row matching options (see restore_ids). Per-file
+// messages go to out and errors; the returned string is a summary.
+char* restore_matching(AutoDeleteSystem* system, const RestoreOptions* options, FILE* out,
+                       FILE* errors) {
+    const char* pattern = options->path ? options->path
+                        : options->prefix ? options->prefix : options->glob;
+    char* target = absolute_original(pattern);
+    if (target == NULL) {
+        return strdup("Error: Could not resolve path");
+    }
+    
+    // Each form becomes a range on idx_deleted_files_original: the exact
+    // path, "<dir>/" up to its successor, or the glob's literal prefix
+    char* lower = NULL;
+    char* upper = NULL;
+    if (options->prefix) {
+        lower = strcmp(target, "/") == 0 ? strdup("/") : format_string("%s/", target);
+    } else if (options->glob) {
+        lower = strndup(target, strcspn(target, "*?["));
+    }
+    if (lower != NULL && lower[0] != '\0') {
+        upper = prefix_upper_bound(lower);
+    }
+    
+    char* sql = sqlite3_mprintf(
+        "SELECT d.id FROM deleted_files d WHERE d.delete_timestamp >= ?1 AND (%s) %s "
+        "ORDER BY d.id DESC",
+        options->path ? "d.original_path = ?2"
+        : options->prefix ? "d.original_path = ?2 OR (d.original_path >= ?3 AND d.original_path < ?4)"
+        : upper ? "d.original_path >= ?3 AND d.original_path < ?4 AND d.original_path GLOB ?2"
+        : "d.original_path GLOB ?2",
+        options->latest ? "AND d.id = (SELECT MAX(id) FROM deleted_files "
+                          "WHERE original_path = d.original_path)" : "");
+    
+    sqlite3_stmt* stmt = NULL;
+    int rc = sql ? sqlite3_prepare_v2(system->db, sql, -1, &stmt, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        free(target);
+        free(lower);
+        free(upper);
+        return format_string("Error preparing SQL: %s", sqlite3_errmsg(system->db));
+    }
+    
+    sqlite3_bind_int64(stmt, 1, options->since);
+    sqlite3_bind_text(stmt, 2, target, -1, SQLITE_STATIC);
+    if (lower != NULL) {
+        sqlite3_bind_text(stmt, 3, lower, -1, SQLITE_STATIC);
+        if (upper != NULL) {
+            sqlite3_bind_text(stmt, 4, upper, -1, SQLITE_STATIC);
+        } else {
+            sqlite3_bind_zeroblob(stmt, 4, 0);  // Every text value sorts below a blob
+        }
+    }
+    
+    // Collect ids first so no read cursor is open while rows are deleted
+    int capacity = 0;
+    int count = 0;
+    int* ids = NULL;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            int* grown = realloc(ids, capacity * sizeof(int));
+            if (grown == NULL) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            ids = grown;
+        }
+        ids[count++] = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    free(target);
+    free(lower);
+    free(upper);
+    
+    if (rc != SQLITE_DONE) {
+        free(ids);
+        return format_string("Error reading recycle bin: %s", sqlite3_errmsg(system->db));
+    }
+    if (count == 0) {
+        free(ids);
+        return format_string("Error: Nothing in the recycle bin matches %s", pattern);
+    }
+    
+    char* result = restore_ids(system, ids, count, out, errors);
+    free(ids);
+    return result;
+}
+
+// A row being removed by purge or eviction
+typedef struct {
+    int id;
+    time_t scheduled_deletion;
+    long long size;
+    char* recycled_path;
+    int is_tree;
+    int tree_status;
+} BinEntry;
+
+// Reads the next page of expired rows after (last_scheduled, last_id), in
+// idx_deleted_files_scheduled order. Returns the number of
+// entries filled, or -1 on error.
+static int fetch_expired_page(AutoDeleteSystem* system, time_t current_time,
+                              time_t last_scheduled, int last_id, int limit,
+                              BinEntry* entries, int* failed_count) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_EXPIRED);
+    if (stmt == NULL) {
+        return -1;
+    }
+    sqlite3_bind_int64(stmt, 1, current_time);
+    sqlite3_bind_int64(stmt, 2, last_scheduled);
+    sqlite3_bind_int(stmt, 3, last_id);
+    sqlite3_bind_int(stmt, 4, limit);
+    
+    int count = 0;
+    int rc;
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int file_id = sqlite3_column_int(stmt, 0);
+        const char* recycled_name = (const char*)sqlite3_column_text(stmt, 1);
+        const char* original_path = (const char*)sqlite3_column_text(stmt, 2);
+        time_t scheduled_time = (time_t)sqlite3_column_int64(stmt, 3);
+        
+        syslog(LOG_DEBUG, "Found expired file: ID=%d, Path=%s, Scheduled=%ld (now=%ld)", 
+               file_id, original_path, scheduled_time, current_time);
+        
+        entries[count].id = file_id;
+        entries[count].scheduled_deletion = scheduled_time;
+        entries[count].size = sqlite3_column_int64(stmt, 5);
+        entries[count].is_tree = 0;
+        const char* bin_path = (const char*)sqlite3_column_text(stmt, 4);
+        entries[count].recycled_path = recycled_location(system, bin_path, recycled_name);
+        if (entries[count].recycled_path == NULL) {
+            syslog(LOG_ERR, "Failed to join paths");
+            (*failed_count)++;
+        }
+        count++;
+    }
+    
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? count : -1;
+}
+
+// Removes the rows for ids[0..count) in one transaction
+int delete_rows(AutoDeleteSystem* system, const int* ids, int count) {
+    if (count == 0) {
+        return 1;
+    }
+    if (!begin_transaction(system)) {
+        return 0;
+    }
+    
+    sqlite3_stmt* stmt = get_statement(system, STMT_DELETE_BY_ID);
+    if (stmt == NULL) {
+        rollback_transaction(system);
+        return 0;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        sqlite3_bind_int(stmt, 1, ids[i]);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            sqlite3_reset(stmt);
+            rollback_transaction(system);
+            return 0;
+        }
+        sqlite3_reset(stmt);
+    }
+    
+    if (!commit_transaction(system)) {
+        rollback_transaction(system);
+        return 0;
+    }
+    return 1;
+}
+
+// Deletes the recycled files behind entries[0..count), sending directories
+// to the removal pool (created on first use) and large files to reclaimer,
+// if there is one. Ids of entries that are gone (or going) afterwards go to
+// removed_ids and their sizes to *freed_bytes. Returns how many were removed.
+static int remove_entries(BinEntry* entries, int count, ReclaimWorker* reclaimer, RemovePool** pool,
+                          int* removed_ids, int* failed_count, long long* freed_bytes) {
+    int removed = 0;
+    int has_trees = 0;
+    
+    for (int i = 0; i < count; i++) {
+        const char* recycled_path = entries[i].recycled_path;
+        if (recycled_path == NULL) {
+            continue;
+        }
+        
+        syslog(LOG_DEBUG, "Attempting to delete: %s", recycled_path);
+        
+        if (reclaimer != NULL && entries[i].size >= RECLAIM_MIN_BYTES &&
+            reclaim_submit(reclaimer, recycled_path)) {
+            syslog(LOG_DEBUG, "Queued for incremental removal: %s", recycled_path);
+            removed_ids[removed++] = entries[i].id;
+            *freed_bytes += entries[i].size;
+        } else if (unlink(recycled_path) == 0) {
+            syslog(LOG_DEBUG, "Successfully deleted file: %s", recycled_path);
+            removed_ids[removed++] = entries[i].id;
+            *freed_bytes += entries[i].size;
+        } else if (errno == EISDIR) {
+            // Trashed directory: hand the tree to the removal pool
+            if (*pool == NULL) {
+                *pool = remove_pool_create(0);
+            }
+            if (*pool == NULL || !remove_pool_submit(*pool, recycled_path, &entries[i].tree_status)) {
+                syslog(LOG_ERR, "Failed to queue directory %s for removal", recycled_path);
+                (*failed_count)++;
+                continue;
+            }
+            entries[i].is_tree = 1;
+            has_trees = 1;
+        } else if (errno == ENOENT) {
+            syslog(LOG_INFO, "File doesn't exist, removing from DB: %s", recycled_path);
+            removed_ids[removed++] = entries[i].id;
+        } else {
+            syslog(LOG_ERR, "Failed to delete %s: %s", recycled_path, strerror(errno));
+            (*failed_count)++;
+        }
+    }
+    
+    if (has_trees) {
+        remove_pool_wait(*pool);
+        for (int i = 0; i < count; i++) {
+            if (!entries[i].is_tree) {
+                continue;
+            }
+            if (entries[i].tree_status == 0 || entries[i].tree_status == ENOENT) {
+                syslog(LOG_DEBUG, "Successfully deleted directory: %s", entries[i].recycled_path);
+                removed_ids[removed++] = entries[i].id;
+                *freed_bytes += entries[i].size;
+            } else {
+                syslog(LOG_ERR, "Failed to delete directory %s: %s",
+                       entries[i].recycled_path, strerror(entries[i].tree_status));
+                (*failed_count)++;
+            }
+        }
     }
     
-    char* file_type = get_extension(abs_path);
-    if (file_type == NULL) {
-        file_type = strdup("");
+    return removed;
+}
+
+// Reads the budget from PURGE_FILES_RATE_ENV, PURGE_BYTES_RATE_ENV and
+// IO_PRESSURE_ENV, starting with a full bucket
+void init_purge_budget(AutoDeleteSystem* system) {
+    PurgeBudget* budget = &system->budget;
+    memset(budget, 0, sizeof(*budget));
+    const char* files = getenv(PURGE_FILES_RATE_ENV);
+    budget->files_per_sec = files != NULL && atof(files) > 0 ? atof(files) : 0;
+    budget->bytes_per_sec = (double)limit_from_env(PURGE_BYTES_RATE_ENV);
+    const char* pressure = getenv(IO_PRESSURE_ENV);
+    budget->pressure_limit = pressure != NULL ? atof(pressure) : DEFAULT_IO_PRESSURE;
+    budget->files = budget->files_per_sec * PURGE_BURST_SECS;
+    budget->bytes = budget->bytes_per_sec * PURGE_BURST_SECS;
+    budget->refilled = monotonic_seconds();
+}
+
+// "some avg10" from the kernel's I/O pressure file, or -1 without PSI
+static double io_pressure(void) {
+    FILE* file = fopen(IO_PRESSURE_FILE, "r");
+    if (file == NULL) {
+        return -1;
     }
-    
-    time_t scheduled_deletion = timestamp + retention_secs;
-    
-    char* sql = sqlite3_mprintf(
-        "INSERT INTO deleted_files (original_path, delete_timestamp, scheduled_deletion, file_type) "
-        "VALUES ('%q', %ld, %ld, '%q')",
-        abs_path, timestamp, scheduled_deletion, file_type
-    );
-    
-    char* err_msg = NULL;
-    rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
-    sqlite3_free(sql);
-    free(file_type);
-    
-    if (rc != SQLITE_OK) {
-        char* result = format_string("Error adding to database: %s", err_msg);
-        sqlite3_free(err_msg);
-        sqlite3_close(db);
-        free(abs_path);
-        free(recycled_path);
-        return result;
+    double avg10 = -1;
+    if (fscanf(file, "some avg10=%lf", &avg10) != 1) {
+        avg10 = -1;
     }
-    
-    sqlite3_close(db);
-    free(recycled_path);
-    
-    char* result = format_string("File %s moved to recycle bin. Will be deleted after %d secs.",
-                                file_path, retention_secs);
-    free(abs_path);
-    return result;
+    fclose(file);
+    return avg10;
 }
 
-char* list_recycled(AutoDeleteSystem* system) {
-    sqlite3* db;
-    int rc = sqlite3_open(system->db_path, &db);
-    if (rc != SQLITE_OK) {
-        return format_string("Error opening database: %s", sqlite3_errmsg(db));
+// Files the budget allows now, up to PURGE_BATCH_SIZE. Returns 0 after
+// setting budget->resume_at when the purge has to wait.
+static int purge_allowance(PurgeBudget* budget) {
+    double now = monotonic_seconds();
+    double elapsed = now - budget->refilled;
+    budget->refilled = now;
+    if (budget->files_per_sec > 0) {
+        budget->files += elapsed * budget->files_per_sec;
+        if (budget->files > budget->files_per_sec * PURGE_BURST_SECS) {
+            budget->files = budget->files_per_sec * PURGE_BURST_SECS;
+        }
     }
-    
-    const char* sql = "SELECT id, original_path, delete_timestamp, scheduled_deletion "
-                     "FROM deleted_files";
-    
-    sqlite3_stmt* stmt;
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
-        return format_string("Error preparing SQL: %s", sqlite3_errmsg(db));
+    if (budget->bytes_per_sec > 0) {
+        budget->bytes += elapsed * budget->bytes_per_sec;
+        if (budget->bytes > budget->bytes_per_sec * PURGE_BURST_SECS) {
+            budget->bytes = budget->bytes_per_sec * PURGE_BURST_SECS;
+        }
     }
-    
-    int row_count = 0;
-    size_t estimated_size = 100; 
-    
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        row_count++;
-        estimated_size += strlen((const char*)sqlite3_column_text(stmt, 1)) + 100; 
+
+    double wait = 0;
+    if (budget->files_per_sec > 0 && budget->files < 1) {
+        wait = (1 - budget->files) / budget->files_per_sec;
     }
-    
-    sqlite3_reset(stmt);
-    
-    if (row_count == 0) {
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return strdup("No files in recycle bin");
+    if (budget->bytes_per_sec > 0 && budget->bytes <= 0) {
+        double bytes_wait = (1 - budget->bytes) / budget->bytes_per_sec;
+        wait = bytes_wait > wait ? bytes_wait : wait;
     }
-    
-    // Allocate buffer for the result
-    char* result = (char*)malloc(estimated_size);
-    if (result == NULL) {
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
+    if (wait == 0 && budget->pressure_limit > 0 && io_pressure() >= budget->pressure_limit) {
+        wait = PRESSURE_BACKOFF_SECS;
+    }
+    if (wait > 0) {
+        budget->resume_at = wall_clock_now() + (time_t)wait + 1;
+        return 0;
+    }
+    if (budget->files_per_sec > 0 && budget->files < PURGE_BATCH_SIZE) {
+        return (int)budget->files;
+    }
+    return PURGE_BATCH_SIZE;
+}
+
+// How many of entries[0..count) fit the bytes left in the budget; always at
+// least one, so a file larger than the whole bucket still goes (into debt)
+static int within_byte_budget(const PurgeBudget* budget, const BinEntry* entries, int count) {
+    if (budget->bytes_per_sec <= 0) {
+        return count;
+    }
+    double bytes = 0;
+    int take = 0;
+    while (take < count && (take == 0 || bytes + entries[take].size <= budget->bytes)) {
+        bytes += entries[take].size;
+        take++;
+    }
+    return take;
+}
+
+// Purges every expired row; with a budget, only what it allows now, the
+// rest being left for budget->resume_at. NULL purges at full speed.
+char* purge_expired(AutoDeleteSystem* system, PurgeBudget* budget) {
+    time_t current_time = wall_clock_now();
+    double started = monotonic_seconds();
+    syslog(LOG_DEBUG, "Current time: %ld", current_time);
+    
+    BinEntry* entries = malloc(PURGE_BATCH_SIZE * sizeof(BinEntry));
+    int* purged_ids = malloc(PURGE_BATCH_SIZE * sizeof(int));
+    if (entries == NULL || purged_ids == NULL) {
+        free(entries);
+        free(purged_ids);
         return strdup("Error: Memory allocation failed");
     }
     
-    // Create header
-    strcpy(result, "ID | Original Path | Deleted On | Scheduled Deletion\n");
-    strcat(result, "------------------------------------------------------------\n");
-    
-    size_t pos = strlen(result);
+    int purged_count = 0;
+    int failed_count = 0;
+    long long freed_total = 0;
+    RemovePool* pool = NULL;
+    time_t last_scheduled = LONG_MIN;
+    int last_id = 0;
+    char* error = NULL;
+    
+    PurgeBudget unlimited = {0};
+    if (budget == NULL) {
+        budget = &unlimited;
+    }
+    budget->resume_at = 0;
     
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        int id = sqlite3_column_int(stmt, 0);
-        const char* path = (const char*)sqlite3_column_text(stmt, 1);
-        time_t del_time = (time_t)sqlite3_column_int64(stmt, 2);
-        time_t sched_time = (time_t)sqlite3_column_int64(stmt, 3);
-        
-        char del_date[20], sched_date[20];
-        struct tm* tm_info;
-        
-        tm_info = localtime(&del_time);
-        strftime(del_date, sizeof(del_date), "%Y-%m-%d %H:%M", tm_info);
+    // Page through expired rows by (scheduled_deletion, id) so no read cursor stays open while the
+    // batch of deletes for the previous page is committed
+    for (;;) {
+        int limit = purge_allowance(budget);
+        if (limit == 0) {
+            break;
+        }
+        int count = fetch_expired_page(system, current_time, last_scheduled, last_id, limit,
+                                       entries, &failed_count);
+        if (count < 0) {
+            syslog(LOG_ERR, "Error reading expired files: %s", sqlite3_errmsg(system->db));
+            error = format_string("Error reading expired files: %s", sqlite3_errmsg(system->db));
+            break;
+        }
+        if (count == 0) {
+            break;
+        }
         
-        tm_info = localtime(&sched_time);
-        strftime(sched_date, sizeof(sched_date), "%Y-%m-%d %H:%M", tm_info);
+        // Rows past the byte budget are left for the next page
+        int take = within_byte_budget(budget, entries, count);
+        long long freed_bytes = 0;
+        int purged_in_batch = remove_entries(entries, take, system->reclaimer, &pool, purged_ids,
+                                             &failed_count, &freed_bytes);
         
-        int written = snprintf(result + pos, estimated_size - pos, 
-                              "%d | %s | %s | %s\n", 
-                              id, path, del_date, sched_date);
+        last_scheduled = entries[take - 1].scheduled_deletion;
+        last_id = entries[take - 1].id;
+        for (int i = 0; i < count; i++) {
+            if (i < take) {
+                budget->bytes -= entries[i].size;
+            }
+            free(entries[i].recycled_path);
+        }
+        budget->files -= take;
         
-        if (written < 0 || written >= estimated_size - pos) {
-            strcat(result, "... (truncated)");
+        if (!delete_rows(system, purged_ids, purged_in_batch)) {
+            syslog(LOG_ERR, "Error removing purged rows: %s", sqlite3_errmsg(system->db));
+            error = format_string("Error removing purged rows: %s", sqlite3_errmsg(system->db));
             break;
         }
+        purged_count += purged_in_batch;
+        freed_total += freed_bytes;
         
-        pos += written;
-    }
-    
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
-    
-    return result;
-}
-
-char* restore_file(AutoDeleteSystem* system, int file_id) {
-    sqlite3* db;
-    int rc = sqlite3_open(system->db_path, &db);
-    if (rc != SQLITE_OK) {
-        return format_string("Error opening database: %s", sqlite3_errmsg(db));
-    }
-    
-    char* sql = sqlite3_mprintf(
-        "SELECT original_path, delete_timestamp FROM deleted_files WHERE id = %d",
-        file_id
-    );
-    
-    sqlite3_stmt* stmt;
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    sqlite3_free(sql);
-    
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
-        return format_string("Error preparing SQL: %s", sqlite3_errmsg(db));
+        if (take == count && count < limit) {
+            break;
+        }
     }
     
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW) {
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return format_string("Error: No file with ID %d in recycle bin", file_id);
-    }
+    remove_pool_destroy(pool);
+    free(entries);
+    free(purged_ids);
+    freed_total += collect_blobs(system);
     
-    const char* original_path = (const char*)sqlite3_column_text(stmt, 0);
-    time_t timestamp = (time_t)sqlite3_column_int64(stmt, 1);
+    EngineStats* stats = &system->stats;
+    stats->purge_runs++;
+    stats->files_purged += purged_count;
+    stats->bytes_purged += freed_total;
+    stats->purge_failures += failed_count;
+    record_purge_latency(stats, monotonic_seconds() - started);
     
-    char* original_path_copy = strdup(original_path);
-    if (original_path_copy == NULL) {
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return strdup("Error: Memory allocation failed");
+    if (error != NULL) {
+        return error;
     }
-    
-    char* filename = get_basename(original_path_copy);
-    if (filename == NULL) {
-        free(original_path_copy);
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return strdup("Error: Could not get basename");
+    if (budget->resume_at != 0) {
+        stats->purge_deferrals++;
+        return format_string("Purged %d expired files, failed to purge %d files, "
+                             "deferring the rest for %ld secs (I/O budget or pressure)",
+                             purged_count, failed_count, (long)(budget->resume_at - current_time));
     }
-    
-    char* recycled_name = format_string("%ld_%s", timestamp, filename);
-    free(filename);
-    
-    if (recycled_name == NULL) {
-        free(original_path_copy);
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return strdup("Error: Could not create filename");
+    if (purged_count == 0 && failed_count == 0) {
+        return strdup("No expired files to purge");
+    } else {
+        return format_string("Purged %d expired files, failed to purge %d files", 
+                           purged_count, failed_count);
     }
-    
-    char* recycled_path = path_join(system->recycle_bin, recycled_name);
-    free(recycled_name);
-    
-    if (recycled_path == NULL) {
-        free(original_path_copy);
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return strdup("Error: Could not create recycled path");
+}
+
+
+// Reads the next page of rows after last_id, oldest first, optionally
+// restricted to one bin (bin_id 0 being the home bin). Returns the number
+// of entries filled, or -1 on error.
+static int fetch_oldest_page(AutoDeleteSystem* system, int in_bin, int bin_id, int last_id,
+                             BinEntry* entries) {
+    sqlite3_stmt* stmt = get_statement(system, in_bin ? STMT_SELECT_OLDEST_IN_BIN : STMT_SELECT_OLDEST);
+    if (stmt == NULL) {
+        return -1;
     }
-    
-    struct stat st;
-    if (stat(recycled_path, &st) != 0) {
-        sql = sqlite3_mprintf("DELETE FROM deleted_files WHERE id = %d", file_id);
-        sqlite3_exec(db, sql, NULL, NULL, NULL);
-        sqlite3_free(sql);
-        
-        char* result = format_string("Error: File %s no longer exists in recycle bin", filename);
-        free(original_path_copy);
-        free(recycled_path);
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return result;
+    int param = 1;
+    if (in_bin) {
+        if (bin_id != 0) {
+            sqlite3_bind_int(stmt, param, bin_id);
+        }
+        param++;
     }
+    sqlite3_bind_int(stmt, param++, last_id);
+    sqlite3_bind_int(stmt, param, PURGE_BATCH_SIZE);
     
-    // Ensure the directory exists
-    char* original_dir = get_dirname(original_path_copy);
-    if (original_dir == NULL) {
-        free(original_path_copy);
-        free(recycled_path);
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return strdup("Error: Could not get directory name");
+    int count = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char* recycled_name = (const char*)sqlite3_column_text(stmt, 1);
+        const char* bin_path = (const char*)sqlite3_column_text(stmt, 3);
+        entries[count].id = sqlite3_column_int(stmt, 0);
+        entries[count].scheduled_deletion = 0;
+        entries[count].size = sqlite3_column_int64(stmt, 2);
+        entries[count].recycled_path = recycled_location(system, bin_path,
+                                                        recycled_name ? recycled_name : "");
+        entries[count].is_tree = 0;
+        count++;
     }
     
-    if (!create_directory(original_dir)) {
-        char* result = format_string("Error: Could not create directory %s", original_dir);
-        free(original_path_copy);
-        free(recycled_path);
-        free(original_dir);
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return result;
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? count : -1;
+}
+
+// Removes the oldest rows (of one bin when in_bin is set) until target
+// bytes have been freed or nothing is left. Returns the number evicted.
+static int evict_oldest(AutoDeleteSystem* system, int in_bin, int bin_id, long long target,
+                        long long* freed_bytes, int* failed_count, char** error) {
+    BinEntry* entries = malloc(PURGE_BATCH_SIZE * sizeof(BinEntry));
+    int* evicted_ids = malloc(PURGE_BATCH_SIZE * sizeof(int));
+    if (entries == NULL || evicted_ids == NULL) {
+        free(entries);
+        free(evicted_ids);
+        *error = strdup("Error: Memory allocation failed");
+        return 0;
     }
-    free(original_dir);
     
-    char* target_path = strdup(original_path_copy);
-    if (target_path == NULL) {
-        free(original_path_copy);
-        free(recycled_path);
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return strdup("Error: Memory allocation failed");
-    }
+    int evicted_count = 0;
+    int last_id = 0;
+    long long freed = 0;
+    RemovePool* pool = NULL;
     
-    if (stat(target_path, &st) == 0) {
-        char* last_dot = strrchr(target_path, '.');
-        if (last_dot != NULL) {
-            *last_dot = '\0'; 
-            char* new_path = format_string("%s_restored%s", target_path, last_dot);
-            free(target_path);
-            target_path = new_path;
-        } else {
-            char* new_path = format_string("%s_restored", target_path);
-            free(target_path);
-            target_path = new_path;
+    while (freed < target) {
+        int count = fetch_oldest_page(system, in_bin, bin_id, last_id, entries);
+        if (count < 0) {
+            *error = format_string("Error reading recycle bin: %s", sqlite3_errmsg(system->db));
+            break;
+        }
+        if (count == 0) {
+            break;
+        }
+        
+        // Only take as many rows as the remaining shortfall needs
+        int take = 0;
+        for (long long planned = freed; take < count && planned < target; take++) {
+            planned += entries[take].size;
+        }
+        
+        int evicted = remove_entries(entries, take, system->reclaimer, &pool, evicted_ids,
+                                     failed_count, &freed);
+        last_id = entries[take - 1].id;
+        for (int i = 0; i < count; i++) {
+            free(entries[i].recycled_path);
+        }
+        
+        if (!delete_rows(system, evicted_ids, evicted)) {
+            *error = format_string("Error removing evicted rows: %s", sqlite3_errmsg(system->db));
+            break;
+        }
+        evicted_count += evicted;
+        
+        if (take == count && count < PURGE_BATCH_SIZE) {
+            break;
         }
     }
+    
+    remove_pool_destroy(pool);
+    free(entries);
+    free(evicted_ids);
+    *freed_bytes += freed;
+    return evicted_count;
+}
 
-    if (rename(recycled_path, target_path) != 0) {
-        char* result = format_string("Error restoring file: %s", strerror(errno));
-        free(original_path_copy);
-        free(recycled_path);
-        free(target_path);
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return result;
+static long long bin_usage(AutoDeleteSystem* system) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_USAGE);
+    if (stmt == NULL) {
+        return 0;
     }
-    
-    sql = sqlite3_mprintf("DELETE FROM deleted_files WHERE id = %d", file_id);
-    sqlite3_exec(db, sql, NULL, NULL, NULL);
-    sqlite3_free(sql);
-    
-    char* result = format_string("File restored to %s", target_path);
-    
-    free(original_path_copy);
-    free(recycled_path);
-    free(target_path);
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
-    
-    return result;
+    long long usage = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        usage = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    return usage;
 }
 
-char* purge_expired(AutoDeleteSystem* system) {
-    sqlite3* db;
-    int rc = sqlite3_open(system->db_path, &db);
-    if (rc != SQLITE_OK) {
-        syslog(LOG_ERR, "Error opening database: %s", sqlite3_errmsg(db));
-        return format_string("Error opening database: %s", sqlite3_errmsg(db));
+// Evicts oldest-first, before retention expires, while the bins hold more
+// than quota_bytes in total or a bin's filesystem has less than
+// min_free_bytes available. Returns NULL when nothing had to be evicted.
+char* enforce_quota(AutoDeleteSystem* system) {
+    if (system->quota_bytes <= 0 && system->min_free_bytes <= 0) {
+        return NULL;
     }
     
-    time_t current_time = time(NULL);
-    syslog(LOG_INFO, "Current time: %ld", current_time);
-    
-    // Find expired files
-    char* sql = sqlite3_mprintf(
-        "SELECT id, delete_timestamp, original_path, scheduled_deletion FROM deleted_files WHERE scheduled_deletion <= %ld",
-        current_time
-    );
-    
-    syslog(LOG_INFO, "Executing SQL: %s", sql);
+    int evicted_count = 0;
+    int failed_count = 0;
+    char* error = NULL;
     
-    sqlite3_stmt* stmt;
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    sqlite3_free(sql);
+    // Stored copies whose rows are all gone count against the quota too
+    long long freed_bytes = collect_blobs(system);
     
-    if (rc != SQLITE_OK) {
-        syslog(LOG_ERR, "Error preparing SQL: %s", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return format_string("Error preparing SQL: %s", sqlite3_errmsg(db));
+    if (system->quota_bytes > 0) {
+        long long usage = bin_usage(system);
+        if (usage > system->quota_bytes) {
+            evicted_count += evict_oldest(system, 0, 0, usage - system->quota_bytes,
+                                          &freed_bytes, &failed_count, &error);
+            freed_bytes += collect_blobs(system);
+        }
     }
     
-    int purged_count = 0;
-    int failed_count = 0;
-    
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        int file_id = sqlite3_column_int(stmt, 0);
-        time_t timestamp = (time_t)sqlite3_column_int64(stmt, 1);
-        const char* original_path = (const char*)sqlite3_column_text(stmt, 2);
-        time_t scheduled_time = (time_t)sqlite3_column_int64(stmt, 3);
-        
-        syslog(LOG_INFO, "Found expired file: ID=%d, Path=%s, Scheduled=%ld (now=%ld)", 
-               file_id, original_path, scheduled_time, current_time);
-        
-        char* filename = get_basename(original_path);
-        if (filename == NULL) {
-            syslog(LOG_ERR, "Failed to get basename for %s", original_path);
-            failed_count++;
-            continue;
+    if (system->min_free_bytes > 0 && error == NULL) {
+        // Collect the bins first so no read cursor is open during eviction
+        int bin_count = 1;
+        int* bin_ids = malloc(sizeof(int));
+        char** bin_paths = malloc(sizeof(char*));
+        if (bin_ids == NULL || bin_paths == NULL) {
+            free(bin_ids);
+            free(bin_paths);
+            return strdup("Error: Memory allocation failed");
         }
+        bin_ids[0] = 0;
+        bin_paths[0] = strdup(system->recycle_bin);
         
-        char* recycled_name = format_string("%ld_%s", timestamp, filename);
-        free(filename);
-        
-        if (recycled_name == NULL) {
-            syslog(LOG_ERR, "Failed to format recycled name");
-            failed_count++;
-            continue;
+        sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_BINS);
+        while (stmt != NULL && sqlite3_step(stmt) == SQLITE_ROW) {
+            int* grown_ids = realloc(bin_ids, (bin_count + 1) * sizeof(int));
+            if (grown_ids != NULL) {
+                bin_ids = grown_ids;
+            }
+            char** grown_paths = realloc(bin_paths, (bin_count + 1) * sizeof(char*));
+            if (grown_paths != NULL) {
+                bin_paths = grown_paths;
+            }
+            if (grown_ids == NULL || grown_paths == NULL) {
+                break;
+            }
+            bin_ids[bin_count] = sqlite3_column_int(stmt, 0);
+            bin_paths[bin_count] = strdup((const char*)sqlite3_column_text(stmt, 1));
+            bin_count++;
         }
-        
-        char* recycled_path = path_join(system->recycle_bin, recycled_name);
-        free(recycled_name);
-        
-        if (recycled_path == NULL) {
-            syslog(LOG_ERR, "Failed to join paths");
-            failed_count++;
-            continue;
+        if (stmt != NULL) {
+            sqlite3_reset(stmt);
         }
         
-        syslog(LOG_INFO, "Attempting to delete: %s", recycled_path);
-        
-        if (unlink(recycled_path) == 0) {
-            syslog(LOG_INFO, "Successfully deleted file: %s", recycled_path);
-        
-            char* delete_sql = sqlite3_mprintf("DELETE FROM deleted_files WHERE id = %d", file_id);
-            sqlite3_exec(db, delete_sql, NULL, NULL, NULL);
-            sqlite3_free(delete_sql);
-            purged_count++;
-        } else if (errno == ENOENT) {
-            syslog(LOG_WARNING, "File doesn't exist, removing from DB: %s", recycled_path);
-            char* delete_sql = sqlite3_mprintf("DELETE FROM deleted_files WHERE id = %d", file_id);
-            sqlite3_exec(db, delete_sql, NULL, NULL, NULL);
-            sqlite3_free(delete_sql);
-            purged_count++;
-        } else {
-            syslog(LOG_ERR, "Failed to delete %s: %s", recycled_path, strerror(errno));
-            failed_count++;
+        for (int i = 0; i < bin_count; i++) {
+            struct statvfs fs;
+            if (error == NULL && bin_paths[i] != NULL && statvfs(bin_paths[i], &fs) == 0) {
+                // Space still being reclaimed is as good as free already
+                long long available = (long long)fs.f_bavail * fs.f_frsize +
+                                      reclaim_pending_bytes(system->reclaimer, bin_paths[i]);
+                if (available < system->min_free_bytes) {
+                    evicted_count += evict_oldest(system, 1, bin_ids[i],
+                                                  system->min_free_bytes - available,
+                                                  &freed_bytes, &failed_count, &error);
+                }
+            }
+            free(bin_paths[i]);
         }
-        
-        free(recycled_path);
+        free(bin_ids);
+        free(bin_paths);
+        freed_bytes += collect_blobs(system);
     }
     
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+    system->stats.files_evicted += evicted_count;
+    system->stats.bytes_evicted += freed_bytes;
+    system->stats.evict_failures += failed_count;
+    if (error != NULL) {
+        syslog(LOG_ERR, "%s", error);
+        return error;
+    }
+    if (evicted_count == 0 && failed_count == 0) {
+        return NULL;
+    }
+    return format_string("Evicted %d files (%lld bytes) to stay within limits, failed to evict %d files",
+                         evicted_count, freed_bytes, failed_count);
+}
+
+
+// Earliest scheduled_deletion still in the database. Returns 0 when the
+// recycle bin is empty (or on error), 1 when *deadline was set.
+int next_deadline(AutoDeleteSystem* system, time_t* deadline) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_NEXT_DEADLINE);
+    if (stmt == NULL) {
+        return 0;
+    }
     
-    if (purged_count == 0 && failed_count == 0) {
-        return strdup("No expired files to purge");
-    } else {
-        return format_string("Purged %d expired files, failed to purge %d files", 
-                           purged_count, failed_count);
+    int found = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        *deadline = (time_t)sqlite3_column_int64(stmt, 0);
+        found = 1;
     }
+    sqlite3_reset(stmt);
+    return found;
 }
 
+// Tells a running daemon about a new deadline so it can wake earlier than
+// planned. Best effort: without a daemon listening this is a no-op.
+void notify_daemon(AutoDeleteSystem* system, time_t deadline) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(system->wakeup_socket) >= sizeof(addr.sun_path)) {
+        return;
+    }
+    strcpy(addr.sun_path, system->wakeup_socket);
+    
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return;
+    }
+    
+    int64_t payload = (int64_t)deadline;
+    sendto(fd, &payload, sizeof(payload), 0, (struct sockaddr*)&addr, sizeof(addr));
+    close(fd);
+}
 
 int create_directory(const char* path) {
     struct stat st;
@@ -590,8 +2232,12 @@ char* get_dirname(const char* path) {
 }
 
 char* get_extension(const char* path) {
-    char* last_dot = strrchr(path, '.');
-    if (last_dot == NULL) {
+    // Only the last component counts: "/a.d/file" has no extension, and
+    // neither does a dotfile such as ".bashrc"
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    char* last_dot = strrchr(name, '.');
+    if (last_dot == NULL || last_dot == name) {
         return strdup("");
     }
     
@@ -625,3 +2271,101 @@ char* format_string(const char* format, ...) {
     return buffer;
 }
 
+// Parses "90", "90s", "15m", "2h", "7d" or "1w" into seconds
+int parse_duration(const char* text, long* seconds) {
+    char* end;
+    long value = strtol(text, &end, 10);
+    if (end == text || value < 0) {
+        return 0;
+    }
+    
+    long unit = 1;
+    switch (*end) {
+        case '\0':
+        case 's': unit = 1; break;
+        case 'm': unit = 60; break;
+        case 'h': unit = 3600; break;
+        case 'd': unit = 86400; break;
+        case 'w': unit = 7 * 86400; break;
+        default: return 0;
+    }
+    if (*end != '\0' && end[1] != '\0') {
+        return 0;
+    }
+    
+    *seconds = value * unit;
+    return 1;
+}
+
+// Parses a syslog level name ("err", "warning", "notice", "info", "debug")
+int parse_log_level(const char* text, int* level) {
+    static const struct { const char* name; int level; } levels[] = {
+        { "err", LOG_ERR }, { "error", LOG_ERR }, { "warning", LOG_WARNING },
+        { "notice", LOG_NOTICE }, { "info", LOG_INFO }, { "debug", LOG_DEBUG },
+    };
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        if (strcasecmp(text, levels[i].name) == 0) {
+            *level = levels[i].level;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Parses "4096", "512K", "20M", "2G" or "1T" (powers of 1024) into bytes
+int parse_size(const char* text, long long* bytes) {
+    char* end;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0) {
+        return 0;
+    }
+    
+    int shift = 0;
+    switch (*end) {
+        case '\0': shift = 0; break;
+        case 'K': case 'k': shift = 10; break;
+        case 'M': case 'm': shift = 20; break;
+        case 'G': case 'g': shift = 30; break;
+        case 'T': case 't': shift = 40; break;
+        default: return 0;
+    }
+    if (*end != '\0' && end[1] != '\0' && strcmp(end + 1, "B") != 0) {
+        return 0;
+    }
+    if (value > (LLONG_MAX >> shift)) {
+        return 0;
+    }
+    
+    *bytes = value << shift;
+    return 1;
+}
+
+// time() may read a coarse clock that lags the one timerfd deadlines fire
+// on; anything compared against a timer deadline should use this instead.
+time_t wall_clock_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec;
+}
+
+// Background passes (purges, eviction, dedup, large-file reclaim) take the
+// lowest best-effort I/O priority so the disk scheduler serves interactive
+// processes first. Only the calling thread changes, so the daemon answers
+// requests between passes at its normal class. Returns the previous
+// priority for restore_io_priority, or -1 if nothing was changed.
+int lower_io_priority(void) {
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    int old = (int)syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid);
+    int prio = IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | IOPRIO_LOWEST_BE;
+    if (old < 0 || syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, prio) != 0) {
+        syslog(LOG_DEBUG, "Could not lower I/O priority: %s", strerror(errno));
+        return -1;
+    }
+    return old;
+}
+
+void restore_io_priority(int prio) {
+    if (prio >= 0) {
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, (pid_t)syscall(SYS_gettid), prio);
+    }
+}
@@ -1,24 +1,319 @@
 #ifndef AUTO_DELETE_H
 #define AUTO_DELETE_H
 
+#include <stdio.h>
 #include <sqlite3.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #define DEFAULT_RETENTION_SECS 60  // Default retention time in seconds
+#define RETENTION_POLICY -1        // Let the policy file decide the retention
+#define POLICY_ENV "AUTO_DELETE_POLICY"      // Path of the retention policy file
+#define POLICY_FILE ".config/auto_delete/policy"  // Default, relative to HOME
+#define SCHEMA_VERSION 11          // Stored in PRAGMA user_version
+#define PURGE_BATCH_SIZE 2048      // Expired rows removed per purge transaction
+#define BUSY_TIMEOUT_MS 10000      // How long to wait for another process's write lock
+#define BUSY_BACKOFF_MIN_US 200    // First wait after SQLITE_BUSY; doubles per retry
+#define BUSY_BACKOFF_MAX_US 50000
+#define MOUNT_BIN_PREFIX ".recycle_bin-"  // Per-mount bins are <mount>/.recycle_bin-<uid>
+#define BIN_SHARDS 256             // Subdirectories 00..ff recycled entries are spread over
+#define QUOTA_ENV "AUTO_DELETE_QUOTA"        // Max bytes kept in the bins, e.g. 20G
+#define MIN_FREE_ENV "AUTO_DELETE_MIN_FREE"  // Free space to keep on each bin's filesystem
+#define DEDUP_ENV "AUTO_DELETE_DEDUP"        // Set to 1 to deduplicate recycled files
+#define DEDUP_STORE_DIR ".store"   // Content-addressed copies, per bin
+#define DEDUP_MIN_BYTES 4096       // Smaller files are not worth a lookup
+#define DEDUP_BATCH_FILES 64       // Files hashed per slice of the daemon's loop
+#define INDEX_BATCH_ROWS 4096      // Path index changes applied per slice of the daemon's loop
+#define COMPRESS_ENV "AUTO_DELETE_COMPRESS_AFTER"  // Compress entries older than this, e.g. 2d
+#define COMPRESS_BATCH_FILES 16    // Files compressed between checks for shutdown
+#define COMPRESS_SCAN_INTERVAL 600 // Seconds between scans once nothing is cold
+#define CODEC_GZIP "gzip"
+#define CODEC_NONE "none"          // Examined, but compression did not pay off
+#define RECLAIM_DIR ".reclaim"     // Large files being truncated away, per bin
+#define RECLAIM_MIN_BYTES (1LL << 30)    // Smaller files are simply unlinked
+#define RECLAIM_STEP_BYTES (256LL << 20) // Truncated per step
+#define RECLAIM_PAUSE_MS 50        // Between steps, so other I/O on the volume gets through
+#define LOG_LEVEL_ENV "AUTO_DELETE_LOG_LEVEL"  // err, warning, notice (default), info or debug
+#define DEFAULT_LOG_LEVEL LOG_NOTICE  // Per-cycle lines are info, per-file lines debug
+#define LATENCY_BUCKETS 10         // Finite buckets in the purge latency histogram
+#define PURGE_FILES_RATE_ENV "AUTO_DELETE_PURGE_FILES_RATE"  // Daemon purge budget, files/sec
+#define PURGE_BYTES_RATE_ENV "AUTO_DELETE_PURGE_BYTES_RATE"  // Daemon purge budget, e.g. 200M a sec
+#define IO_PRESSURE_ENV "AUTO_DELETE_IO_PRESSURE"  // Pause purging above this io avg10 %; 0 never
+#define DEFAULT_IO_PRESSURE 20     // Percent of time tasks stalled on I/O
+#define IO_PRESSURE_FILE "/proc/pressure/io"
+#define PRESSURE_BACKOFF_SECS 5    // Wait before looking at the pressure again
+#define PURGE_BURST_SECS 1         // Budget a purge can save up, in seconds of its rate
+#define SEARCH_LIMIT 50            // Matches shown by search without --limit
+#define SEARCH_MIN_TERM 3          // Shorter terms cannot use the trigram index
+
+// Statements compiled once per process and reused for its lifetime
+typedef enum {
+    STMT_INSERT,
+    STMT_SELECT_BY_ID,
+    STMT_DELETE_BY_ID,
+    STMT_SELECT_EXPIRED,
+    STMT_SELECT_NEXT_DEADLINE,
+    STMT_BEGIN,
+    STMT_COMMIT,
+    STMT_ROLLBACK,
+    STMT_SAVEPOINT,
+    STMT_RELEASE,
+    STMT_ROLLBACK_TO,
+    STMT_INSERT_BIN,
+    STMT_SELECT_BIN_ID,
+    STMT_SELECT_BINS,
+    STMT_SELECT_USAGE,
+    STMT_SELECT_OLDEST,
+    STMT_SELECT_OLDEST_IN_BIN,
+    STMT_SELECT_DEDUP_PENDING,
+    STMT_MARK_DEDUPED,
+    STMT_SELECT_BLOB,
+    STMT_INSERT_BLOB,
+    STMT_REF_BLOB,
+    STMT_SELECT_UNREFERENCED_BLOBS,
+    STMT_DELETE_BLOB,
+    STMT_SELECT_COLD,
+    STMT_SET_CODEC,
+    STMT_SELECT_BIN_ROWS,
+    STMT_DELETE_BY_NAME,
+    STMT_DELETE_BY_ID_NAME,
+    STMT_RESERVE_NAMES,
+    STMT_INSERT_MANIFEST,
+    STMT_SELECT_MANIFEST,
+    STMT_SHRINK_ENTRY,
+    STMT_INDEX_LOG_BOUND,
+    STMT_APPLY_INDEX_LOG,
+    STMT_CLEAR_INDEX_LOG,
+    STMT_COUNT
+} StatementId;
+
+typedef enum {
+    LIST_FORMAT_TABLE,
+    LIST_FORMAT_JSON,
+    LIST_FORMAT_CSV,
+    LIST_FORMAT_NUL,      // "<id>\t<original_path>\0" per row
+    LIST_FORMAT_IDS       // One id per line, for restore
+} ListFormat;
+
+// Filters for list_recycled; all of them are applied in SQL
+typedef struct {
+    long limit;                 // < 0 for no limit
+    long offset;
+    time_t since;               // Deleted at or after; 0 for any
+    const char* path_prefix;    // NULL for any
+    long expiring_within;       // Seconds from now; < 0 for any
+    char** terms;               // Search: paths containing every term, best match first
+    int term_count;
+    ListFormat format;
+} ListOptions;
+
+// Selects rows to restore by original path; exactly one of path, prefix
+// and glob is set
+typedef struct {
+    const char* path;           // Exact original path
+    const char* prefix;         // A directory: itself and everything below it
+    const char* glob;           // SQLite GLOB pattern; '*' also matches '/'
+    time_t since;               // Deleted at or after; 0 for any
+    int latest;                 // Only the newest row per original path
+} RestoreOptions;
+
+typedef struct {
+    dev_t device;
+    char* mount_point;
+} MountEntry;
+
+// A recycle bin at the top of a mounted filesystem. id 0 is the home bin,
+// which has no row in recycle_bins.
+typedef struct {
+    char* mount_point;
+    char* path;        // NULL when no usable bin exists on that mount
+    int id;
+} RecycleBin;
+
+// Counters kept by the engine for the life of the process; the daemon's
+// are what `auto_delete stats` reports
+typedef struct {
+    time_t started;                 // Set by the daemon; 0 in a one-shot CLI
+    long long files_recycled;
+    long long files_restored;
+    long long purge_runs;
+    long long files_purged;
+    long long bytes_purged;
+    long long purge_failures;
+    long long files_evicted;
+    long long bytes_evicted;
+    long long evict_failures;
+    long long stale_rows;           // Dropped because their file left the bin
+    long long busy_waits;           // Sleeps waiting for another process's lock
+    long long purge_deferrals;      // Purges cut short by the budget or I/O pressure
+    long long purge_latency[LATENCY_BUCKETS + 1];  // Per bucket; the last one is +Inf
+    double purge_seconds;           // Sum over all purges
+} EngineStats;
+
+// Token bucket for the daemon's purges; all zero means no limit
+typedef struct {
+    double files_per_sec;
+    double bytes_per_sec;
+    double files;                   // Tokens; bytes can go below zero after a large file
+    double bytes;
+    double refilled;                // monotonic_seconds() of the last refill
+    double pressure_limit;          // io "some avg10" percentage to back off at
+    time_t resume_at;               // When deferred rows may go on; 0 if none were deferred
+} PurgeBudget;
+
+typedef struct RetentionPolicy RetentionPolicy;
+typedef struct ReclaimWorker ReclaimWorker;
+typedef struct StagedBatch StagedBatch;
 
 typedef struct {
     const char* home_dir;
     char* recycle_bin;
     char* db_path;
+    char* wakeup_socket;
+    sqlite3* db;
+    sqlite3_stmt* stmts[STMT_COUNT];
+    int transaction_depth;  // Levels below the outermost are savepoints
+    double busy_since;      // When the current wait for a lock began
+    unsigned busy_seed;     // Jitter for the busy backoff
+    MountEntry* mounts;     // Parsed lazily from /proc/self/mountinfo
+    int mount_count;
+    RecycleBin* bins;       // bins[0] is the home bin once mounts are loaded
+    int bin_count;
+    long long quota_bytes;     // 0 for no quota
+    long long min_free_bytes;  // 0 for no free-space floor
+    int dedup;                 // Daemon links identical recycled files together
+    long compress_after;       // Age in seconds before the daemon compresses; 0 for never
+    EngineStats stats;
+    RetentionPolicy* policy;   // NULL when there is no policy file
+    int policy_loaded;         // The policy file is read on first use
+    ReclaimWorker* reclaimer;  // Set by the daemon; NULL unlinks large files in one go
+    PurgeBudget budget;        // Set by the daemon for its timer-driven purges
+    int path_index;            // Search index: 1 present, -1 absent, 0 not looked up yet
+    StagedBatch* staging;      // Set by the daemon's group commit: deletes only move
+                               // files here, and the rows go in with the group
 } AutoDeleteSystem;
 
 // Function declarations
 int init_system(AutoDeleteSystem* system);
 void cleanup_system(AutoDeleteSystem* system);
 int init_database(AutoDeleteSystem* system);
+sqlite3_stmt* get_statement(AutoDeleteSystem* system, StatementId id);
+int begin_transaction(AutoDeleteSystem* system);
+int commit_transaction(AutoDeleteSystem* system);
+void rollback_transaction(AutoDeleteSystem* system);
+long recycle_path(AutoDeleteSystem* system, const char* file_path, long retention_secs,
+                  char** error);
 char* delete_file(AutoDeleteSystem* system, const char* file_path, int retention_secs);
-char* list_recycled(AutoDeleteSystem* system);
+char* delete_files(AutoDeleteSystem* system, char** file_paths, int count, int retention_secs,
+                   FILE* errors);
+StagedBatch* staged_batch_create(void);
+int staged_batch_record(AutoDeleteSystem* system, StagedBatch* batch, char** error);
+int staged_batch_unstage(AutoDeleteSystem* system, StagedBatch* batch);
+void staged_batch_free(StagedBatch* batch);
+void init_list_options(ListOptions* options);
+char* list_recycled(AutoDeleteSystem* system, const ListOptions* options, FILE* out);
+char* restore_matching(AutoDeleteSystem* system, const RestoreOptions* options, FILE* out,
+                       FILE* errors);
+int delete_rows(AutoDeleteSystem* system, const int* ids, int count);
+void init_purge_budget(AutoDeleteSystem* system);
+char* purge_expired(AutoDeleteSystem* system, PurgeBudget* budget);
+char* enforce_quota(AutoDeleteSystem* system);
+int next_deadline(AutoDeleteSystem* system, time_t* deadline);
+int update_path_index(AutoDeleteSystem* system, int max_rows);
+int create_missing_path_index(AutoDeleteSystem* system);
+void notify_daemon(AutoDeleteSystem* system, time_t deadline);
+
+// CLI commands (commands.c)
+int run_command(AutoDeleteSystem* system, int argc, char* argv[], FILE* in, FILE* out, FILE* err);
+
+// Recycle bins (recycle_bins.c)
+const RecycleBin* find_recycle_bin(AutoDeleteSystem* system, const char* abs_path);
+char* recycled_location(AutoDeleteSystem* system, const char* bin_path, const char* recycled_name);
+char* shard_recycled_name(long long seq);
+int is_shard_name(const char* name);
+int move_into_bin(const char* src, const char* dst);
+void free_recycle_bins(AutoDeleteSystem* system);
+int move_path(const char* src, const char* dst);
+int copy_file(const char* src, const char* dst);
+long long disk_usage(const char* path);
+
+// Manifests of recycled directories (manifest.c)
+typedef struct {
+    unsigned char* data;
+    size_t length;
+    size_t capacity;
+    long long count;
+} Manifest;
+
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    size_t offset;
+    char* path;                 // Current entry, relative to the directory
+    size_t path_length;
+    size_t path_capacity;
+    int type;                   // S_IFMT bits
+    long long size;
+    long long usage;            // Bytes allocated
+    time_t mtime;
+} ManifestReader;
+
+int build_manifest(const char* dir_path, Manifest* manifest, long long* usage);
+void free_manifest(Manifest* manifest);
+void manifest_reader_init(ManifestReader* reader, const void* data, size_t length);
+int manifest_next(ManifestReader* reader);
+void manifest_reader_free(ManifestReader* reader);
+int store_manifest(AutoDeleteSystem* system, int file_id, const Manifest* manifest);
+int load_manifest(AutoDeleteSystem* system, int file_id, const char* recycled_path,
+                  Manifest* manifest, char** error);
+int filter_manifest(const Manifest* manifest, const unsigned char* drop, Manifest* kept);
+char* list_manifest(AutoDeleteSystem* system, int file_id, FILE* out);
+
+// Deduplication (dedup.c)
+int dedup_recycled(AutoDeleteSystem* system, int max_files);
+long long collect_blobs(AutoDeleteSystem* system);
+
+// Restore (restore.c)
 char* restore_file(AutoDeleteSystem* system, int file_id);
-char* purge_expired(AutoDeleteSystem* system);
+char* restore_ids(AutoDeleteSystem* system, const int* ids, int count, FILE* out, FILE* errors);
+char* restore_entries(AutoDeleteSystem* system, int file_id, char** paths, int count, FILE* out,
+                      FILE* errors);
+
+// Compression of cold entries (compress.c)
+typedef struct CompressWorker CompressWorker;
+int compress_cold_entries(AutoDeleteSystem* system, time_t cutoff, int max_files);
+int decompress_file(const char* src, const char* dst);
+CompressWorker* compress_worker_start(long min_age);
+void compress_worker_stop(CompressWorker* worker);
+
+// Incremental removal of large files (reclaim.c)
+ReclaimWorker* reclaim_worker_start(void);
+void reclaim_worker_stop(ReclaimWorker* worker);
+int reclaim_submit(ReclaimWorker* worker, const char* recycled_path);
+void reclaim_resume(ReclaimWorker* worker, AutoDeleteSystem* system);
+long long reclaim_pending_bytes(ReclaimWorker* worker, const char* path);
+
+// Reconciling the bins with the database (reconcile.c)
+typedef struct BinWatch BinWatch;
+char* fsck_bins(AutoDeleteSystem* system, FILE* out);
+BinWatch* bin_watch_open(void);
+int bin_watch_fd(const BinWatch* watch);
+void bin_watch_refresh(BinWatch* watch, AutoDeleteSystem* system);
+int bin_watch_process(BinWatch* watch, AutoDeleteSystem* system);
+void bin_watch_close(BinWatch* watch);
+
+// Retention policy (policy.c)
+RetentionPolicy* load_policy(const char* path);
+void free_policy(RetentionPolicy* policy);
+long policy_retention(const RetentionPolicy* policy, const char* abs_path, const struct stat* st);
+void reload_policy(AutoDeleteSystem* system);
+
+// Metrics (stats.c)
+double monotonic_seconds(void);
+void record_purge_latency(EngineStats* stats, double seconds);
+int write_stats(AutoDeleteSystem* system, FILE* out);
 
 // Helper functions
 int create_directory(const char* path);
@@ -28,5 +323,11 @@ char* get_basename(const char* path);
 char* get_dirname(const char* path);
 char* get_extension(const char* path);
 char* format_string(const char* format, ...);
+int parse_size(const char* text, long long* bytes);
+int parse_duration(const char* text, long* seconds);
+int parse_log_level(const char* text, int* level);
+time_t wall_clock_now(void);
+int lower_io_priority(void);
+void restore_io_priority(int prio);
 
 #endif
\ No newline at end of file
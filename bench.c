@@ -0,0 +1,707 @@
+/* bench.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include "auto_delete.h"
+#include "remove_tree.h"
+
+// Workload harness for the engine: builds synthetic trees in a scratch
+// HOME, times the public entry points call by call and writes one JSON
+// document per run so results can be diffed across versions.
+
+#define BENCH_DEFAULT_OUTPUT "bench_results.json"
+#define BENCH_SMALL_FILES 2000
+#define BENCH_SMALL_FILE_BYTES 1024
+#define BENCH_HUGE_FILES 4
+#define BENCH_HUGE_FILE_BYTES (256LL << 20)
+#define BENCH_TREE_DEPTH 200
+#define BENCH_TREE_FANOUT 100       // Directories at the top of the wide tree
+#define BENCH_TREE_FILES 50         // Files per wide-tree directory
+#define BENCH_TREE_ROUNDS 5
+#define BENCH_DB_ROWS 1000000
+#define BENCH_DB_EXPIRED 10000      // Rows of the large database due for purge
+#define BENCH_DB_PROBES 1000        // Calls per operation against the large database
+#define BENCH_PURGE_BATCH 100       // Files expired per purge call
+#define BENCH_POLICY_RULES 300      // Rules in the policy scenario's file
+#define BENCH_WRITERS 64            // Processes deleting at the same time
+#define BENCH_WRITER_FILES 50       // Files each writer deletes
+#define BENCH_WRITER_BATCH 8        // Paths per delete_files call, for odd writers
+
+typedef struct {
+    int small_files;
+    long long huge_file_bytes;
+    int db_rows;
+    const char* output;
+} BenchConfig;
+
+// Per-call latencies for one operation in one scenario
+typedef struct {
+    const char* scenario;
+    const char* operation;
+    double* samples;   // Seconds per call
+    int count;
+    int capacity;
+    long long items;   // Files or rows handled across all calls
+} Series;
+
+typedef struct {
+    Series* series;
+    int count;
+    int capacity;
+} Results;
+
+static AutoDeleteSystem bench_system;
+static FILE* devnull;
+
+static Series* new_series(Results* results, const char* scenario, const char* operation) {
+    if (results->count == results->capacity) {
+        int capacity = results->capacity ? results->capacity * 2 : 16;
+        Series* grown = realloc(results->series, capacity * sizeof(Series));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            exit(1);
+        }
+        results->series = grown;
+        results->capacity = capacity;
+    }
+    Series* series = &results->series[results->count++];
+    memset(series, 0, sizeof(*series));
+    series->scenario = scenario;
+    series->operation = operation;
+    return series;
+}
+
+static void record(Series* series, double seconds, long long items) {
+    if (series->count == series->capacity) {
+        int capacity = series->capacity ? series->capacity * 2 : 256;
+        double* grown = realloc(series->samples, capacity * sizeof(double));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            exit(1);
+        }
+        series->samples = grown;
+        series->capacity = capacity;
+    }
+    series->samples[series->count++] = seconds;
+    series->items += items;
+}
+
+// Engine calls return a malloc'd message that the benchmark does not need
+static void discard(char* message) {
+    free(message);
+}
+
+static void write_file(const char* path, long long bytes) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (bytes > 0) {
+        // Allocated rather than sparse, so disk usage and unlink cost are real
+        int err = posix_fallocate(fd, 0, bytes);
+        if (err != 0 && ftruncate(fd, bytes) != 0) {
+            fprintf(stderr, "Error sizing %s: %s\n", path, strerror(err));
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+static void make_dir(const char* path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+// Ids handed out by the most recent inserts, oldest first
+static int* last_ids(int count) {
+    int* ids = malloc(count * sizeof(int));
+    if (ids == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    int last = (int)sqlite3_last_insert_rowid(bench_system.db);
+    for (int i = 0; i < count; i++) {
+        ids[i] = last - count + 1 + i;
+    }
+    return ids;
+}
+
+static void time_delete(Series* series, char** paths, int count, int retention_secs) {
+    for (int i = 0; i < count; i++) {
+        double start = monotonic_seconds();
+        discard(delete_file(&bench_system, paths[i], retention_secs));
+        record(series, monotonic_seconds() - start, 1);
+    }
+}
+
+static void time_restore(Series* series, const int* ids, int count) {
+    for (int i = 0; i < count; i++) {
+        double start = monotonic_seconds();
+        discard(restore_file(&bench_system, ids[i]));
+        record(series, monotonic_seconds() - start, 1);
+    }
+}
+
+static void time_list(Series* series, const ListOptions* options, int calls, long long rows) {
+    for (int i = 0; i < calls; i++) {
+        double start = monotonic_seconds();
+        discard(list_recycled(&bench_system, options, devnull));
+        record(series, monotonic_seconds() - start, rows);
+    }
+}
+
+static void time_purge(Series* series, long long items) {
+    double start = monotonic_seconds();
+    discard(purge_expired(&bench_system, NULL));
+    record(series, monotonic_seconds() - start, items);
+}
+
+static char** numbered_paths(const char* dir, const char* stem, int count) {
+    char** paths = malloc(count * sizeof(char*));
+    for (int i = 0; paths != NULL && i < count; i++) {
+        paths[i] = format_string("%s/%s%d", dir, stem, i);
+        if (paths[i] == NULL) {
+            paths = NULL;
+        }
+    }
+    if (paths == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    return paths;
+}
+
+static void free_paths(char** paths, int count) {
+    for (int i = 0; i < count; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+// Many small files: one delete, restore and purge at a time, plus full
+// listings of the populated bin
+static void bench_small_files(Results* results, const BenchConfig* config, const char* work) {
+    int count = config->small_files;
+    char* dir = path_join(work, "small");
+    make_dir(dir);
+    char** paths = numbered_paths(dir, "f", count);
+    for (int i = 0; i < count; i++) {
+        write_file(paths[i], BENCH_SMALL_FILE_BYTES);
+    }
+
+    time_delete(new_series(results, "small_files", "delete_file"), paths, count, 3600);
+
+    ListOptions options;
+    init_list_options(&options);
+    time_list(new_series(results, "small_files", "list_recycled"), &options, 20, count);
+
+    int* ids = last_ids(count);
+    time_restore(new_series(results, "small_files", "restore_file"), ids, count);
+    free(ids);
+
+    Series* purge = new_series(results, "small_files", "purge_expired");
+    for (int i = 0; i < count; i += BENCH_PURGE_BATCH) {
+        int batch = count - i < BENCH_PURGE_BATCH ? count - i : BENCH_PURGE_BATCH;
+        discard(delete_files(&bench_system, paths + i, batch, 0, devnull));
+        time_purge(purge, batch);
+    }
+
+    free_paths(paths, count);
+    free(dir);
+}
+
+// Deletes that ask a policy file of BENCH_POLICY_RULES prefix, extension
+// and glob rules for their retention; the matching rule is the last one
+static void bench_policy(Results* results, const BenchConfig* config, const char* work) {
+    char* policy_path = path_join(work, "policy");
+    FILE* policy = policy_path ? fopen(policy_path, "w") : NULL;
+    if (policy == NULL) {
+        fprintf(stderr, "Error creating policy file\n");
+        exit(1);
+    }
+    for (int i = 0; i < BENCH_POLICY_RULES - 1; i++) {
+        switch (i % 3) {
+            case 0: fprintf(policy, "prefix %s/other%d 1m\n", work, i); break;
+            case 1: fprintf(policy, "ext .x%d 1h\n", i); break;
+            default: fprintf(policy, "glob *%d.tmp 1d\n", i); break;
+        }
+    }
+    fprintf(policy, "glob *.dat 7d\n");
+    fclose(policy);
+    setenv(POLICY_ENV, policy_path, 1);
+    reload_policy(&bench_system);
+
+    int count = config->small_files;
+    char* dir = path_join(work, "policy_files");
+    make_dir(dir);
+    char** paths = numbered_paths(dir, "f", count);
+    for (int i = 0; i < count; i++) {
+        char* named = format_string("%s.dat", paths[i]);
+        free(paths[i]);
+        paths[i] = named;
+        write_file(paths[i], BENCH_SMALL_FILE_BYTES);
+    }
+
+    time_delete(new_series(results, "policy", "delete_file"), paths, count, RETENTION_POLICY);
+    int* ids = last_ids(count);
+    time_restore(new_series(results, "policy", "restore_file"), ids, count);
+    free(ids);
+
+    unsetenv(POLICY_ENV);
+    reload_policy(&bench_system);
+    free_paths(paths, count);
+    free(dir);
+    free(policy_path);
+}
+
+static void bench_huge_files(Results* results, const BenchConfig* config, const char* work) {
+    char* dir = path_join(work, "huge");
+    make_dir(dir);
+    char** paths = numbered_paths(dir, "h", BENCH_HUGE_FILES);
+    for (int i = 0; i < BENCH_HUGE_FILES; i++) {
+        write_file(paths[i], config->huge_file_bytes);
+    }
+
+    time_delete(new_series(results, "huge_files", "delete_file"), paths, BENCH_HUGE_FILES, 3600);
+    int* ids = last_ids(BENCH_HUGE_FILES);
+    time_restore(new_series(results, "huge_files", "restore_file"), ids, BENCH_HUGE_FILES);
+    free(ids);
+
+    discard(delete_files(&bench_system, paths, BENCH_HUGE_FILES, 0, devnull));
+    time_purge(new_series(results, "huge_files", "purge_expired"), BENCH_HUGE_FILES);
+
+    free_paths(paths, BENCH_HUGE_FILES);
+    free(dir);
+}
+
+// One directory chain BENCH_TREE_DEPTH deep and one wide tree, each with a
+// file per directory. Returns the number of entries created.
+static long long build_tree(const char* root) {
+    long long entries = 0;
+    make_dir(root);
+
+    char* deep = path_join(root, "deep");
+    for (int level = 0; deep != NULL && level < BENCH_TREE_DEPTH; level++) {
+        make_dir(deep);
+        char* file = path_join(deep, "file");
+        write_file(file, BENCH_SMALL_FILE_BYTES);
+        free(file);
+        entries += 2;
+        char* next = path_join(deep, "d");
+        free(deep);
+        deep = next;
+    }
+    free(deep);
+
+    for (int d = 0; d < BENCH_TREE_FANOUT; d++) {
+        char* sub = format_string("%s/wide%d", root, d);
+        make_dir(sub);
+        char** files = numbered_paths(sub, "f", BENCH_TREE_FILES);
+        for (int f = 0; f < BENCH_TREE_FILES; f++) {
+            write_file(files[f], BENCH_SMALL_FILE_BYTES);
+        }
+        free_paths(files, BENCH_TREE_FILES);
+        free(sub);
+        entries += 1 + BENCH_TREE_FILES;
+    }
+    return entries;
+}
+
+static void bench_trees(Results* results, const char* work) {
+    Series* deletes = new_series(results, "deep_trees", "delete_file");
+    Series* restores = new_series(results, "deep_trees", "restore_file");
+    Series* purges = new_series(results, "deep_trees", "purge_expired");
+
+    for (int round = 0; round < BENCH_TREE_ROUNDS; round++) {
+        char* root = format_string("%s/tree%d", work, round);
+        long long entries = build_tree(root);
+
+        time_delete(deletes, &root, 1, 3600);
+        int* ids = last_ids(1);
+        time_restore(restores, ids, 1);
+        free(ids);
+
+        discard(delete_file(&bench_system, root, 0));
+        time_purge(purges, entries);
+        free(root);
+    }
+}
+
+// Rows straight into deleted_files, in one transaction; their recycled
+// names point at nothing, which purge and restore treat as already gone
+static void fill_database(int rows, int expired) {
+    sqlite3_stmt* stmt = get_statement(&bench_system, STMT_INSERT);
+    if (stmt == NULL || !begin_transaction(&bench_system)) {
+        fprintf(stderr, "Error filling database: %s\n", sqlite3_errmsg(bench_system.db));
+        exit(1);
+    }
+    time_t now = wall_clock_now();
+    for (int i = 0; i < rows; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/bench/d%d/f%d.txt", i % 1000, i);
+        char* name = shard_recycled_name(i + 1);
+        // Spread the expired rows through the table
+        int due = expired > 0 && i % (rows / expired) == 0;
+        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2, now);
+        sqlite3_bind_int64(stmt, 3, due ? now - 1 : now + 86400);
+        sqlite3_bind_text(stmt, 4, "txt", -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 5, name, -1, SQLITE_TRANSIENT);
+        free(name);
+        sqlite3_bind_null(stmt, 6);
+        sqlite3_bind_int64(stmt, 7, 0);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "Error filling database: %s\n", sqlite3_errmsg(bench_system.db));
+            exit(1);
+        }
+        sqlite3_reset(stmt);
+    }
+    if (!commit_transaction(&bench_system)) {
+        fprintf(stderr, "Error filling database: %s\n", sqlite3_errmsg(bench_system.db));
+        exit(1);
+    }
+}
+
+// Sent by each concurrent writer per call
+typedef struct {
+    double seconds;
+    int items;
+} WriterSample;
+
+// One writer process: waits for go_fd to close so that every writer starts
+// at once, then deletes its files with a connection of its own
+static void run_writer(int writer, const char* dir, int go_fd, int out_fd) {
+    char byte;
+    if (read(go_fd, &byte, 1) < 0) {
+        _exit(1);
+    }
+    AutoDeleteSystem system;
+    if (!init_system(&system)) {
+        _exit(1);
+    }
+    int batch = writer % 2 ? BENCH_WRITER_BATCH : 1;
+    char** paths = numbered_paths(dir, "f", BENCH_WRITER_FILES);
+    for (int i = 0; i < BENCH_WRITER_FILES; i += batch) {
+        int n = BENCH_WRITER_FILES - i < batch ? BENCH_WRITER_FILES - i : batch;
+        double start = monotonic_seconds();
+        discard(batch == 1 ? delete_file(&system, paths[i], 3600)
+                           : delete_files(&system, paths + i, n, 3600, devnull));
+        WriterSample sample = { monotonic_seconds() - start, n };
+        if (write(out_fd, &sample, sizeof(sample)) != sizeof(sample)) {
+            _exit(1);
+        }
+    }
+    cleanup_system(&system);
+    _exit(0);
+}
+
+// BENCH_WRITERS processes deleting at once, like parallel build jobs running
+// rm: reports per-call latency, aggregate throughput, and any file that
+// left its directory without getting a row
+static int bench_concurrent_writers(Results* results, const char* work) {
+    char* root = path_join(work, "writers");
+    make_dir(root);
+    char* dirs[BENCH_WRITERS];
+    for (int w = 0; w < BENCH_WRITERS; w++) {
+        dirs[w] = format_string("%s/w%d", root, w);
+        make_dir(dirs[w]);
+        char** paths = numbered_paths(dirs[w], "f", BENCH_WRITER_FILES);
+        for (int i = 0; i < BENCH_WRITER_FILES; i++) {
+            write_file(paths[i], BENCH_SMALL_FILE_BYTES);
+        }
+        free_paths(paths, BENCH_WRITER_FILES);
+    }
+
+    int go[2];
+    int out[BENCH_WRITERS];
+    pid_t pids[BENCH_WRITERS];
+    if (pipe(go) != 0) {
+        fprintf(stderr, "Error creating pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+    fflush(NULL);
+    for (int w = 0; w < BENCH_WRITERS; w++) {
+        int fds[2];
+        if (pipe(fds) != 0 || (pids[w] = fork()) < 0) {
+            fprintf(stderr, "Error starting writer: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (pids[w] == 0) {
+            close(go[1]);
+            close(fds[0]);
+            run_writer(w, dirs[w], go[0], fds[1]);
+        }
+        close(fds[1]);
+        out[w] = fds[0];
+    }
+    close(go[0]);
+    double start = monotonic_seconds();
+    close(go[1]);
+
+    // Each writer's samples fit in its pipe, so it never blocks on us
+    int failed_writers = 0;
+    for (int w = 0; w < BENCH_WRITERS; w++) {
+        int status;
+        waitpid(pids[w], &status, 0);
+        failed_writers += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    Series* single = new_series(results, "concurrent", "delete_file");
+    Series* batched = new_series(results, "concurrent", "delete_files");
+    WriterSample sample;
+    for (int w = 0; w < BENCH_WRITERS; w++) {
+        while (read(out[w], &sample, sizeof(sample)) == sizeof(sample)) {
+            record(sample.items == 1 ? single : batched, sample.seconds, sample.items);
+        }
+        close(out[w]);
+    }
+    int total = BENCH_WRITERS * BENCH_WRITER_FILES;
+    record(new_series(results, "concurrent", "all_writers"), elapsed, total);
+
+    // Every file is either still in place (a failed delete) or has a row
+    int left = 0;
+    for (int w = 0; w < BENCH_WRITERS; w++) {
+        char** paths = numbered_paths(dirs[w], "f", BENCH_WRITER_FILES);
+        for (int i = 0; i < BENCH_WRITER_FILES; i++) {
+            struct stat st;
+            left += lstat(paths[i], &st) == 0;
+        }
+        free_paths(paths, BENCH_WRITER_FILES);
+        free(dirs[w]);
+    }
+    char* pattern = format_string("%s/%%", root);
+    sqlite3_stmt* stmt;
+    int rows = -1;
+    if (pattern != NULL && sqlite3_prepare_v2(bench_system.db, "SELECT COUNT(*) FROM deleted_files "
+                                              "WHERE original_path LIKE ?1", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            rows = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    free(pattern);
+    free(root);
+
+    int lost = total - left - rows;
+    printf("concurrent: %d writers, %d files in %.2f s: %d recorded, %d not deleted, %d lost rows\n",
+           BENCH_WRITERS, total, elapsed, rows, left, lost);
+    if (failed_writers > 0 || rows < 0 || lost != 0) {
+        fprintf(stderr, "Error: concurrent writers lost rows or failed (%d writers)\n",
+                failed_writers);
+        return 0;
+    }
+    return 1;
+}
+
+// The same operations against a database that already holds config->db_rows rows
+static void bench_large_database(Results* results, const BenchConfig* config, const char* work) {
+    int rows = config->db_rows;
+    int expired = rows < BENCH_DB_EXPIRED ? rows : BENCH_DB_EXPIRED;
+    double start = monotonic_seconds();
+    fill_database(rows, expired);
+    record(new_series(results, "large_db", "fill"), monotonic_seconds() - start, rows);
+    int first_id = (int)sqlite3_last_insert_rowid(bench_system.db) - rows + 1;
+
+    char* dir = path_join(work, "large_db");
+    make_dir(dir);
+    char** paths = numbered_paths(dir, "f", BENCH_DB_PROBES);
+    for (int i = 0; i < BENCH_DB_PROBES; i++) {
+        write_file(paths[i], BENCH_SMALL_FILE_BYTES);
+    }
+    time_delete(new_series(results, "large_db", "delete_file"), paths, BENCH_DB_PROBES, 3600);
+
+    ListOptions options;
+    init_list_options(&options);
+    options.limit = 100;
+    Series* pages = new_series(results, "large_db", "list_recycled_prefix");
+    for (int i = 0; i < BENCH_DB_PROBES; i++) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "/bench/d%d/", (i * 7919) % 1000);
+        options.path_prefix = prefix;
+        time_list(pages, &options, 1, 100);
+    }
+    // Ranked trigram lookups of one file name among all rows, with the index
+    // caught up as the daemon keeps it between requests
+    update_path_index(&bench_system, -1);
+    init_list_options(&options);
+    options.limit = SEARCH_LIMIT;
+    Series* searches = new_series(results, "large_db", "search");
+    for (int i = 0; i < BENCH_DB_PROBES; i++) {
+        char term[32];
+        snprintf(term, sizeof(term), "f%d.txt", (int)(((long long)i * 7919) % rows));
+        char* terms[] = { term };
+        options.terms = terms;
+        options.term_count = 1;
+        time_list(searches, &options, 1, 1);
+    }
+    init_list_options(&options);
+    time_list(new_series(results, "large_db", "list_recycled"), &options, 3,
+              rows + BENCH_DB_PROBES);
+
+    // Spread across the table, skipping the rows the purge below will take
+    int* ids = malloc(BENCH_DB_PROBES * sizeof(int));
+    for (int i = 0; ids != NULL && i < BENCH_DB_PROBES; i++) {
+        ids[i] = first_id + (int)(((long long)i * 104729 + 1) % rows);
+        if (expired > 0 && (ids[i] - first_id) % (rows / expired) == 0) {
+            ids[i]++;
+        }
+    }
+    if (ids == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    time_restore(new_series(results, "large_db", "restore_file"), ids, BENCH_DB_PROBES);
+    free(ids);
+
+    time_purge(new_series(results, "large_db", "purge_expired"), expired);
+
+    free_paths(paths, BENCH_DB_PROBES);
+    free(dir);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples, in microseconds
+static double percentile_us(const Series* series, int pct) {
+    if (series->count == 0) {
+        return 0;
+    }
+    int rank = (series->count * pct + 99) / 100;
+    return series->samples[rank > 0 ? rank - 1 : 0] * 1e6;
+}
+
+static int write_results(const Results* results, const BenchConfig* config, const char* path) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    struct utsname host;
+    uname(&host);
+    fprintf(out, "{\n  \"timestamp\": %ld,\n", (long)wall_clock_now());
+    fprintf(out, "  \"kernel\": \"%s\",\n  \"machine\": \"%s\",\n", host.release, host.machine);
+    fprintf(out, "  \"schema_version\": %d,\n  \"sqlite\": \"%s\",\n",
+            SCHEMA_VERSION, sqlite3_libversion());
+    fprintf(out, "  \"config\": {\"small_files\": %d, \"huge_file_bytes\": %lld, \"db_rows\": %d},\n",
+            config->small_files, config->huge_file_bytes, config->db_rows);
+    fprintf(out, "  \"results\": [\n");
+
+    for (int i = 0; i < results->count; i++) {
+        Series* series = &results->series[i];
+        double total = 0;
+        for (int j = 0; j < series->count; j++) {
+            total += series->samples[j];
+        }
+        qsort(series->samples, series->count, sizeof(double), compare_doubles);
+        double items_per_sec = total > 0 ? series->items / total : 0;
+
+        fprintf(out, "    {\"scenario\": \"%s\", \"operation\": \"%s\", \"calls\": %d, "
+                "\"items\": %lld, \"seconds\": %.6f, \"calls_per_sec\": %.1f, "
+                "\"items_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f}%s\n",
+                series->scenario, series->operation, series->count, series->items, total,
+                total > 0 ? series->count / total : 0, items_per_sec,
+                percentile_us(series, 50), percentile_us(series, 99),
+                i + 1 < results->count ? "," : "");
+        printf("%-12s %-22s %8d calls %12.1f items/s  p50 %10.1f us  p99 %10.1f us\n",
+               series->scenario, series->operation, series->count, items_per_sec,
+               percentile_us(series, 50), percentile_us(series, 99));
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0;
+}
+
+static void print_usage(void) {
+    printf("Usage: auto_delete_bench [-o results.json] [-n small_files] [-s huge_file_size] "
+           "[-r db_rows]\n");
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config = {
+        .small_files = BENCH_SMALL_FILES,
+        .huge_file_bytes = BENCH_HUGE_FILE_BYTES,
+        .db_rows = BENCH_DB_ROWS,
+        .output = BENCH_DEFAULT_OUTPUT,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:n:s:r:h")) != -1) {
+        switch (opt) {
+            case 'o': config.output = optarg; break;
+            case 'n': config.small_files = atoi(optarg); break;
+            case 's':
+                if (!parse_size(optarg, &config.huge_file_bytes)) {
+                    fprintf(stderr, "Error: Invalid size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r': config.db_rows = atoi(optarg); break;
+            default:
+                print_usage();
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (config.small_files <= 0 || config.db_rows <= 0) {
+        print_usage();
+        return 1;
+    }
+
+    const char* tmp = getenv("TMPDIR");
+    char* scratch = format_string("%s/auto_delete_bench.XXXXXX", tmp ? tmp : "/tmp");
+    if (scratch == NULL || mkdtemp(scratch) == NULL) {
+        fprintf(stderr, "Error creating scratch directory: %s\n", strerror(errno));
+        return 1;
+    }
+    // The engine keeps its bin and database under HOME
+    setenv("HOME", scratch, 1);
+
+    devnull = fopen("/dev/null", "w");
+    if (devnull == NULL || !init_system(&bench_system)) {
+        fprintf(stderr, "Error initializing system in %s\n", scratch);
+        return 1;
+    }
+    char* work = path_join(scratch, "work");
+    make_dir(work);
+
+    Results results = {0};
+    bench_small_files(&results, &config, work);
+    bench_policy(&results, &config, work);
+    bench_huge_files(&results, &config, work);
+    bench_trees(&results, work);
+    int writers_ok = bench_concurrent_writers(&results, work);
+    bench_large_database(&results, &config, work);
+
+    cleanup_system(&bench_system);
+    fclose(devnull);
+
+    int ok = write_results(&results, &config, config.output);
+    if (ok) {
+        printf("Results written to %s\n", config.output);
+    }
+
+    remove_tree(scratch, 0);
+    for (int i = 0; i < results.count; i++) {
+        free(results.series[i].samples);
+    }
+    free(results.series);
+    free(work);
+    free(scratch);
+    return ok && writers_ok ? 0 : 1;
+}
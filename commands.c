@@ -0,0 +1,417 @@
+/* commands.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "auto_delete.h"
+
+static int parse_int(const char* text, int* value) {
+    char* end;
+    long parsed = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0') {
+        return 0;
+    }
+    *value = (int)parsed;
+    return 1;
+}
+
+// Retentions are seconds from now; negative ones would collide with
+// RETENTION_POLICY and mean nothing anyway
+static int parse_retention(const char* text, int* value) {
+    return parse_int(text, value) && *value >= 0;
+}
+
+// Matches "--name value" and "--name=value"; returns the value or NULL
+static const char* option_value(const char* name, int argc, char* argv[], int* i) {
+    size_t len = strlen(name);
+    if (strncmp(argv[*i], name, len) != 0) {
+        return NULL;
+    }
+    if (argv[*i][len] == '=') {
+        return argv[*i] + len + 1;
+    }
+    if (argv[*i][len] == '\0' && *i + 1 < argc) {
+        return argv[++(*i)];
+    }
+    return NULL;
+}
+
+// Appends NUL-delimited paths read from stdin (as produced by find -print0)
+static int read_stdin_paths(FILE* in, char*** paths, int* count, int* capacity) {
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    
+    while ((len = getdelim(&line, &line_cap, '\0', in)) != -1) {
+        if (len > 0 && line[len - 1] == '\0') {
+            len--;
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (*count == *capacity) {
+            int new_capacity = *capacity ? *capacity * 2 : 1024;
+            char** grown = realloc(*paths, new_capacity * sizeof(char*));
+            if (grown == NULL) {
+                free(line);
+                return 0;
+            }
+            *paths = grown;
+            *capacity = new_capacity;
+        }
+        (*paths)[(*count)++] = strndup(line, len);
+    }
+    
+    free(line);
+    return 1;
+}
+
+// "-r", "-f", "-rf" and the like, which rm users pass out of habit
+static int is_rm_flags(const char* arg) {
+    if (arg[0] != '-' || arg[1] == '\0') {
+        return 0;
+    }
+    for (const char* p = arg + 1; *p; p++) {
+        if (*p != 'r' && *p != 'R' && *p != 'f') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static char* run_delete(AutoDeleteSystem* system, int argc, char* argv[], FILE* in, FILE* err) {
+    int retention_secs = RETENTION_POLICY;
+    int retention_given = 0;
+    int from_stdin = 0;
+    int i = 2;
+    
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        const char* arg = argv[i];
+        const char* value;
+        if (strcmp(arg, "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(arg, "--stdin") == 0 || strcmp(arg, "-0") == 0) {
+            from_stdin = 1;
+        } else if ((value = option_value("--retention", argc, argv, &i)) != NULL) {
+            if (!parse_retention(value, &retention_secs)) {
+                return strdup("Error: retention must be a non-negative number");
+            }
+            retention_given = 1;
+        } else if (is_rm_flags(arg)) {
+            // Aliased to rm: directories are moved whole anyway
+            continue;
+        } else {
+            return format_string("Error: unknown option %s", arg);
+        }
+    }
+    
+    char** operands = argv + i;
+    int operand_count = argc - i;
+    
+    // Keep the original "delete <file_path> [retention_seconds]" form working
+    struct stat st;
+    if (!from_stdin && !retention_given && operand_count == 2 &&
+        stat(operands[1], &st) != 0 && parse_int(operands[1], &retention_secs)) {
+        if (retention_secs < 0) {
+            return strdup("Error: retention must be a non-negative number");
+        }
+        operand_count = 1;
+    }
+    
+    if (!from_stdin) {
+        if (operand_count == 0) {
+            return NULL;
+        }
+        if (operand_count == 1) {
+            return delete_file(system, operands[0], retention_secs);
+        }
+        return delete_files(system, operands, operand_count, retention_secs, err);
+    }
+    
+    int count = 0;
+    int capacity = 0;
+    char** paths = NULL;
+    int ok = 1;
+    for (int j = 0; ok && j < operand_count; j++) {
+        if (count == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 1024;
+            char** grown = realloc(paths, new_capacity * sizeof(char*));
+            if (grown == NULL) {
+                ok = 0;
+                break;
+            }
+            paths = grown;
+            capacity = new_capacity;
+        }
+        paths[count] = strdup(operands[j]);
+        ok = paths[count++] != NULL;
+    }
+    
+    char* result;
+    if (!ok || !read_stdin_paths(in, &paths, &count, &capacity)) {
+        result = strdup("Error: Memory allocation failed");
+    } else if (count == 0) {
+        result = strdup("No paths given on stdin");
+    } else {
+        result = delete_files(system, paths, count, retention_secs, err);
+    }
+    
+    for (int j = 0; j < count; j++) {
+        free(paths[j]);
+    }
+    free(paths);
+    return result;
+}
+
+// list, or search when search is set: the same filters, then the terms
+// every path must contain
+static char* run_list(AutoDeleteSystem* system, int argc, char* argv[], FILE* out, int search) {
+    ListOptions options;
+    init_list_options(&options);
+    
+    for (int i = 2; i < argc; i++) {
+        const char* value;
+        long number;
+        int file_id;
+        int first = i == 2;
+        
+        if (search && (argv[i][0] != '-' || argv[i][1] == '\0')) {
+            options.terms = argv + i;
+            options.term_count = argc - i;
+            break;
+        } else if (!search && (value = option_value("--in", argc, argv, &i)) != NULL) {
+            // The entries of one recycled directory instead of the bin
+            if (!parse_int(value, &file_id) || !first || i != argc - 1) {
+                return strdup("Error: list --in takes a directory's file_id and nothing else");
+            }
+            return list_manifest(system, file_id, out);
+        } else if ((value = option_value("--limit", argc, argv, &i)) != NULL) {
+            char* end;
+            options.limit = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || options.limit < 0) {
+                return strdup("Error: --limit must be a non-negative number");
+            }
+        } else if ((value = option_value("--offset", argc, argv, &i)) != NULL) {
+            char* end;
+            options.offset = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || options.offset < 0) {
+                return strdup("Error: --offset must be a non-negative number");
+            }
+        } else if ((value = option_value("--since", argc, argv, &i)) != NULL) {
+            // "@<unix time>" is absolute, anything else is a duration ago
+            if (value[0] == '@') {
+                char* end;
+                options.since = (time_t)strtol(value + 1, &end, 10);
+                if (*end != '\0') {
+                    return strdup("Error: --since=@<unix time> must be a number");
+                }
+            } else if (parse_duration(value, &number)) {
+                options.since = time(NULL) - number;
+            } else {
+                return strdup("Error: --since takes a duration such as 10m or @<unix time>");
+            }
+        } else if ((value = option_value("--path-prefix", argc, argv, &i)) != NULL) {
+            options.path_prefix = value;
+        } else if ((value = option_value("--expiring-within", argc, argv, &i)) != NULL) {
+            if (!parse_duration(value, &number)) {
+                return strdup("Error: --expiring-within takes a duration such as 1h");
+            }
+            options.expiring_within = number;
+        } else if ((value = option_value("--format", argc, argv, &i)) != NULL) {
+            if (strcmp(value, "table") == 0) {
+                options.format = LIST_FORMAT_TABLE;
+            } else if (strcmp(value, "json") == 0) {
+                options.format = LIST_FORMAT_JSON;
+            } else if (strcmp(value, "csv") == 0) {
+                options.format = LIST_FORMAT_CSV;
+            } else if (strcmp(value, "nul") == 0) {
+                options.format = LIST_FORMAT_NUL;
+            } else if (strcmp(value, "ids") == 0) {
+                options.format = LIST_FORMAT_IDS;
+            } else {
+                return format_string("Error: unknown format %s", value);
+            }
+        } else {
+            return format_string("Error: unknown option %s", argv[i]);
+        }
+    }
+    
+    if (search) {
+        if (options.term_count == 0) {
+            return strdup("Usage: auto_delete search [list options] <term>...");
+        }
+        if (options.limit < 0) {
+            options.limit = SEARCH_LIMIT;
+        }
+    }
+    return list_recycled(system, &options, out);
+}
+
+static int run_restore(AutoDeleteSystem* system, int argc, char* argv[], FILE* out, FILE* err) {
+    RestoreOptions options;
+    memset(&options, 0, sizeof(options));
+    int selectors = 0;
+    
+    for (int i = 2; i < argc; i++) {
+        const char* value;
+        long number;
+        
+        if ((value = option_value("--path", argc, argv, &i)) != NULL) {
+            options.path = value;
+            selectors++;
+        } else if ((value = option_value("--prefix", argc, argv, &i)) != NULL) {
+            options.prefix = value;
+            selectors++;
+        } else if ((value = option_value("--glob", argc, argv, &i)) != NULL) {
+            options.glob = value;
+            selectors++;
+        } else if (strcmp(argv[i], "--latest") == 0) {
+            options.latest = 1;
+        } else if ((value = option_value("--since", argc, argv, &i)) != NULL) {
+            if (!parse_duration(value, &number)) {
+                fprintf(out, "Error: --since takes a duration such as 10m\n");
+                return 1;
+            }
+            options.since = time(NULL) - number;
+        } else {
+            fprintf(out, "Error: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    
+    if (selectors != 1 || (options.path ? options.path : options.prefix ? options.prefix
+                                                                         : options.glob)[0] == '\0') {
+        fprintf(out, "Error: restore takes exactly one of --path, --prefix or --glob\n");
+        return 1;
+    }
+    
+    char* result = restore_matching(system, &options, out, err);
+    if (result != NULL) {
+        fprintf(out, "%s\n", result);
+        free(result);
+    }
+    return 0;
+}
+
+// "restore <id> <id>...", as piped from "search --format ids | xargs"
+static int run_restore_ids(AutoDeleteSystem* system, int argc, char* argv[], FILE* out, FILE* err) {
+    int* ids = malloc(argc * sizeof(int));
+    if (ids == NULL) {
+        fprintf(err, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    int count = 0;
+    for (int i = 2; i < argc; i++) {
+        if (!parse_int(argv[i], &ids[count++])) {
+            fprintf(out, "Error: file_id must be a number, not %s\n", argv[i]);
+            free(ids);
+            return 1;
+        }
+    }
+    
+    char* result = restore_ids(system, ids, count, out, err);
+    free(ids);
+    if (result != NULL) {
+        fprintf(out, "%s\n", result);
+        free(result);
+    }
+    return 0;
+}
+
+// "restore <id> --path sub/file...": entries out of a recycled directory
+static int run_restore_entries(AutoDeleteSystem* system, int file_id, int argc, char* argv[],
+                               FILE* out, FILE* err) {
+    char** paths = malloc(argc * sizeof(char*));
+    if (paths == NULL) {
+        fprintf(err, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    int count = 0;
+    for (int i = 3; i < argc; i++) {
+        const char* value = option_value("--path", argc, argv, &i);
+        if (value == NULL) {
+            fprintf(out, "Error: restore <file_id> takes only --path options, not %s\n", argv[i]);
+            free(paths);
+            return 1;
+        }
+        paths[count++] = (char*)value;
+    }
+    
+    char* result = restore_entries(system, file_id, paths, count, out, err);
+    free(paths);
+    if (result != NULL) {
+        fprintf(out, "%s\n", result);
+        free(result);
+    }
+    return 0;
+}
+
+// Runs one CLI command (argv[1]) against system. Output that the CLI would
+// print goes to out/err, so the daemon can run the same code for clients.
+// Returns the process exit status.
+int run_command(AutoDeleteSystem* system, int argc, char* argv[], FILE* in, FILE* out, FILE* err) {
+    char* result = NULL;
+    const char* command = argv[1];
+    
+    if (strcmp(command, "delete") == 0) {
+        result = run_delete(system, argc, argv, in, err);
+        if (result == NULL) {
+            fprintf(out, "Usage: auto_delete delete [-r secs] [--stdin|-0] <file_path>...\n");
+            return 1;
+        }
+    } 
+    else if (strcmp(command, "list") == 0) {
+        result = run_list(system, argc, argv, out, 0);
+    } 
+    else if (strcmp(command, "search") == 0) {
+        result = run_list(system, argc, argv, out, 1);
+    } 
+    else if (strcmp(command, "restore") == 0) {
+        if (argc < 3) {
+            fprintf(out, "Usage: auto_delete restore <file_id>... | <file_id> [--path SUB]... | "
+                         "--path P | --prefix DIR | --glob G [--latest] [--since 10m]\n");
+            return 1;
+        }
+        if (argv[2][0] == '-') {
+            return run_restore(system, argc, argv, out, err);
+        }
+        
+        char* end;
+        int file_id = (int)strtol(argv[2], &end, 10);
+        if (*end != '\0') {
+            fprintf(out, "Error: file_id must be a number\n");
+            return 1;
+        }
+        
+        if (argc > 3 && argv[3][0] == '-') {
+            return run_restore_entries(system, file_id, argc, argv, out, err);
+        }
+        if (argc > 3) {
+            return run_restore_ids(system, argc, argv, out, err);
+        }
+        result = restore_file(system, file_id);
+    } 
+    else if (strcmp(command, "purge") == 0) {
+        result = purge_expired(system, NULL);
+    } 
+    else if (strcmp(command, "fsck") == 0) {
+        result = fsck_bins(system, out);
+    } 
+    else if (strcmp(command, "stats") == 0) {
+        if (!write_stats(system, out)) {
+            fprintf(err, "Error reading statistics: %s\n", sqlite3_errmsg(system->db));
+            return 1;
+        }
+    } 
+    else {
+        fprintf(out, "Unknown command: %s\n", command);
+        return 2;
+    }
+    
+    if (result != NULL) {
+        fprintf(out, "%s\n", result);
+        free(result);
+    }
+    return 0;
+}
@@ -0,0 +1,353 @@
+/* compress.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <zlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "auto_delete.h"
+
+#define COMPRESS_CHUNK_SIZE (256 << 10)
+#define COMPRESS_MIN_BYTES 4096
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+struct CompressWorker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    long min_age;
+};
+
+typedef struct {
+    int id;
+    char* recycled_name;
+    char* recycled_path;
+} ColdEntry;
+
+static int write_all_fd(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Streams in_fd through zlib (gzip framing when compressing, any framing
+// when inflating) into out_fd. Returns 0 or an errno.
+static int pump(int in_fd, int out_fd, int compress) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int rc = compress ? deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                                     Z_DEFAULT_STRATEGY)
+                      : inflateInit2(&zs, 15 + 32);
+    if (rc != Z_OK) {
+        return ENOMEM;
+    }
+
+    unsigned char* in = malloc(COMPRESS_CHUNK_SIZE);
+    unsigned char* out = malloc(COMPRESS_CHUNK_SIZE);
+    int err = (in && out) ? 0 : ENOMEM;
+    int finished = 0;
+
+    while (err == 0 && !finished) {
+        ssize_t n = read(in_fd, in, COMPRESS_CHUNK_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err = errno;
+            break;
+        }
+        zs.next_in = in;
+        zs.avail_in = (uInt)n;
+        int flush = (compress && n == 0) ? Z_FINISH : Z_NO_FLUSH;
+
+        do {
+            zs.next_out = out;
+            zs.avail_out = COMPRESS_CHUNK_SIZE;
+            rc = compress ? deflate(&zs, flush) : inflate(&zs, Z_NO_FLUSH);
+            if (rc == Z_STREAM_ERROR || rc == Z_DATA_ERROR || rc == Z_MEM_ERROR ||
+                rc == Z_NEED_DICT) {
+                err = EIO;
+                break;
+            }
+            err = write_all_fd(out_fd, out, COMPRESS_CHUNK_SIZE - zs.avail_out);
+            if (rc == Z_STREAM_END) {
+                finished = 1;
+            }
+        } while (err == 0 && !finished && zs.avail_out == 0);
+
+        // A truncated compressed file ends without Z_STREAM_END
+        if (err == 0 && !finished && n == 0) {
+            err = compress ? EIO : EINVAL;
+        }
+    }
+
+    if (compress) {
+        deflateEnd(&zs);
+    } else {
+        inflateEnd(&zs);
+    }
+    free(in);
+    free(out);
+    return err;
+}
+
+// Writes a decompressed copy of src to dst (which must not exist), with
+// src's mode and timestamps. Returns 0 or an errno.
+int decompress_file(const char* src, const char* dst) {
+    int in_fd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in_fd < 0) {
+        return errno;
+    }
+    struct stat st;
+    if (fstat(in_fd, &st) != 0) {
+        int err = errno;
+        close(in_fd);
+        return err;
+    }
+
+    int out_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+    if (out_fd < 0) {
+        int err = errno;
+        close(in_fd);
+        return err;
+    }
+
+    int err = pump(in_fd, out_fd, 0);
+    if (err == 0) {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        futimens(out_fd, times);
+    }
+    close(in_fd);
+    if (close(out_fd) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        unlink(dst);
+    }
+    return err;
+}
+
+static int set_codec(AutoDeleteSystem* system, int file_id, const char* codec,
+                     const char* recycled_name, long long size) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_SET_CODEC);
+    if (stmt == NULL) {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, codec, -1, SQLITE_STATIC);
+    if (recycled_name != NULL) {
+        sqlite3_bind_text(stmt, 2, recycled_name, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, size);
+    }
+    sqlite3_bind_int(stmt, 4, file_id);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE && sqlite3_changes(system->db) == 1;
+}
+
+// Points the row at the gzip copy and removes the original in one step
+// under the write lock, so a restore never sees the new row with the
+// original still there, or the old row with it already gone. Returns 0 if
+// the row or the original went away first; the caller drops the copy.
+static int swap_in_compressed(AutoDeleteSystem* system, const ColdEntry* entry,
+                              const char* gz_name, const char* gz_path, long long size) {
+    if (!begin_transaction(system)) {
+        return 0;
+    }
+    if (!set_codec(system, entry->id, CODEC_GZIP, gz_name, size) ||
+        unlink(entry->recycled_path) != 0) {
+        rollback_transaction(system);
+        return 0;
+    }
+    if (!commit_transaction(system)) {
+        // The row still names the original, so put it back before letting go
+        syslog(LOG_ERR, "Failed to record compressed %s: %s", entry->recycled_path,
+               sqlite3_errmsg(system->db));
+        decompress_file(gz_path, entry->recycled_path);
+        rollback_transaction(system);
+        return 0;
+    }
+    return 1;
+}
+
+// Replaces one recycled file with a gzip copy next to it and points the
+// row at it. Files that do not shrink by at least an eighth are marked
+// CODEC_NONE so they are not tried again.
+static void compress_entry(AutoDeleteSystem* system, const ColdEntry* entry) {
+    int in_fd = open(entry->recycled_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (in_fd < 0 || fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink > 1 ||
+        st.st_size < COMPRESS_MIN_BYTES) {
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        set_codec(system, entry->id, CODEC_NONE, NULL, 0);
+        return;
+    }
+
+    char* gz_name = format_string("%s.gz", entry->recycled_name);
+    char* gz_path = format_string("%s.gz", entry->recycled_path);
+    int out_fd = (gz_name && gz_path)
+        ? open(gz_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777)
+        : -1;
+    if (out_fd < 0) {
+        syslog(LOG_WARNING, "Cannot create %s: %s", gz_path ? gz_path : entry->recycled_path,
+               strerror(errno));
+        close(in_fd);
+        free(gz_name);
+        free(gz_path);
+        return;
+    }
+
+    int err = pump(in_fd, out_fd, 1);
+    struct stat gz_st;
+    if (err == 0 && fstat(out_fd, &gz_st) != 0) {
+        err = errno;
+    }
+    if (err == 0) {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        futimens(out_fd, times);
+    }
+    close(in_fd);
+    if (close(out_fd) != 0 && err == 0) {
+        err = errno;
+    }
+
+    if (err != 0 || gz_st.st_size > st.st_size - st.st_size / 8) {
+        unlink(gz_path);
+        if (err != 0) {
+            syslog(LOG_WARNING, "Failed to compress %s: %s", entry->recycled_path, strerror(err));
+        } else {
+            set_codec(system, entry->id, CODEC_NONE, NULL, 0);
+        }
+    } else if (!swap_in_compressed(system, entry, gz_name, gz_path,
+                                   (long long)gz_st.st_blocks * 512)) {
+        // Restored, purged or deduplicated while we were compressing
+        unlink(gz_path);
+    }
+
+    free(gz_name);
+    free(gz_path);
+}
+
+// Compresses up to max_files entries deleted at or before cutoff. Returns
+// 1 when more may be waiting.
+int compress_cold_entries(AutoDeleteSystem* system, time_t cutoff, int max_files) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_COLD);
+    if (stmt == NULL) {
+        return 0;
+    }
+    sqlite3_bind_int64(stmt, 1, cutoff);
+    sqlite3_bind_int(stmt, 2, system->dedup);
+    sqlite3_bind_int(stmt, 3, max_files);
+
+    ColdEntry* entries = calloc(max_files, sizeof(ColdEntry));
+    int count = 0;
+    while (entries != NULL && count < max_files && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* recycled_name = (const char*)sqlite3_column_text(stmt, 1);
+        const char* bin_path = (const char*)sqlite3_column_text(stmt, 2);
+        entries[count].id = sqlite3_column_int(stmt, 0);
+        entries[count].recycled_name = strdup(recycled_name ? recycled_name : "");
+        entries[count].recycled_path = recycled_location(system, bin_path,
+                                                        recycled_name ? recycled_name : "");
+        count++;
+    }
+    sqlite3_reset(stmt);
+
+    for (int i = 0; i < count; i++) {
+        if (entries[i].recycled_name != NULL && entries[i].recycled_path != NULL) {
+            compress_entry(system, &entries[i]);
+        }
+        free(entries[i].recycled_name);
+        free(entries[i].recycled_path);
+    }
+    free(entries);
+    return count == max_files;
+}
+
+// Idle I/O class and lowest CPU priority, for the calling thread only
+static void lower_priority(void) {
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+// The worker has its own database connection; WAL lets it write alongside
+// the daemon's main loop.
+static void* worker_main(void* arg) {
+    CompressWorker* worker = arg;
+    lower_priority();
+
+    AutoDeleteSystem system;
+    if (!init_system(&system)) {
+        syslog(LOG_ERR, "Compression worker could not open the database");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    while (!worker->stop) {
+        pthread_mutex_unlock(&worker->lock);
+        int more = compress_cold_entries(&system, wall_clock_now() - worker->min_age,
+                                         COMPRESS_BATCH_FILES);
+        pthread_mutex_lock(&worker->lock);
+
+        if (!more && !worker->stop) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += worker->min_age < COMPRESS_SCAN_INTERVAL ? worker->min_age
+                                                                     : COMPRESS_SCAN_INTERVAL;
+            pthread_cond_timedwait(&worker->wake, &worker->lock, &until);
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    cleanup_system(&system);
+    return NULL;
+}
+
+CompressWorker* compress_worker_start(long min_age) {
+    CompressWorker* worker = calloc(1, sizeof(CompressWorker));
+    if (worker == NULL) {
+        return NULL;
+    }
+    worker->min_age = min_age;
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->wake, NULL);
+
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->wake);
+        free(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+void compress_worker_stop(CompressWorker* worker) {
+    if (worker == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&worker->lock);
+    worker->stop = 1;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_join(worker->thread, NULL);
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->wake);
+    free(worker);
+}
@@ -0,0 +1,239 @@
+/* control.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "auto_delete.h"
+#include "control.h"
+
+char* control_socket_path(const char* home_dir) {
+    return format_string("%s/.recycle_bin/%s", home_dir, CONTROL_SOCKET_NAME);
+}
+
+int is_forwarded_command(const char* command) {
+    return strcmp(command, "delete") == 0 || strcmp(command, "list") == 0 ||
+           strcmp(command, "search") == 0 || strcmp(command, "restore") == 0 ||
+           strcmp(command, "purge") == 0 || strcmp(command, "stats") == 0 ||
+           strcmp(command, "fsck") == 0;
+}
+
+int write_all(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void* data, size_t len) {
+    char* p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int connect_to_daemon(void) {
+    const char* home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        return -1;
+    }
+
+    char* path = control_socket_path(home_dir);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        free(path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    free(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct timeval timeout = { .tv_sec = CONTROL_TIMEOUT_SECS };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+static int wants_stdin(int argc, char* argv[]) {
+    if (strcmp(argv[1], "delete") != 0) {
+        return 0;
+    }
+    for (int i = 2; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strcmp(argv[i], "--stdin") == 0 || strcmp(argv[i], "-0") == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reads stdin to the end; returns 0 on a read error or out of memory
+static int read_input(char** data, size_t* length) {
+    size_t capacity = 0;
+    *data = NULL;
+    *length = 0;
+    for (;;) {
+        if (capacity - *length < 65536) {
+            size_t new_capacity = capacity ? capacity * 2 : 1 << 20;
+            char* grown = realloc(*data, new_capacity);
+            if (grown == NULL) {
+                return 0;
+            }
+            *data = grown;
+            capacity = new_capacity;
+        }
+        ssize_t n = read(STDIN_FILENO, *data + *length, capacity - *length);
+        if (n == 0) {
+            return 1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        *length += n;
+    }
+}
+
+static int send_request(int fd, const char* cwd, int argc, char* argv[],
+                        const char* input, size_t input_length) {
+    if (write_all(fd, cwd, strlen(cwd) + 1) != 0) {
+        return -1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (write_all(fd, argv[i], strlen(argv[i]) + 1) != 0) {
+            return -1;
+        }
+    }
+    if (write_all(fd, "", 1) != 0 || write_all(fd, input, input_length) != 0) {
+        return -1;
+    }
+    return shutdown(fd, SHUT_WR);
+}
+
+int forward_to_daemon(int argc, char* argv[], int* status, FILE** in) {
+    if (getenv("AUTO_DELETE_DIRECT") != NULL || !is_forwarded_command(argv[1])) {
+        return 0;
+    }
+
+    // Only send what the daemon will accept: empty args cannot be framed,
+    // and requests past CONTROL_MAX_REQUEST_BYTES are dropped
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return 0;
+    }
+    size_t size = strlen(cwd) + 2;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '\0') {
+            return 0;
+        }
+        size += strlen(argv[i]) + 1;
+    }
+    if (size > CONTROL_MAX_REQUEST_BYTES) {
+        return 0;
+    }
+
+    int fd = connect_to_daemon();
+    if (fd < 0) {
+        return 0;
+    }
+
+    // stdin is read whole before sending, so its size is known; when it is
+    // too large the command runs directly on what was read
+    char* input = NULL;
+    size_t input_length = 0;
+    if (wants_stdin(argc, argv)) {
+        if (!read_input(&input, &input_length)) {
+            fprintf(stderr, "Error reading stdin: %s\n", strerror(errno));
+            free(input);
+            close(fd);
+            *status = 1;
+            return 1;
+        }
+        if (size + input_length > CONTROL_MAX_REQUEST_BYTES) {
+            close(fd);
+            FILE* buffered = fmemopen(NULL, input_length, "w+");
+            if (buffered == NULL || fwrite(input, 1, input_length, buffered) != input_length) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                if (buffered) fclose(buffered);
+                free(input);
+                *status = 1;
+                return 1;
+            }
+            rewind(buffered);
+            free(input);
+            *in = buffered;
+            return 0;
+        }
+    }
+
+    // Once the request is on the wire the daemon may have acted on it, so
+    // from here on failures are reported rather than retried directly
+    int sent = send_request(fd, cwd, argc, argv, input, input_length);
+    free(input);
+    if (sent != 0) {
+        fprintf(stderr, "Error sending request to daemon: %s\n", strerror(errno));
+        close(fd);
+        *status = 1;
+        return 1;
+    }
+
+    *status = -1;
+    char header[5];
+    while (read_all(fd, header, sizeof(header)) == 0) {
+        uint32_t len;
+        memcpy(&len, header + 1, sizeof(len));
+
+        char* payload = malloc(len ? len : 1);
+        if (payload == NULL || read_all(fd, payload, len) != 0) {
+            free(payload);
+            break;
+        }
+
+        if (header[0] == FRAME_STDOUT) {
+            fwrite(payload, 1, len, stdout);
+        } else if (header[0] == FRAME_STDERR) {
+            fwrite(payload, 1, len, stderr);
+        } else if (header[0] == FRAME_STATUS && len == sizeof(int32_t)) {
+            int32_t value;
+            memcpy(&value, payload, sizeof(value));
+            *status = value;
+        }
+        free(payload);
+    }
+    close(fd);
+
+    if (*status < 0) {
+        fprintf(stderr, "Error: daemon closed the connection without a reply\n");
+        *status = 1;
+    }
+    return 1;
+}
@@ -0,0 +1,31 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Requests the CLI forwards to a running auto_delete_daemon.
+//
+// Request:  <cwd>\0<arg1>\0...<argN>\0\0<stdin bytes>, then EOF (SHUT_WR)
+// Response: frames of <channel byte><uint32 length><payload> until EOF
+#define CONTROL_SOCKET_NAME "daemon.sock"
+#define FRAME_STDOUT 'o'
+#define FRAME_STDERR 'e'
+#define FRAME_STATUS 'x'   // payload is an int32 exit status
+#define CONTROL_TIMEOUT_SECS 30
+#define CONTROL_MAX_REQUEST_BYTES (64 << 20)  // Larger requests run directly instead
+
+char* control_socket_path(const char* home_dir);
+int is_forwarded_command(const char* command);
+
+// Client side: returns 1 and sets *status when the daemon handled the
+// command, 0 when the caller should run it directly (no daemon, or a request
+// too large for it). *in is the stream the command reads paths from; it is
+// replaced when stdin had to be read before deciding.
+int forward_to_daemon(int argc, char* argv[], int* status, FILE** in);
+
+// Shared helpers; return 0 on success, -1 on error
+int write_all(int fd, const void* data, size_t len);
+
+#endif
@@ -1,30 +1,55 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
 #include <syslog.h>
 #include "auto_delete.h"
+#include "control.h"
+#include "daemon.h"
 
-#define DAEMON_NAME       "auto_delete_daemon"
-#define CHECK_INTERVAL    60  
+#define MAX_EVENTS        64
 
-volatile sig_atomic_t running = 1;
+// A client connection; requests are complete once the client shuts down
+// its write side
+typedef struct Connection {
+    int fd;
+    char* buffer;
+    size_t length;
+    size_t capacity;
+    int complete;
+    char* out;
+    size_t out_length;
+    char* err;
+    size_t err_length;
+    int status;
+    StagedBatch* staged;       // Deletes waiting for the group commit
+    char* reply;               // Framed output, written as the socket drains
+    size_t reply_length;
+    size_t reply_sent;
+    struct Connection* next;
+} Connection;
 
-void handle_signal(int sig) {
-    if (sig == SIGTERM || sig == SIGINT) {
-        syslog(LOG_INFO, "Received signal %d, preparing to shut down", sig);
-        running = 0;
-    }
-}
+static Connection* connections = NULL;
 
-void daemonize() {
+void daemonize(void) {
     pid_t pid, sid;
 
     pid = fork();
     if (pid < 0) exit(EXIT_FAILURE);
-    if (pid > 0) exit(EXIT_SUCCESS);  
+    if (pid > 0) exit(EXIT_SUCCESS);
     umask(0);
     openlog(DAEMON_NAME, LOG_PID, LOG_DAEMON);
     syslog(LOG_INFO, "Starting daemon");
@@ -45,11 +70,424 @@ void daemonize() {
     close(STDERR_FILENO);
 }
 
-int main() {
-    signal(SIGTERM, handle_signal);
-    signal(SIGINT, handle_signal);
-    signal(SIGHUP, handle_signal);  
-    
+// Datagram socket the CLI pokes with new deadlines (see notify_daemon)
+int open_wakeup_socket(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Wakeup socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to create wakeup socket: %s", strerror(errno));
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR, "Failed to bind %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    chmod(path, 0600);
+    return fd;
+}
+
+static int open_control_socket(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Control socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to create control socket: %s", strerror(errno));
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        syslog(LOG_ERR, "Failed to listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    chmod(path, 0600);
+    return fd;
+}
+
+static void accept_clients(int listen_fd, int epoll_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                syslog(LOG_ERR, "accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        // The socket is 0600 already; this also covers a shared bin directory
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+            cred.uid != getuid()) {
+            close(fd);
+            continue;
+        }
+
+        Connection* conn = calloc(1, sizeof(Connection));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->next = connections;
+        connections = conn;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static Connection* find_connection(int fd) {
+    for (Connection* conn = connections; conn != NULL; conn = conn->next) {
+        if (conn->fd == fd) {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+static void close_connection(Connection* conn) {
+    Connection** link = &connections;
+    while (*link != conn) {
+        link = &(*link)->next;
+    }
+    *link = conn->next;
+
+    close(conn->fd);
+    staged_batch_free(conn->staged);
+    free(conn->buffer);
+    free(conn->out);
+    free(conn->err);
+    free(conn->reply);
+    free(conn);
+}
+
+// Reads what is available; returns 1 once the request is complete, -1 if
+// the client should be dropped
+static int read_request(Connection* conn) {
+    for (;;) {
+        if (conn->length > CONTROL_MAX_REQUEST_BYTES) {
+            return -1;
+        }
+        if (conn->capacity - conn->length < 4096 && conn->capacity <= CONTROL_MAX_REQUEST_BYTES) {
+            // One byte past the limit tells a request of exactly the limit
+            // from a larger one
+            size_t new_capacity = conn->capacity ? conn->capacity * 2 : 8192;
+            if (new_capacity > CONTROL_MAX_REQUEST_BYTES + 1) {
+                new_capacity = CONTROL_MAX_REQUEST_BYTES + 1;
+            }
+            char* grown = realloc(conn->buffer, new_capacity);
+            if (grown == NULL) {
+                return -1;
+            }
+            conn->buffer = grown;
+            conn->capacity = new_capacity;
+        }
+
+        ssize_t n = read(conn->fd, conn->buffer + conn->length, conn->capacity - conn->length);
+        if (n > 0) {
+            conn->length += n;
+            continue;
+        }
+        if (n == 0) {
+            conn->complete = 1;
+            return 1;
+        }
+        if (errno == EINTR) continue;
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+}
+
+static int is_delete_request(const Connection* conn) {
+    size_t cwd_len = strnlen(conn->buffer, conn->length);
+    return cwd_len + 1 < conn->length && strcmp(conn->buffer + cwd_len + 1, "delete") == 0;
+}
+
+// Runs the request with the client's working directory, capturing what the
+// CLI would have printed
+static void execute_request(AutoDeleteSystem* system, Connection* conn) {
+    FILE* out = open_memstream(&conn->out, &conn->out_length);
+    FILE* err = open_memstream(&conn->err, &conn->err_length);
+    if (out == NULL || err == NULL) {
+        if (out) fclose(out);
+        if (err) fclose(err);
+        conn->status = 1;
+        return;
+    }
+
+    // Split "<cwd>\0<args...>\0\0<stdin>" in place; the args end at the
+    // empty one, so count them first
+    const char* cwd = conn->buffer;
+    size_t first = strnlen(conn->buffer, conn->length) + 1;
+    size_t pos = first;
+    int count = 0;
+    int terminated = 0;
+    while (pos < conn->length) {
+        size_t len = strnlen(conn->buffer + pos, conn->length - pos);
+        if (pos + len >= conn->length) {
+            break;
+        }
+        pos += len + 1;
+        if (len == 0) {
+            terminated = 1;
+            break;
+        }
+        count++;
+    }
+    char** args = terminated ? malloc((count + 2) * sizeof(char*)) : NULL;
+    int argc = 0;
+    if (args != NULL) {
+        args[argc++] = "auto_delete";
+        for (size_t arg = first; argc <= count; arg += strlen(conn->buffer + arg) + 1) {
+            args[argc++] = conn->buffer + arg;
+        }
+        args[argc] = NULL;
+    }
+
+    if (terminated && args == NULL) {
+        fprintf(err, "Error: Memory allocation failed\n");
+        conn->status = 1;
+    } else if (!terminated || argc < 2 || !is_forwarded_command(args[1])) {
+        fprintf(err, "Error: malformed request\n");
+        conn->status = 1;
+    } else if (chdir(cwd) != 0) {
+        fprintf(err, "Error: cannot enter %s: %s\n", cwd, strerror(errno));
+        conn->status = 1;
+    } else {
+        // fmemopen rejects empty buffers; a lone NUL reads as no paths
+        static char empty_input[1];
+        size_t input_length = conn->length - pos;
+        FILE* in = input_length ? fmemopen(conn->buffer + pos, input_length, "r")
+                                : fmemopen(empty_input, 1, "r");
+        conn->status = run_command(system, argc, args, in, out, err);
+        if (in) fclose(in);
+        chdir("/");
+    }
+
+    free(args);
+    fclose(out);
+    fclose(err);
+}
+
+static void append_frame(FILE* stream, char channel, const void* data, uint32_t len) {
+    fputc(channel, stream);
+    fwrite(&len, sizeof(len), 1, stream);
+    fwrite(data, 1, len, stream);
+}
+
+// Writes as much of the reply as the socket takes without blocking the
+// loop. Returns 1 once all of it is sent, 0 to wait for EPOLLOUT, -1 if
+// the client went away.
+static int flush_reply(Connection* conn) {
+    while (conn->reply_sent < conn->reply_length) {
+        ssize_t n = send(conn->fd, conn->reply + conn->reply_sent,
+                         conn->reply_length - conn->reply_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            syslog(LOG_WARNING, "Failed to reply to client: %s", strerror(errno));
+            return -1;
+        }
+        conn->reply_sent += n;
+    }
+    return 1;
+}
+
+// Frames what the request printed and starts sending it; what does not
+// fit in the socket buffer goes out from EPOLLOUT events
+static int send_reply(Connection* conn, int epoll_fd) {
+    FILE* stream = open_memstream(&conn->reply, &conn->reply_length);
+    if (stream == NULL) {
+        return -1;
+    }
+    int32_t status = conn->status;
+    if (conn->out_length) {
+        append_frame(stream, FRAME_STDOUT, conn->out, conn->out_length);
+    }
+    if (conn->err_length) {
+        append_frame(stream, FRAME_STDERR, conn->err, conn->err_length);
+    }
+    append_frame(stream, FRAME_STATUS, &status, sizeof(status));
+    if (fclose(stream) != 0) {
+        return -1;
+    }
+    free(conn->out);
+    free(conn->err);
+    conn->out = conn->err = NULL;
+
+    int sent = flush_reply(conn);
+    if (sent == 0) {
+        // The request was read to EOF, so only writability matters now
+        struct epoll_event ev = { .events = EPOLLOUT, .data.fd = conn->fd };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    }
+    return sent;
+}
+
+// Replaces what a delete request printed with the error that undid it
+static void fail_request(Connection* conn, const char* error) {
+    free(conn->out);
+    conn->out = format_string("%s\n", error);
+    conn->out_length = conn->out ? strlen(conn->out) : 0;
+    conn->status = 1;
+}
+
+// Serves every request that completed in this loop iteration. Deletes share
+// one transaction (group commit), so concurrent rm's cost a single commit:
+// every request first moves its files with no lock held, then all the rows
+// go in at once, each request's under its own savepoint so one failing
+// undoes only its rows. Returns the number of delete requests served.
+static int serve_requests(AutoDeleteSystem* system, int epoll_fd) {
+    int delete_count = 0;
+    for (Connection* conn = connections; conn != NULL; conn = conn->next) {
+        if (conn->complete && is_delete_request(conn)) {
+            conn->staged = staged_batch_create();
+            system->staging = conn->staged;
+            execute_request(system, conn);
+            system->staging = NULL;
+            delete_count++;
+        }
+    }
+
+    if (delete_count > 0) {
+        // Without the group transaction each batch commits on its own
+        int in_transaction = begin_transaction(system);
+        for (Connection* conn = connections; conn != NULL; conn = conn->next) {
+            char* error = NULL;
+            if (conn->staged != NULL && !staged_batch_record(system, conn->staged, &error)) {
+                syslog(LOG_ERR, "Recording a delete request failed: %s", error ? error : "out of memory");
+                fail_request(conn, error ? error : "Error: Memory allocation failed");
+            }
+            free(error);
+        }
+        if (in_transaction && !commit_transaction(system)) {
+            char* error = format_string("Error committing transaction: %s", sqlite3_errmsg(system->db));
+            syslog(LOG_ERR, "Group commit failed: %s", sqlite3_errmsg(system->db));
+            rollback_transaction(system);
+            for (Connection* conn = connections; conn != NULL; conn = conn->next) {
+                if (conn->staged != NULL && staged_batch_unstage(system, conn->staged)) {
+                    fail_request(conn, error ? error : "Error: Memory allocation failed");
+                }
+            }
+            free(error);
+        }
+    }
+
+    for (Connection* conn = connections; conn != NULL; conn = conn->next) {
+        if (conn->complete && !is_delete_request(conn)) {
+            execute_request(system, conn);
+        }
+    }
+
+    Connection* conn = connections;
+    while (conn != NULL) {
+        Connection* next = conn->next;
+        if (conn->complete) {
+            conn->complete = 0;
+            staged_batch_free(conn->staged);
+            conn->staged = NULL;
+            if (send_reply(conn, epoll_fd) != 0) {
+                close_connection(conn);
+            }
+        }
+        conn = next;
+    }
+    return delete_count;
+}
+
+// Arms the timer for an absolute wall-clock deadline, or disarms it when
+// deadline is 0. Clock changes cancel the timer so the deadline is re-read.
+void arm_timer(int timer_fd, time_t deadline) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL);
+}
+
+// Returns the deadline the timer was armed for, 0 if idle
+static time_t schedule_next(AutoDeleteSystem* system, int timer_fd) {
+    time_t deadline;
+    if (!next_deadline(system, &deadline)) {
+        arm_timer(timer_fd, 0);
+        syslog(LOG_INFO, "Recycle bin empty, sleeping until notified");
+        return 0;
+    }
+
+    // Rows still due after a purge were either deferred by the budget, which
+    // says when to go on, or failed; don't spin on them
+    time_t now = wall_clock_now();
+    if (deadline <= now) {
+        deadline = system->budget.resume_at > now ? system->budget.resume_at : now + RETRY_INTERVAL;
+    }
+
+    arm_timer(timer_fd, deadline);
+    syslog(LOG_INFO, "Next purge scheduled in %ld seconds", (long)(deadline - now));
+    return deadline;
+}
+
+void run_purge(AutoDeleteSystem* system) {
+    int prio = lower_io_priority();
+    char* result = purge_expired(system, &system->budget);
+    restore_io_priority(prio);
+    if (result) {
+        syslog(LOG_INFO, "Purge result: %s", result);
+        free(result);
+    } else {
+        syslog(LOG_ERR, "purge_expired returned NULL");
+    }
+}
+
+static void run_fsck(AutoDeleteSystem* system) {
+    int prio = lower_io_priority();
+    char* result = fsck_bins(system, NULL);
+    restore_io_priority(prio);
+    if (result) {
+        syslog(LOG_INFO, "Reconcile result: %s", result);
+        free(result);
+    }
+}
+
+// Checks the quota and free-space floor; cheap when nothing is over
+void run_eviction(AutoDeleteSystem* system) {
+    int prio = lower_io_priority();
+    char* result = enforce_quota(system);
+    restore_io_priority(prio);
+    if (result) {
+        syslog(LOG_NOTICE, "Eviction result: %s", result);
+        free(result);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        if (strcmp(argv[1], "--system") == 0 && argc == 2) {
+            return run_system_daemon();
+        }
+        fprintf(stderr, "Usage: %s [--system]\n", DAEMON_NAME);
+        return EXIT_FAILURE;
+    }
     daemonize();
 
     AutoDeleteSystem system;
@@ -59,37 +497,177 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    syslog(LOG_INFO, "Auto-delete daemon initialized successfully");
-    syslog(LOG_INFO, "Running purge check every %d seconds", CHECK_INTERVAL);
+    system.stats.started = wall_clock_now();
+    init_purge_budget(&system);
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    int timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    int wakeup_fd = open_wakeup_socket(system.wakeup_socket);
+    char* control_path = control_socket_path(system.home_dir);
+    int control_fd = control_path ? open_control_socket(control_path) : -1;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    BinWatch* watch = bin_watch_open();
+    if (signal_fd < 0 || timer_fd < 0 || wakeup_fd < 0 || control_fd < 0 || epoll_fd < 0) {
+        syslog(LOG_ERR, "Could not set up event loop: %s", strerror(errno));
+        cleanup_system(&system);
+        closelog();
+        exit(EXIT_FAILURE);
+    }
+
+    // Without inotify, stale rows are still caught by fsck and by purge
+    int watched[] = { signal_fd, timer_fd, wakeup_fd, control_fd, watch ? bin_watch_fd(watch) : -1 };
+    for (int i = 0; i < 5 && watched[i] >= 0; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = watched[i] };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watched[i], &ev);
+    }
+
+    syslog(LOG_NOTICE, "Auto-delete daemon initialized successfully");
     syslog(LOG_INFO, "Recycle bin path: %s", system.recycle_bin);
     syslog(LOG_INFO, "Database path: %s", system.db_path);
+    if (watch == NULL) {
+        syslog(LOG_WARNING, "Could not watch the recycle bins: %s", strerror(errno));
+    }
+
+    // Catch up on anything that changed or expired while the daemon was not
+    // running; watching starts first so nothing slips in between
+    if (watch != NULL) {
+        bin_watch_refresh(watch, &system);
+    }
+    // Large files go to a background thread from the first purge on
+    system.reclaimer = reclaim_worker_start();
+    if (system.reclaimer != NULL) {
+        reclaim_resume(system.reclaimer, &system);
+    } else {
+        syslog(LOG_WARNING, "Could not start reclaim thread, unlinking large files directly");
+    }
+    run_fsck(&system);
+    run_purge(&system);
+    run_eviction(&system);
+    create_missing_path_index(&system);
+    time_t armed = schedule_next(&system, timer_fd);
+
+    CompressWorker* compressor = NULL;
+    if (system.compress_after > 0) {
+        compressor = compress_worker_start(system.compress_after);
+        if (compressor == NULL) {
+            syslog(LOG_ERR, "Could not start the compression worker");
+        }
+    }
 
-    // Main daemon loop
+    // Dedup and the path index run in bounded slices while the loop is
+    // otherwise idle, so hashing a large bin never holds up clients
+    int dedup_pending = system.dedup;
+    int index_pending = 1;
+
+    int running = 1;
     while (running) {
-        syslog(LOG_INFO, "Starting daemon check cycle");
-        
-        syslog(LOG_INFO, "Checking for expired files");
-        char* result = purge_expired(&system);
-        if (result) {
-            syslog(LOG_INFO, "Purge result: %s", result);
-            free(result);
-        } else {
-            syslog(LOG_ERR, "purge_expired returned NULL");
-        }
-        
-        if (!running) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, dedup_pending || index_pending ? 0 : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
             break;
         }
-        
-        syslog(LOG_INFO, "Sleeping for %d seconds before next check", CHECK_INTERVAL);
-        
-        for (int i = 0; i < CHECK_INTERVAL && running; i++) {
-            sleep(1);
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == signal_fd) {
+                struct signalfd_siginfo info;
+                while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                    if (info.ssi_signo == SIGTERM || info.ssi_signo == SIGINT) {
+                        syslog(LOG_NOTICE, "Received signal %d, preparing to shut down", info.ssi_signo);
+                        running = 0;
+                    } else {
+                        // SIGHUP: re-read the policy file and the schedule
+                        reload_policy(&system);
+                        armed = schedule_next(&system, timer_fd);
+                    }
+                }
+            } else if (fd == wakeup_fd) {
+                // Sent after every direct-mode delete, so the bins just grew
+                int64_t deadline;
+                while (recv(wakeup_fd, &deadline, sizeof(deadline), 0) == sizeof(deadline)) {
+                    if (armed == 0 || deadline < armed) {
+                        armed = (time_t)deadline;
+                        arm_timer(timer_fd, armed);
+                    }
+                }
+                run_eviction(&system);
+                if (watch != NULL) {
+                    bin_watch_refresh(watch, &system);
+                }
+                dedup_pending = system.dedup;
+                index_pending = 1;
+            } else if (fd == timer_fd) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+                    // ECANCELED: wall clock was changed, recompute
+                    if (errno == ECANCELED) {
+                        armed = schedule_next(&system, timer_fd);
+                    }
+                    continue;
+                }
+                run_purge(&system);
+                run_eviction(&system);
+                armed = schedule_next(&system, timer_fd);
+                index_pending = 1;
+            } else if (watch != NULL && fd == bin_watch_fd(watch)) {
+                bin_watch_process(watch, &system);
+            } else if (fd == control_fd) {
+                accept_clients(control_fd, epoll_fd);
+            } else {
+                Connection* conn = find_connection(fd);
+                if (conn == NULL) {
+                    continue;
+                }
+                if (conn->reply != NULL ? flush_reply(conn) != 0 : read_request(conn) < 0) {
+                    close_connection(conn);
+                }
+            }
+        }
+
+        if (serve_requests(&system, epoll_fd) > 0) {
+            run_eviction(&system);
+            if (watch != NULL) {
+                bin_watch_refresh(watch, &system);
+            }
+            dedup_pending = system.dedup;
+            index_pending = 1;
+        }
+        if (dedup_pending && n == 0) {
+            int prio = lower_io_priority();
+            dedup_pending = dedup_recycled(&system, DEDUP_BATCH_FILES);
+            restore_io_priority(prio);
+        } else if (index_pending && n == 0) {
+            index_pending = update_path_index(&system, INDEX_BATCH_ROWS) > 0;
         }
     }
 
-    syslog(LOG_INFO, "Daemon shutting down");
+    syslog(LOG_NOTICE, "Daemon shutting down");
+    compress_worker_stop(compressor);
+    reclaim_worker_stop(system.reclaimer);
+    system.reclaimer = NULL;
+    bin_watch_close(watch);
+    while (connections != NULL) {
+        close_connection(connections);
+    }
+    close(control_fd);
+    unlink(control_path);
+    free(control_path);
+    close(epoll_fd);
+    close(wakeup_fd);
+    unlink(system.wakeup_socket);
+    close(timer_fd);
+    close(signal_fd);
     cleanup_system(&system);
     closelog();
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,20 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <time.h>
+#include "auto_delete.h"
+
+#define DAEMON_NAME       "auto_delete_daemon"
+#define RETRY_INTERVAL    60  // Delay before retrying entries that failed to purge
+
+// Shared by the per-user daemon (daemon.c) and system mode (system_daemon.c)
+void daemonize(void);
+int open_wakeup_socket(const char* path);
+void arm_timer(int timer_fd, time_t deadline);
+void run_purge(AutoDeleteSystem* system);
+void run_eviction(AutoDeleteSystem* system);
+
+// One root daemon scheduling every user's bins; returns the exit status
+int run_system_daemon(void);
+
+#endif
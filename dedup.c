@@ -0,0 +1,441 @@
+/* dedup.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "auto_delete.h"
+
+#define DEDUP_CHUNK_SIZE (1 << 20)
+
+// Row waiting for the dedup pass, or a stored copy being collected
+typedef struct {
+    int id;
+    int bin_id;
+    long long size;
+    char* bin_path;
+    char* recycled_path;
+} PendingEntry;
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Word-at-a-time 64-bit hash. Only used to find candidates; a match is
+// confirmed byte for byte before anything is linked.
+static uint64_t hash_update(uint64_t hash, const unsigned char* data, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = mix64(hash ^ word) + 0x9e3779b97f4a7c15ULL;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, len - i);
+    return mix64(hash ^ tail ^ ((uint64_t)(len - i) << 56));
+}
+
+static int hash_file(int fd, char* buffer, uint64_t* hash) {
+    uint64_t h = 0x243f6a8885a308d3ULL;
+    for (;;) {
+        ssize_t n = read(fd, buffer, DEDUP_CHUNK_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        if (n == 0) {
+            break;
+        }
+        h = hash_update(h, (unsigned char*)buffer, n);
+    }
+    *hash = h;
+    return 1;
+}
+
+static ssize_t read_full(int fd, char* buffer, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = read(fd, buffer + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+static int same_contents(int fd_a, int fd_b, char* buffer) {
+    char* other = buffer + DEDUP_CHUNK_SIZE;
+    if (lseek(fd_a, 0, SEEK_SET) != 0 || lseek(fd_b, 0, SEEK_SET) != 0) {
+        return 0;
+    }
+    for (;;) {
+        ssize_t n_a = read_full(fd_a, buffer, DEDUP_CHUNK_SIZE);
+        ssize_t n_b = read_full(fd_b, other, DEDUP_CHUNK_SIZE);
+        if (n_a < 0 || n_a != n_b || memcmp(buffer, other, n_a) != 0) {
+            return 0;
+        }
+        if (n_a == 0) {
+            return 1;
+        }
+    }
+}
+
+// Replaces recycled_path with a reflink of the stored copy, keeping its own
+// inode and metadata. Where the filesystem cannot clone, a hardlink to the
+// stored copy is used instead, but only when the two already agree on
+// owner, mode and mtime: the link shares the stored inode, and restoring
+// it must not bring the file back with another file's permissions.
+// Returns 0 or an errno.
+static int replace_with_stored(const char* recycled_path, const struct stat* st, int store_fd,
+                               const char* store_path) {
+    char* temp_path = format_string("%s.dedup", recycled_path);
+    if (temp_path == NULL) {
+        return ENOMEM;
+    }
+
+    int err = 0;
+    struct stat store_st;
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st->st_mode & 07777);
+    if (fd < 0) {
+        err = errno;
+    } else if (ioctl(fd, FICLONE, store_fd) == 0) {
+        struct timespec times[2] = { st->st_atim, st->st_mtim };
+        futimens(fd, times);
+        close(fd);
+    } else {
+        close(fd);
+        unlink(temp_path);
+        if (fstat(store_fd, &store_st) != 0) {
+            err = errno;
+        } else if (store_st.st_mode != st->st_mode || store_st.st_uid != st->st_uid ||
+                   store_st.st_gid != st->st_gid || store_st.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+                   store_st.st_mtim.tv_nsec != st->st_mtim.tv_nsec) {
+            err = EPERM;
+        } else if (link(store_path, temp_path) != 0) {
+            err = errno;
+        }
+    }
+
+    // Exchanging rather than renaming fails if the row was restored or purged
+    // meanwhile, instead of putting the file back where it no longer belongs
+    if (err == 0) {
+        if (renameat2(AT_FDCWD, temp_path, AT_FDCWD, recycled_path, RENAME_EXCHANGE) != 0 &&
+            ((errno != EINVAL && errno != ENOSYS) || rename(temp_path, recycled_path) != 0)) {
+            err = errno;
+        }
+        unlink(temp_path);
+    }
+    free(temp_path);
+    return err;
+}
+
+static int fetch_pending(AutoDeleteSystem* system, PendingEntry* entries, int limit) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_DEDUP_PENDING);
+    if (stmt == NULL) {
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, limit);
+
+    int count = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char* recycled_name = (const char*)sqlite3_column_text(stmt, 1);
+        const char* bin_path = (const char*)sqlite3_column_text(stmt, 2);
+        entries[count].id = sqlite3_column_int(stmt, 0);
+        entries[count].bin_id = sqlite3_column_int(stmt, 3);
+        entries[count].size = sqlite3_column_int64(stmt, 4);
+        entries[count].bin_path = strdup(bin_path ? bin_path : system->recycle_bin);
+        entries[count].recycled_path = recycled_location(system, bin_path,
+                                                        recycled_name ? recycled_name : "");
+        count++;
+    }
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? count : -1;
+}
+
+// Marks a row as examined, linking it to blob_id unless that is 0. Rows
+// restored, purged or handled since fetch_pending are left alone. Returns 1
+// if the row was updated, 0 if it was not, -1 on error.
+static int mark_deduped(AutoDeleteSystem* system, int file_id, int blob_id) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_MARK_DEDUPED);
+    if (stmt == NULL) {
+        return -1;
+    }
+    if (blob_id != 0) {
+        sqlite3_bind_int(stmt, 1, blob_id);
+    }
+    sqlite3_bind_int(stmt, 2, file_id);
+    int rc = sqlite3_step(stmt);
+    int changes = sqlite3_changes(system->db);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? changes > 0 : -1;
+}
+
+// Looks up a stored blob with this key in the entry's bin. Returns its id,
+// 0 if there is none, -1 on error.
+static int find_blob(AutoDeleteSystem* system, const PendingEntry* entry, const char* hash,
+                     long long length) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_BLOB);
+    if (stmt == NULL) {
+        return -1;
+    }
+    if (entry->bin_id != 0) {
+        sqlite3_bind_int(stmt, 1, entry->bin_id);
+    }
+    sqlite3_bind_text(stmt, 2, hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, length);
+
+    int rc = sqlite3_step(stmt);
+    int blob_id = rc == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : (rc == SQLITE_DONE ? 0 : -1);
+    sqlite3_reset(stmt);
+    return blob_id;
+}
+
+static int add_blob(AutoDeleteSystem* system, const PendingEntry* entry, const char* hash,
+                    long long length) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_INSERT_BLOB);
+    if (stmt == NULL) {
+        return 0;
+    }
+    if (entry->bin_id != 0) {
+        sqlite3_bind_int(stmt, 1, entry->bin_id);
+    }
+    sqlite3_bind_text(stmt, 2, hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, length);
+    sqlite3_bind_int64(stmt, 4, entry->size);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? (int)sqlite3_last_insert_rowid(system->db) : 0;
+}
+
+// Returns 1 if the blob was referenced, 0 if it is gone or waiting to be
+// collected, -1 on error.
+static int ref_blob(AutoDeleteSystem* system, int blob_id) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_REF_BLOB);
+    if (stmt == NULL) {
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, blob_id);
+    int rc = sqlite3_step(stmt);
+    int changes = sqlite3_changes(system->db);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? changes > 0 : -1;
+}
+
+// Records a file that now shares an existing blob's stored copy. If the blob
+// was collected in the meantime the file keeps its own copy and is only
+// marked. Returns 0 on a database error.
+static int link_to_blob(AutoDeleteSystem* system, int file_id, int blob_id) {
+    if (!begin_transaction(system)) {
+        return 0;
+    }
+    int marked = mark_deduped(system, file_id, blob_id);
+    int referenced = marked > 0 ? ref_blob(system, blob_id) : 0;
+    if (referenced > 0) {
+        if (commit_transaction(system)) {
+            return 1;
+        }
+        rollback_transaction(system);
+        return 0;
+    }
+    rollback_transaction(system);
+    if (marked < 0 || referenced < 0) {
+        return 0;
+    }
+    return marked == 0 || mark_deduped(system, file_id, 0) >= 0;
+}
+
+// Records a new blob whose stored copy is already linked at store_path. The
+// link is removed again if the row went away. Returns 0 on a database error.
+static int store_blob(AutoDeleteSystem* system, const PendingEntry* entry, const char* hash,
+                      long long length, const char* store_path) {
+    if (!begin_transaction(system)) {
+        unlink(store_path);
+        return 0;
+    }
+    int blob_id = add_blob(system, entry, hash, length);
+    int marked = blob_id > 0 ? mark_deduped(system, entry->id, blob_id) : -1;
+    if (marked > 0 && commit_transaction(system)) {
+        return 1;
+    }
+    rollback_transaction(system);
+    unlink(store_path);
+    return marked == 0;
+}
+
+// Hashes one recycled file and either links it to an identical stored copy
+// or makes it the stored copy for later duplicates. The file work happens
+// outside any transaction; only the row updates are written in one, after
+// checking the row is still pending. Returns 0 on a database error, 1
+// otherwise (files that cannot be deduplicated are just marked).
+static int dedup_entry(AutoDeleteSystem* system, const PendingEntry* entry, char* buffer) {
+    if (entry->recycled_path == NULL || entry->bin_path == NULL) {
+        return mark_deduped(system, entry->id, 0) >= 0;
+    }
+
+    // Directories, small files and files already sharing an inode are left alone
+    int fd = open(entry->recycled_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    uint64_t hash_value;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink > 1 ||
+        st.st_size < DEDUP_MIN_BYTES || !hash_file(fd, buffer, &hash_value)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return mark_deduped(system, entry->id, 0) >= 0;
+    }
+
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)hash_value);
+    char* store_dir = path_join(entry->bin_path, DEDUP_STORE_DIR);
+    char* store_name = format_string("%s-%lld", hash, (long long)st.st_size);
+    char* store_path = (store_dir && store_name) ? path_join(store_dir, store_name) : NULL;
+    free(store_name);
+    if (store_path == NULL) {
+        free(store_dir);
+        close(fd);
+        return 1;
+    }
+
+    int ok = 1;
+    int blob_id = find_blob(system, entry, hash, st.st_size);
+    if (blob_id < 0) {
+        ok = 0;
+    } else if (blob_id > 0) {
+        int store_fd = open(store_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        int err = ENOENT;
+        if (store_fd >= 0 && same_contents(fd, store_fd, buffer)) {
+            err = replace_with_stored(entry->recycled_path, &st, store_fd, store_path);
+        }
+        if (store_fd >= 0) {
+            close(store_fd);
+        }
+        if (err == 0) {
+            ok = link_to_blob(system, entry->id, blob_id);
+        } else {
+            ok = mark_deduped(system, entry->id, 0) >= 0;
+        }
+    } else {
+        // First copy of this content: the store keeps a link to it
+        mkdir(store_dir, 0700);
+        if (link(entry->recycled_path, store_path) == 0) {
+            ok = store_blob(system, entry, hash, st.st_size, store_path);
+        } else {
+            ok = mark_deduped(system, entry->id, 0) >= 0;
+        }
+    }
+
+    close(fd);
+    free(store_dir);
+    free(store_path);
+    return ok;
+}
+
+// Runs the dedup pass over at most max_files rows that have not been
+// examined yet. Returns 1 while more rows are pending.
+int dedup_recycled(AutoDeleteSystem* system, int max_files) {
+    PendingEntry* entries = malloc(max_files * sizeof(PendingEntry));
+    char* buffer = malloc(2 * DEDUP_CHUNK_SIZE);
+    if (entries == NULL || buffer == NULL) {
+        free(entries);
+        free(buffer);
+        return 0;
+    }
+
+    int count = fetch_pending(system, entries, max_files);
+    int done = 0;
+    while (done < count && dedup_entry(system, &entries[done], buffer)) {
+        done++;
+    }
+    if (done < count) {
+        syslog(LOG_ERR, "Dedup pass failed: %s", sqlite3_errmsg(system->db));
+    } else if (count < 0) {
+        syslog(LOG_ERR, "Error reading dedup queue: %s", sqlite3_errmsg(system->db));
+        count = 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(entries[i].bin_path);
+        free(entries[i].recycled_path);
+    }
+    free(entries);
+    free(buffer);
+    return done == max_files;
+}
+
+// Drops stored copies no row refers to any more. Returns the bytes freed.
+long long collect_blobs(AutoDeleteSystem* system) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_UNREFERENCED_BLOBS);
+    if (stmt == NULL) {
+        return 0;
+    }
+
+    int capacity = 0;
+    int count = 0;
+    PendingEntry* blobs = NULL;
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            PendingEntry* grown = realloc(blobs, capacity * sizeof(PendingEntry));
+            if (grown == NULL) {
+                break;
+            }
+            blobs = grown;
+        }
+        const char* hash = (const char*)sqlite3_column_text(stmt, 1);
+        long long length = sqlite3_column_int64(stmt, 2);
+        const char* bin_path = (const char*)sqlite3_column_text(stmt, 3);
+        blobs[count].id = sqlite3_column_int(stmt, 0);
+        blobs[count].size = sqlite3_column_int64(stmt, 4);
+        blobs[count].recycled_path = format_string("%s/%s/%s-%lld",
+                                                   bin_path ? bin_path : system->recycle_bin,
+                                                   DEDUP_STORE_DIR, hash ? hash : "", length);
+        count++;
+    }
+    sqlite3_reset(stmt);
+
+    long long freed = 0;
+    if (count > 0 && begin_transaction(system)) {
+        sqlite3_stmt* delete_stmt = get_statement(system, STMT_DELETE_BLOB);
+        for (int i = 0; i < count && delete_stmt != NULL; i++) {
+            const char* path = blobs[i].recycled_path;
+            if (path != NULL && unlink(path) != 0 && errno != ENOENT) {
+                syslog(LOG_ERR, "Failed to delete stored copy %s: %s", path, strerror(errno));
+                continue;
+            }
+            sqlite3_bind_int(delete_stmt, 1, blobs[i].id);
+            if (sqlite3_step(delete_stmt) == SQLITE_DONE) {
+                freed += blobs[i].size;
+            }
+            sqlite3_reset(delete_stmt);
+        }
+        if (!commit_transaction(system)) {
+            rollback_transaction(system);
+            freed = 0;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(blobs[i].recycled_path);
+    }
+    free(blobs);
+    return freed;
+}
@@ -3,14 +3,45 @@
 #include <stdlib.h>
 #include <string.h>
 #include "auto_delete.h"
+#include "control.h"
 
 void print_usage() {
-    printf("Usage: auto_delete [delete|list|restore|purge] [args]\n");
+    printf("Usage: auto_delete [delete|list|search|restore|purge|fsck|stats] [args]\n");
     printf("Commands:\n");
     printf("  delete <file_path> [retention_seconds] - Move file to recycle bin\n");
+    printf("       (without a retention, the policy file decides; %d secs if none)\n",
+           DEFAULT_RETENTION_SECS);
+    printf("  delete [--retention secs] <path>...  - Move several files in one transaction\n");
+    printf("  delete [--retention secs] --stdin|-0 - Read NUL-delimited paths from stdin\n");
+    printf("       (-r, -f and -rf are accepted and ignored, as for rm)\n");
     printf("  list                               - List files in recycle bin\n");
-    printf("  restore <file_id>                  - Restore file from recycle bin\n");
+    printf("       [--limit N] [--offset N] [--since 10m|@unix] [--path-prefix P]\n");
+    printf("       [--expiring-within 1h] [--format table|json|csv|nul|ids]\n");
+    printf("  list --in <file_id>                - List what a recycled directory holds\n");
+    printf("  search [list options] <term>...    - Paths containing every term, best first\n");
+    printf("       (--format ids | xargs auto_delete restore  restores them)\n");
+    printf("  restore <file_id>...               - Restore files from recycle bin\n");
+    printf("  restore <file_id> --path SUB...    - Restore entries out of a recycled directory\n");
+    printf("  restore --path P | --prefix DIR | --glob G [--latest] [--since 10m]\n");
+    printf("                                     - Restore every match in one transaction\n");
     printf("  purge                              - Remove expired files\n");
+    printf("  fsck                               - Drop rows whose files left the bins\n");
+    printf("  stats                              - Print the daemon's counters and queue state\n");
+    printf("Environment (read by the daemon):\n");
+    printf("  %s=20G      - Evict oldest files when the bins hold more than this\n", QUOTA_ENV);
+    printf("  %s=5G    - Evict oldest files when a bin's filesystem has less free\n", MIN_FREE_ENV);
+    printf("  %s=1        - Link identical recycled files to one stored copy\n", DEDUP_ENV);
+    printf("  %s=2d - Compress entries older than this in the background\n", COMPRESS_ENV);
+    printf("  %s=info   - Syslog verbosity: err, warning, notice, info, debug\n", LOG_LEVEL_ENV);
+    printf("  %s=100  - Purge at most this many files a second\n", PURGE_FILES_RATE_ENV);
+    printf("  %s=200M - Purge at most this many bytes a second\n", PURGE_BYTES_RATE_ENV);
+    printf("  %s=20        - Pause purging while I/O pressure (some avg10 %%) is this high;\n",
+           IO_PRESSURE_ENV);
+    printf("      0 never pauses\n");
+    printf("  %s=FILE      - Retention rules (default ~/%s), one per line:\n",
+           POLICY_ENV, POLICY_FILE);
+    printf("      prefix ~/build 10m | glob */node_modules/* 5m | ext .pdf 7d |\n");
+    printf("      size >1G 1h | default 2m    (first matching line wins)\n");
 }
 
 int main(int argc, char* argv[]) {
@@ -19,70 +50,28 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+    // A running daemon already has the database open; let it do the work
+    int status;
+    FILE* in = stdin;
+    if (forward_to_daemon(argc, argv, &status, &in)) {
+        return status;
+    }
+    
     AutoDeleteSystem system;
     if (!init_system(&system)) {
         fprintf(stderr, "Error initializing auto delete system\n");
         return 1;
     }
     
-    char* result = NULL;
-    const char* command = argv[1];
-    
-    if (strcmp(command, "delete") == 0) {
-        if (argc < 3) {
-            printf("Usage: auto_delete delete <file_path> [retention_seconds]\n");
-            cleanup_system(&system);
-            return 1;
-        }
-        
-        int retention_secs = 60; // Default
-        if (argc >= 4) {
-            char* end;
-            retention_secs = (int)strtol(argv[3], &end, 10);
-            if (*end != '\0') {
-                printf("Error: retention must be a number\n");
-                cleanup_system(&system);
-                return 1;
-            }
-        }
-        
-        result = delete_file(&system, argv[2], retention_secs);
-    } 
-    else if (strcmp(command, "list") == 0) {
-        result = list_recycled(&system);
-    } 
-    else if (strcmp(command, "restore") == 0) {
-        if (argc < 3) {
-            printf("Usage: auto_delete restore <file_id>\n");
-            cleanup_system(&system);
-            return 1;
-        }
-        
-        char* end;
-        int file_id = (int)strtol(argv[2], &end, 10);
-        if (*end != '\0') {
-            printf("Error: file_id must be a number\n");
-            cleanup_system(&system);
-            return 1;
-        }
-        
-        result = restore_file(&system, file_id);
-    } 
-    else if (strcmp(command, "purge") == 0) {
-        result = purge_expired(&system);
-    } 
-    else {
-        printf("Unknown command: %s\n", command);
+    status = run_command(&system, argc, argv, in, stdout, stderr);
+    if (status == 2) {
         print_usage();
-        cleanup_system(&system);
-        return 1;
+        status = 1;
     }
     
-    if (result != NULL) {
-        printf("%s\n", result);
-        free(result);
+    if (in != stdin) {
+        fclose(in);
     }
-    
     cleanup_system(&system);
-    return 0;
-}
\ No newline at end of file
+    return status;
+}
@@ -0,0 +1,395 @@
+/* manifest.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "auto_delete.h"
+
+// A recycled directory is one row, but its manifest lists every entry below
+// it so single files can be restored out of it. Entries are stored in walk
+// order (each directory just before its contents), one record each:
+//
+//   varint shared   bytes of the path kept from the previous entry
+//   varint length   bytes of path that follow
+//   bytes  suffix
+//   byte   type     st_mode >> 12
+//   varint size, varint usage (bytes allocated), varint mtime (zigzag)
+//
+// Paths in a tree share most of their bytes with the entry before them, so
+// front coding keeps a 200k-entry manifest to a few MB, and building it
+// costs no more than the getdents64/fstatat walk that measures the tree.
+
+#define MANIFEST_DENTS_SIZE 32768
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct {
+    Manifest* manifest;
+    char* path;                 // Entry being visited, relative to the root
+    size_t path_length;
+    size_t path_capacity;
+    char* previous;             // Last path written, for front coding
+    size_t previous_length;
+    size_t previous_capacity;
+    long long usage;
+    int failed;                 // Out of memory; the manifest is incomplete
+} ManifestBuilder;
+
+static int reserve(unsigned char** data, size_t length, size_t* capacity, size_t extra) {
+    if (length + extra <= *capacity) {
+        return 1;
+    }
+    size_t new_capacity = *capacity ? *capacity * 2 : 4096;
+    while (new_capacity < length + extra) {
+        new_capacity *= 2;
+    }
+    unsigned char* grown = realloc(*data, new_capacity);
+    if (grown == NULL) {
+        return 0;
+    }
+    *data = grown;
+    *capacity = new_capacity;
+    return 1;
+}
+
+static size_t put_varint(unsigned char* out, unsigned long long value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+static int get_varint(ManifestReader* reader, unsigned long long* value) {
+    unsigned long long result = 0;
+    for (int shift = 0; shift < 64 && reader->offset < reader->length; shift += 7) {
+        unsigned char byte = reader->data[reader->offset++];
+        result |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int append_entry(ManifestBuilder* b, const struct stat* st) {
+    Manifest* m = b->manifest;
+    size_t shared = 0;
+    while (shared < b->previous_length && shared < b->path_length &&
+           b->previous[shared] == b->path[shared]) {
+        shared++;
+    }
+    size_t suffix = b->path_length - shared;
+    long long mtime = (long long)st->st_mtime;
+    unsigned long long zigzag = ((unsigned long long)mtime << 1) ^ (unsigned long long)(mtime >> 63);
+
+    if (!reserve(&m->data, m->length, &m->capacity, suffix + 5 * 10 + 1) ||
+        !reserve((unsigned char**)&b->previous, 0, &b->previous_capacity, b->path_length + 1)) {
+        return 0;
+    }
+    unsigned char* out = m->data + m->length;
+    out += put_varint(out, shared);
+    out += put_varint(out, suffix);
+    memcpy(out, b->path + shared, suffix);
+    out += suffix;
+    *out++ = (unsigned char)(st->st_mode >> 12);
+    out += put_varint(out, (unsigned long long)st->st_size);
+    out += put_varint(out, (unsigned long long)st->st_blocks * 512);
+    out += put_varint(out, zigzag);
+    m->length = out - m->data;
+    m->count++;
+
+    memcpy(b->previous + shared, b->path + shared, suffix);
+    b->previous_length = b->path_length;
+    return 1;
+}
+
+// Appends "/name" (or just name at the top) to the current path
+static int push_name(ManifestBuilder* b, const char* name) {
+    size_t name_length = strlen(name);
+    if (!reserve((unsigned char**)&b->path, b->path_length, &b->path_capacity, name_length + 2)) {
+        return 0;
+    }
+    if (b->path_length > 0) {
+        b->path[b->path_length++] = '/';
+    }
+    memcpy(b->path + b->path_length, name, name_length);
+    b->path_length += name_length;
+    b->path[b->path_length] = '\0';
+    return 1;
+}
+
+static void walk_directory(ManifestBuilder* b, int fd) {
+    char* buffer = malloc(MANIFEST_DENTS_SIZE);
+    if (buffer == NULL) {
+        b->failed = 1;
+        close(fd);
+        return;
+    }
+    for (;;) {
+        long nread = syscall(SYS_getdents64, fd, buffer, MANIFEST_DENTS_SIZE);
+        if (nread <= 0) {
+            break;
+        }
+        for (long pos = 0; pos < nread; ) {
+            struct linux_dirent64* entry = (struct linux_dirent64*)(buffer + pos);
+            pos += entry->d_reclen;
+
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            struct stat st;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            b->usage += (long long)st.st_blocks * 512;
+
+            // After a failed allocation the walk goes on for the usage only
+            size_t saved_length = b->path_length;
+            if (!b->failed && !(push_name(b, name) && append_entry(b, &st))) {
+                b->failed = 1;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                int child = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (child >= 0) {
+                    walk_directory(b, child);
+                }
+            }
+            b->path_length = saved_length;
+        }
+    }
+    free(buffer);
+    close(fd);
+}
+
+// Lists the tree at dir_path into manifest and sets *usage to the bytes
+// allocated to it, the directory itself included (as disk_usage would).
+// Returns 0 when memory ran out; *usage is still the full total then.
+int build_manifest(const char* dir_path, Manifest* manifest, long long* usage) {
+    memset(manifest, 0, sizeof(*manifest));
+    *usage = 0;
+    struct stat st;
+    if (lstat(dir_path, &st) != 0) {
+        return 0;
+    }
+    ManifestBuilder b;
+    memset(&b, 0, sizeof(b));
+    b.manifest = manifest;
+    b.usage = (long long)st.st_blocks * 512;
+
+    int fd = S_ISDIR(st.st_mode)
+        ? open(dir_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+    if (fd >= 0) {
+        walk_directory(&b, fd);
+    }
+    free(b.path);
+    free(b.previous);
+    *usage = b.usage;
+    if (b.failed || fd < 0) {
+        free_manifest(manifest);
+        return 0;
+    }
+    return 1;
+}
+
+void free_manifest(Manifest* manifest) {
+    free(manifest->data);
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+void manifest_reader_init(ManifestReader* reader, const void* data, size_t length) {
+    memset(reader, 0, sizeof(*reader));
+    reader->data = data;
+    reader->length = length;
+}
+
+void manifest_reader_free(ManifestReader* reader) {
+    free(reader->path);
+    reader->path = NULL;
+}
+
+// Decodes the next entry into reader. Returns 0 at the end, or if the data
+// is damaged.
+int manifest_next(ManifestReader* reader) {
+    unsigned long long shared, suffix, size, usage, zigzag;
+    if (reader->offset >= reader->length || !get_varint(reader, &shared) ||
+        !get_varint(reader, &suffix) || shared > reader->path_length ||
+        suffix > reader->length - reader->offset) {
+        return 0;
+    }
+    if (!reserve((unsigned char**)&reader->path, 0, &reader->path_capacity, shared + suffix + 1)) {
+        return 0;
+    }
+    memcpy(reader->path + shared, reader->data + reader->offset, suffix);
+    reader->offset += suffix;
+    reader->path_length = shared + suffix;
+    reader->path[reader->path_length] = '\0';
+
+    if (reader->offset >= reader->length) {
+        return 0;
+    }
+    reader->type = (int)reader->data[reader->offset++] << 12;
+    if (!get_varint(reader, &size) || !get_varint(reader, &usage) || !get_varint(reader, &zigzag)) {
+        return 0;
+    }
+    reader->size = (long long)size;
+    reader->usage = (long long)usage;
+    reader->mtime = (time_t)((long long)(zigzag >> 1) ^ -(long long)(zigzag & 1));
+    return 1;
+}
+
+// Saves manifest for the row file_id, replacing any earlier one
+int store_manifest(AutoDeleteSystem* system, int file_id, const Manifest* manifest) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_INSERT_MANIFEST);
+    if (stmt == NULL) {
+        return 0;
+    }
+    sqlite3_bind_int(stmt, 1, file_id);
+    sqlite3_bind_int64(stmt, 2, manifest->count);
+    sqlite3_bind_blob(stmt, 3, manifest->data ? (const void*)manifest->data : "", (int)manifest->length,
+                      SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE;
+}
+
+// Copies the stored manifest of file_id into manifest. Directories recycled
+// before manifests were kept get one built from the bin instead. Returns 0
+// (with *error set) when there is neither.
+int load_manifest(AutoDeleteSystem* system, int file_id, const char* recycled_path,
+                  Manifest* manifest, char** error) {
+    memset(manifest, 0, sizeof(*manifest));
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_MANIFEST);
+    if (stmt == NULL) {
+        *error = format_string("Error preparing SQL: %s", sqlite3_errmsg(system->db));
+        return 0;
+    }
+    sqlite3_bind_int(stmt, 1, file_id);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        size_t length = (size_t)sqlite3_column_bytes(stmt, 1);
+        const void* data = sqlite3_column_blob(stmt, 1);
+        manifest->count = sqlite3_column_int64(stmt, 0);
+        manifest->data = malloc(length ? length : 1);
+        if (manifest->data == NULL) {
+            sqlite3_reset(stmt);
+            *error = strdup("Error: Memory allocation failed");
+            return 0;
+        }
+        memcpy(manifest->data, data, length);
+        manifest->length = manifest->capacity = length;
+        sqlite3_reset(stmt);
+        return 1;
+    }
+    sqlite3_reset(stmt);
+
+    struct stat st;
+    long long usage;
+    if (lstat(recycled_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        *error = format_string("Error: Entry %d is not a directory", file_id);
+        return 0;
+    }
+    if (!build_manifest(recycled_path, manifest, &usage)) {
+        *error = strdup("Error: Memory allocation failed");
+        return 0;
+    }
+    return 1;
+}
+
+// Copies manifest without the entries for which drop[i] is set, re-coding
+// the paths that lose their predecessor
+int filter_manifest(const Manifest* manifest, const unsigned char* drop, Manifest* kept) {
+    memset(kept, 0, sizeof(*kept));
+    ManifestBuilder b;
+    memset(&b, 0, sizeof(b));
+    b.manifest = kept;
+
+    ManifestReader reader;
+    manifest_reader_init(&reader, manifest->data, manifest->length);
+    int ok = 1;
+    for (long long i = 0; ok && manifest_next(&reader); i++) {
+        if (drop[i]) {
+            continue;
+        }
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_mode = reader.type;
+        st.st_size = reader.size;
+        st.st_blocks = reader.usage / 512;
+        st.st_mtime = reader.mtime;
+        b.path = reader.path;
+        b.path_length = reader.path_length;
+        ok = append_entry(&b, &st);
+    }
+    manifest_reader_free(&reader);
+    free(b.previous);
+    if (!ok) {
+        free_manifest(kept);
+    }
+    return ok;
+}
+
+static char type_letter(int type) {
+    if (S_ISDIR(type)) return 'd';
+    if (S_ISLNK(type)) return 'l';
+    if (S_ISREG(type)) return '-';
+    return '?';
+}
+
+// Prints the entries of the recycled directory file_id, one per line
+char* list_manifest(AutoDeleteSystem* system, int file_id, FILE* out) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_BY_ID);
+    if (stmt == NULL) {
+        return format_string("Error preparing SQL: %s", sqlite3_errmsg(system->db));
+    }
+    sqlite3_bind_int(stmt, 1, file_id);
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        sqlite3_reset(stmt);
+        return format_string("Error: No file with ID %d in recycle bin", file_id);
+    }
+    char* recycled_path = recycled_location(system, (const char*)sqlite3_column_text(stmt, 2),
+                                            (const char*)sqlite3_column_text(stmt, 1));
+    sqlite3_reset(stmt);
+    if (recycled_path == NULL) {
+        return strdup("Error: Memory allocation failed");
+    }
+
+    Manifest manifest;
+    char* error = NULL;
+    int loaded = load_manifest(system, file_id, recycled_path, &manifest, &error);
+    free(recycled_path);
+    if (!loaded) {
+        return error;
+    }
+
+    ManifestReader reader;
+    manifest_reader_init(&reader, manifest.data, manifest.length);
+    long long count = 0;
+    while (manifest_next(&reader)) {
+        char modified[20];
+        struct tm tm_info;
+        localtime_r(&reader.mtime, &tm_info);
+        strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", &tm_info);
+        fprintf(out, "%c %12lld  %s  %s\n", type_letter(reader.type), reader.size, modified,
+                reader.path);
+        count++;
+    }
+    manifest_reader_free(&reader);
+    free_manifest(&manifest);
+    return format_string("%lld entries", count);
+}
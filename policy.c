@@ -0,0 +1,390 @@
+/* policy.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include "auto_delete.h"
+
+// Retention rules, one per line, first match in file order wins:
+//
+//   prefix ~/build          10m    the directory and everything below it
+//   glob   */node_modules/* 5m     fnmatch; without a '/' only the basename
+//   ext    .pdf             7d     case-insensitive
+//   size   >1G              1h     or <4K; files only (directories are not walked)
+//   default                 2m     when nothing else matches
+//
+// Prefixes go into a trie of path components and extensions into a sorted
+// array, so only globs and sizes are checked one by one, and only those
+// earlier in the file than the best match found so far.
+
+typedef struct PolicyNode {
+    char* name;
+    int rule;                       // Lowest rule index ending here, or INT_MAX
+    struct PolicyNode* children;
+    int child_count;
+    int child_capacity;
+} PolicyNode;
+
+typedef struct {
+    char* ext;
+    int rule;
+} ExtRule;
+
+typedef struct {
+    char* pattern;
+    const char* tail;               // Literal end of pattern, checked before fnmatch
+    size_t tail_length;
+    int basename_only;
+    int rule;
+} GlobRule;
+
+typedef struct {
+    long long bytes;
+    int larger;                     // '>' rather than '<'
+    int rule;
+} SizeRule;
+
+struct RetentionPolicy {
+    PolicyNode root;
+    ExtRule* exts;                  // Sorted by extension
+    int ext_count;
+    GlobRule* globs;
+    int glob_count;
+    SizeRule* sizes;
+    int size_count;
+    long* retentions;               // Indexed by rule
+    int rule_count;
+    long default_retention;
+};
+
+static void* grow_array(void* array, int count, int* capacity, size_t size) {
+    if (count < *capacity) {
+        return array;
+    }
+    int new_capacity = *capacity ? *capacity * 2 : 8;
+    void* grown = realloc(array, new_capacity * size);
+    if (grown != NULL) {
+        *capacity = new_capacity;
+    }
+    return grown;
+}
+
+static PolicyNode* child_named(PolicyNode* node, const char* name, size_t len, int create) {
+    for (int i = 0; i < node->child_count; i++) {
+        PolicyNode* child = &node->children[i];
+        if (strlen(child->name) == len && memcmp(child->name, name, len) == 0) {
+            return child;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    PolicyNode* grown = grow_array(node->children, node->child_count, &node->child_capacity,
+                                   sizeof(PolicyNode));
+    if (grown == NULL) {
+        return NULL;
+    }
+    node->children = grown;
+    PolicyNode* child = &node->children[node->child_count];
+    memset(child, 0, sizeof(*child));
+    child->name = strndup(name, len);
+    child->rule = INT_MAX;
+    if (child->name == NULL) {
+        return NULL;
+    }
+    node->child_count++;
+    return child;
+}
+
+static void free_node(PolicyNode* node) {
+    for (int i = 0; i < node->child_count; i++) {
+        free_node(&node->children[i]);
+    }
+    free(node->children);
+    free(node->name);
+}
+
+static int add_prefix(RetentionPolicy* policy, const char* prefix, int rule) {
+    PolicyNode* node = &policy->root;
+    const char* p = prefix;
+    while (*p) {
+        while (*p == '/') p++;
+        const char* end = strchrnul(p, '/');
+        if (end > p && (node = child_named(node, p, end - p, 1)) == NULL) {
+            return 0;
+        }
+        p = end;
+    }
+    if (rule < node->rule) {
+        node->rule = rule;
+    }
+    return 1;
+}
+
+// Lowest rule index among prefixes of path
+static int match_prefix(const RetentionPolicy* policy, const char* path) {
+    const PolicyNode* node = &policy->root;
+    int best = node->rule;
+    const char* p = path;
+    while (*p && node != NULL) {
+        while (*p == '/') p++;
+        const char* end = strchrnul(p, '/');
+        if (end == p) {
+            break;
+        }
+        node = child_named((PolicyNode*)node, p, end - p, 0);
+        if (node != NULL && node->rule < best) {
+            best = node->rule;
+        }
+        p = end;
+    }
+    return best;
+}
+
+static int compare_exts(const void* a, const void* b) {
+    const ExtRule* x = a;
+    const ExtRule* y = b;
+    int cmp = strcasecmp(x->ext, y->ext);
+    return cmp != 0 ? cmp : x->rule - y->rule;
+}
+
+static int match_ext(const RetentionPolicy* policy, const char* path) {
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    const char* dot = strrchr(name, '.');
+    if (dot == NULL || dot == name) {
+        return INT_MAX;
+    }
+    // The first entry for an extension has its lowest rule
+    int lo = 0;
+    int hi = policy->ext_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcasecmp(policy->exts[mid].ext, dot) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < policy->ext_count && strcasecmp(policy->exts[lo].ext, dot) == 0) {
+        return policy->exts[lo].rule;
+    }
+    return INT_MAX;
+}
+
+// "~/x" and "~" are relative to HOME; anything else is used as written
+static char* expand_home(const char* pattern) {
+    const char* home = getenv("HOME");
+    if (home != NULL && pattern[0] == '~' && (pattern[1] == '/' || pattern[1] == '\0')) {
+        return format_string("%s%s", home, pattern + 1);
+    }
+    return strdup(pattern);
+}
+
+static int parse_rule(RetentionPolicy* policy, char* line, int rule, int* ext_capacity,
+                      int* glob_capacity, int* size_capacity) {
+    char* fields[3];
+    int field_count = 0;
+    char* save = NULL;
+    for (char* token = strtok_r(line, " \t", &save); token != NULL;
+         token = strtok_r(NULL, " \t", &save)) {
+        if (field_count == 3) {
+            return 0;
+        }
+        fields[field_count++] = token;
+    }
+
+    long retention;
+    if (field_count == 2 && strcmp(fields[0], "default") == 0) {
+        if (!parse_duration(fields[1], &retention)) {
+            return 0;
+        }
+        policy->default_retention = retention;
+        return 1;
+    }
+    if (field_count != 3 || !parse_duration(fields[2], &retention)) {
+        return 0;
+    }
+    policy->retentions[rule] = retention;
+    const char* kind = fields[0];
+    const char* pattern = fields[1];
+
+    if (strcmp(kind, "prefix") == 0) {
+        char* prefix = expand_home(pattern);
+        int ok = prefix != NULL && prefix[0] == '/' && add_prefix(policy, prefix, rule);
+        free(prefix);
+        return ok;
+    }
+    if (strcmp(kind, "ext") == 0) {
+        ExtRule* exts = grow_array(policy->exts, policy->ext_count, ext_capacity, sizeof(ExtRule));
+        if (exts == NULL) {
+            return 0;
+        }
+        policy->exts = exts;
+        ExtRule* ext = &exts[policy->ext_count];
+        ext->ext = pattern[0] == '.' ? strdup(pattern) : format_string(".%s", pattern);
+        ext->rule = rule;
+        if (ext->ext == NULL) {
+            return 0;
+        }
+        policy->ext_count++;
+        return 1;
+    }
+    if (strcmp(kind, "glob") == 0) {
+        GlobRule* globs = grow_array(policy->globs, policy->glob_count, glob_capacity,
+                                     sizeof(GlobRule));
+        if (globs == NULL) {
+            return 0;
+        }
+        policy->globs = globs;
+        GlobRule* glob = &globs[policy->glob_count];
+        glob->pattern = expand_home(pattern);
+        glob->basename_only = strchr(pattern, '/') == NULL;
+        glob->rule = rule;
+        if (glob->pattern == NULL) {
+            return 0;
+        }
+        glob->tail = glob->pattern;
+        for (const char* p = glob->pattern; *p; p++) {
+            if (*p == '*' || *p == '?' || *p == ']' || *p == '\\') {
+                glob->tail = p + 1;
+            }
+        }
+        glob->tail_length = strlen(glob->tail);
+        policy->glob_count++;
+        return 1;
+    }
+    if (strcmp(kind, "size") == 0) {
+        SizeRule* sizes = grow_array(policy->sizes, policy->size_count, size_capacity,
+                                     sizeof(SizeRule));
+        if (sizes == NULL) {
+            return 0;
+        }
+        policy->sizes = sizes;
+        if (pattern[0] != '>' && pattern[0] != '<') {
+            return 0;
+        }
+        SizeRule* size = &sizes[policy->size_count];
+        size->larger = pattern[0] == '>';
+        size->rule = rule;
+        if (!parse_size(pattern + 1, &size->bytes)) {
+            return 0;
+        }
+        policy->size_count++;
+        return 1;
+    }
+    return 0;
+}
+
+// Compiles the policy file at path. Returns NULL when there is no such
+// file; lines that do not parse are reported and skipped.
+RetentionPolicy* load_policy(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    RetentionPolicy* policy = calloc(1, sizeof(RetentionPolicy));
+    if (policy == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    policy->root.rule = INT_MAX;
+    policy->default_retention = DEFAULT_RETENTION_SECS;
+
+    int ext_capacity = 0;
+    int glob_capacity = 0;
+    int size_capacity = 0;
+    int retention_capacity = 0;
+    char* line = NULL;
+    size_t line_cap = 0;
+    int line_number = 0;
+    while (getline(&line, &line_cap, file) != -1) {
+        line_number++;
+        char* text = line + strspn(line, " \t");
+        text[strcspn(text, "#\r\n")] = '\0';
+        size_t len = strlen(text);
+        while (len > 0 && isspace((unsigned char)text[len - 1])) {
+            text[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+
+        long* retentions = grow_array(policy->retentions, policy->rule_count,
+                                      &retention_capacity, sizeof(long));
+        if (retentions == NULL) {
+            break;
+        }
+        policy->retentions = retentions;
+        if (parse_rule(policy, text, policy->rule_count, &ext_capacity, &glob_capacity,
+                       &size_capacity)) {
+            policy->rule_count++;
+        } else {
+            fprintf(stderr, "Warning: ignoring invalid rule at %s:%d\n", path, line_number);
+            syslog(LOG_WARNING, "Ignoring invalid rule at %s:%d", path, line_number);
+        }
+    }
+    free(line);
+    fclose(file);
+
+    qsort(policy->exts, policy->ext_count, sizeof(ExtRule), compare_exts);
+    return policy;
+}
+
+void free_policy(RetentionPolicy* policy) {
+    if (policy == NULL) {
+        return;
+    }
+    free_node(&policy->root);
+    for (int i = 0; i < policy->ext_count; i++) {
+        free(policy->exts[i].ext);
+    }
+    for (int i = 0; i < policy->glob_count; i++) {
+        free(policy->globs[i].pattern);
+    }
+    free(policy->exts);
+    free(policy->globs);
+    free(policy->sizes);
+    free(policy->retentions);
+    free(policy);
+}
+
+// Retention in seconds for abs_path, which st describes
+long policy_retention(const RetentionPolicy* policy, const char* abs_path, const struct stat* st) {
+    int best = match_prefix(policy, abs_path);
+    int ext_rule = match_ext(policy, abs_path);
+    if (ext_rule < best) {
+        best = ext_rule;
+    }
+
+    for (int i = 0; i < policy->size_count && policy->sizes[i].rule < best; i++) {
+        const SizeRule* size = &policy->sizes[i];
+        if (S_ISREG(st->st_mode) &&
+            (size->larger ? st->st_size > size->bytes : st->st_size < size->bytes)) {
+            best = size->rule;
+        }
+    }
+
+    const char* name = strrchr(abs_path, '/');
+    name = name ? name + 1 : abs_path;
+    size_t length = strlen(abs_path);
+    for (int i = 0; i < policy->glob_count && policy->globs[i].rule < best; i++) {
+        const GlobRule* glob = &policy->globs[i];
+        // Most globs end in a literal ("*.o"); a mismatch there settles it
+        if (glob->tail_length > length ||
+            memcmp(abs_path + length - glob->tail_length, glob->tail, glob->tail_length) != 0) {
+            continue;
+        }
+        if (fnmatch(glob->pattern, glob->basename_only ? name : abs_path, 0) == 0) {
+            best = glob->rule;
+        }
+    }
+
+    return best == INT_MAX ? policy->default_retention : policy->retentions[best];
+}
@@ -0,0 +1,276 @@
+/* reclaim.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "auto_delete.h"
+
+// Unlinking a file of hundreds of GB frees all of its extents in one
+// journal transaction, which can stall every other writer on the volume for
+// seconds. Large files are instead moved into the bin's RECLAIM_DIR, where a
+// background thread shrinks them RECLAIM_STEP_BYTES at a time with a pause
+// between steps and unlinks what is left. The rows go at once, so purges
+// carry on meanwhile; files still queued at shutdown are picked up again
+// from RECLAIM_DIR on the next start.
+
+typedef struct ReclaimJob {
+    char* path;
+    int fd;                     // Opened on the first step
+    dev_t device;
+    long long size;             // Current length; touched by the worker thread only
+    long long remaining;        // size as last published under the lock
+    struct ReclaimJob* next;
+} ReclaimJob;
+
+struct ReclaimWorker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    ReclaimJob* head;
+    ReclaimJob* tail;
+};
+
+static void free_job(ReclaimJob* job) {
+    if (job->fd >= 0) {
+        close(job->fd);
+    }
+    free(job->path);
+    free(job);
+}
+
+// One bounded step of shrinking job's file. Returns 1 once the file is
+// gone (or could not be worked on), 0 while there is more to do.
+static int reclaim_step(ReclaimJob* job) {
+    if (job->fd < 0) {
+        job->fd = open(job->path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (job->fd < 0) {
+            if (errno != ENOENT) {
+                syslog(LOG_WARNING, "Cannot open %s to reclaim it: %s", job->path, strerror(errno));
+                unlink(job->path);
+            }
+            return 1;
+        }
+        struct stat st;
+        if (fstat(job->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1) {
+            unlink(job->path);
+            return 1;
+        }
+        job->size = st.st_size;
+    }
+
+    long long size = job->size > RECLAIM_STEP_BYTES ? job->size - RECLAIM_STEP_BYTES : 0;
+    if (ftruncate(job->fd, size) != 0) {
+        syslog(LOG_WARNING, "Cannot truncate %s, unlinking it whole: %s", job->path,
+               strerror(errno));
+        size = 0;
+    }
+    job->size = size;
+    if (size > 0) {
+        return 0;
+    }
+    if (unlink(job->path) != 0 && errno != ENOENT) {
+        syslog(LOG_ERR, "Failed to delete %s: %s", job->path, strerror(errno));
+    }
+    syslog(LOG_DEBUG, "Reclaimed %s", job->path);
+    return 1;
+}
+
+static void* reclaim_main(void* arg) {
+    ReclaimWorker* worker = arg;
+    lower_io_priority();
+
+    pthread_mutex_lock(&worker->lock);
+    while (!worker->stop) {
+        ReclaimJob* job = worker->head;
+        if (job == NULL) {
+            pthread_cond_wait(&worker->wake, &worker->lock);
+            continue;
+        }
+        // The job stays queued while it runs, so pending bytes stay counted
+        pthread_mutex_unlock(&worker->lock);
+        int done = reclaim_step(job);
+        pthread_mutex_lock(&worker->lock);
+
+        job->remaining = job->size;
+        if (done) {
+            worker->head = job->next;
+            if (worker->head == NULL) {
+                worker->tail = NULL;
+            }
+            free_job(job);
+        } else if (!worker->stop) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += RECLAIM_PAUSE_MS * 1000000L;
+            until.tv_sec += until.tv_nsec / 1000000000L;
+            until.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&worker->wake, &worker->lock, &until);
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+ReclaimWorker* reclaim_worker_start(void) {
+    ReclaimWorker* worker = calloc(1, sizeof(ReclaimWorker));
+    if (worker == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->wake, NULL);
+
+    if (pthread_create(&worker->thread, NULL, reclaim_main, worker) != 0) {
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->wake);
+        free(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+// Files not finished yet stay in RECLAIM_DIR for the next start
+void reclaim_worker_stop(ReclaimWorker* worker) {
+    if (worker == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&worker->lock);
+    worker->stop = 1;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_join(worker->thread, NULL);
+    while (worker->head != NULL) {
+        ReclaimJob* job = worker->head;
+        worker->head = job->next;
+        free_job(job);
+    }
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->wake);
+    free(worker);
+}
+
+static void queue_job(ReclaimWorker* worker, char* path, const struct stat* st) {
+    ReclaimJob* job = calloc(1, sizeof(ReclaimJob));
+    if (job == NULL) {
+        unlink(path);
+        free(path);
+        return;
+    }
+    job->path = path;
+    job->fd = -1;
+    job->device = st->st_dev;
+    job->size = st->st_size;
+    job->remaining = st->st_size;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail != NULL) {
+        worker->tail->next = job;
+    } else {
+        worker->head = job;
+    }
+    worker->tail = job;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// RECLAIM_DIR of the bin holding recycled_path, which is either
+// <bin>/<shard>/<name> or a flat <bin>/<name> from before sharding
+static char* reclaim_dir_for(const char* recycled_path) {
+    char* parent = get_dirname(recycled_path);
+    if (parent == NULL) {
+        return NULL;
+    }
+    const char* last = strrchr(parent, '/');
+    char* bin = last != NULL && is_shard_name(last + 1) ? get_dirname(parent) : strdup(parent);
+    free(parent);
+    char* dir = bin ? path_join(bin, RECLAIM_DIR) : NULL;
+    free(bin);
+    return dir;
+}
+
+// Takes over recycled_path if it is a large regular file with no other
+// links (dedup may share the inode): moves it out of the way and queues it.
+// Returns 0 when the caller should just unlink it.
+int reclaim_submit(ReclaimWorker* worker, const char* recycled_path) {
+    struct stat st;
+    if (lstat(recycled_path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1 ||
+        st.st_size < RECLAIM_MIN_BYTES) {
+        return 0;
+    }
+    char* dir = reclaim_dir_for(recycled_path);
+    const char* name = strrchr(recycled_path, '/');
+    char* target = dir && name ? path_join(dir, name + 1) : NULL;
+    int ok = target != NULL && (mkdir(dir, 0700) == 0 || errno == EEXIST) &&
+             renameat2(AT_FDCWD, recycled_path, AT_FDCWD, target, RENAME_NOREPLACE) == 0;
+    free(dir);
+    if (!ok) {
+        free(target);
+        return 0;
+    }
+    queue_job(worker, target, &st);
+    return 1;
+}
+
+static void resume_bin(ReclaimWorker* worker, const char* bin_path) {
+    char* dir_path = path_join(bin_path, RECLAIM_DIR);
+    DIR* dir = dir_path ? opendir(dir_path) : NULL;
+    if (dir == NULL) {
+        free(dir_path);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char* path = entry->d_name[0] != '.' ? path_join(dir_path, entry->d_name) : NULL;
+        struct stat st;
+        if (path != NULL && lstat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            syslog(LOG_INFO, "Resuming reclaim of %s", path);
+            queue_job(worker, path, &st);
+        } else {
+            free(path);
+        }
+    }
+    closedir(dir);
+    free(dir_path);
+}
+
+// Requeues whatever an earlier run left in the RECLAIM_DIR of every bin
+void reclaim_resume(ReclaimWorker* worker, AutoDeleteSystem* system) {
+    resume_bin(worker, system->recycle_bin);
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_BINS);
+    while (stmt != NULL && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* path = (const char*)sqlite3_column_text(stmt, 1);
+        if (path != NULL) {
+            resume_bin(worker, path);
+        }
+    }
+    if (stmt != NULL) {
+        sqlite3_reset(stmt);
+    }
+}
+
+// Bytes queued but not yet freed on the filesystem holding path, or on
+// every filesystem when path is NULL
+long long reclaim_pending_bytes(ReclaimWorker* worker, const char* path) {
+    struct stat st;
+    if (worker == NULL || (path != NULL && stat(path, &st) != 0)) {
+        return 0;
+    }
+    long long pending = 0;
+    pthread_mutex_lock(&worker->lock);
+    for (ReclaimJob* job = worker->head; job != NULL; job = job->next) {
+        if (path == NULL || job->device == st.st_dev) {
+            pending += job->remaining;
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return pending;
+}
@@ -0,0 +1,561 @@
+/* reconcile.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "auto_delete.h"
+
+#define WATCH_EVENTS (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define WATCH_BIN_EVENTS (WATCH_EVENTS | IN_CREATE)   // The top also sees new shards
+#define WATCH_BUFFER_SIZE 65536
+
+typedef struct {
+    int id;        // 0 for the home bin
+    char* path;
+} BinRef;
+
+// A bin's top directory (shard "") or one of its shard directories
+typedef struct {
+    int wd;
+    int bin_id;
+    char* path;
+    char shard[3];
+} WatchedBin;
+
+struct BinWatch {
+    int fd;
+    WatchedBin* bins;
+    int count;
+    int capacity;
+};
+
+// Open-addressed set of the names found in one bin directory
+typedef struct {
+    char** names;
+    unsigned char* tracked;   // A row refers to the name
+    size_t capacity;          // Power of two
+    size_t count;
+} NameSet;
+
+static uint64_t hash_name(const char* name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t name_set_slot(const NameSet* set, const char* name) {
+    size_t mask = set->capacity - 1;
+    size_t slot = hash_name(name) & mask;
+    while (set->names[slot] != NULL && strcmp(set->names[slot], name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int name_set_grow(NameSet* set) {
+    size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+    NameSet grown = { calloc(capacity, sizeof(char*)), calloc(capacity, 1), capacity, set->count };
+    if (grown.names == NULL || grown.tracked == NULL) {
+        free(grown.names);
+        free(grown.tracked);
+        return 0;
+    }
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (set->names[i] != NULL) {
+            grown.names[name_set_slot(&grown, set->names[i])] = set->names[i];
+        }
+    }
+    free(set->names);
+    free(set->tracked);
+    *set = grown;
+    return 1;
+}
+
+static int name_set_add(NameSet* set, const char* name) {
+    if ((set->count + 1) * 2 > set->capacity && !name_set_grow(set)) {
+        return 0;
+    }
+    size_t slot = name_set_slot(set, name);
+    if (set->names[slot] == NULL) {
+        if ((set->names[slot] = strdup(name)) == NULL) {
+            return 0;
+        }
+        set->count++;
+    }
+    return 1;
+}
+
+// Marks name as tracked; returns 0 if it is not in the set
+static int name_set_claim(NameSet* set, const char* name) {
+    if (set->capacity == 0) {
+        return 0;
+    }
+    size_t slot = name_set_slot(set, name);
+    if (set->names[slot] == NULL) {
+        return 0;
+    }
+    set->tracked[slot] = 1;
+    return 1;
+}
+
+static void name_set_free(NameSet* set) {
+    for (size_t i = 0; i < set->capacity; i++) {
+        free(set->names[i]);
+    }
+    free(set->names);
+    free(set->tracked);
+}
+
+// The database, sockets and dot entries (.store, temporaries) that live in
+// a bin without a row of their own
+static int is_bin_internal(const char* name) {
+    return name[0] == '.' || strncmp(name, "tracking.db", 11) == 0 ||
+           strcmp(name, "wakeup.sock") == 0 || strcmp(name, "daemon.sock") == 0;
+}
+
+static void bind_bin_id(sqlite3_stmt* stmt, int bin_id) {
+    if (bin_id != 0) {
+        sqlite3_bind_int(stmt, 1, bin_id);
+    } else {
+        sqlite3_bind_null(stmt, 1);
+    }
+}
+
+// The home bin followed by every bin registered on another mount
+static BinRef* list_bins(AutoDeleteSystem* system, int* count) {
+    int capacity = 8;
+    BinRef* bins = malloc(capacity * sizeof(BinRef));
+    if (bins == NULL) {
+        return NULL;
+    }
+    bins[0].id = 0;
+    bins[0].path = strdup(system->recycle_bin);
+    *count = 1;
+
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_BINS);
+    while (stmt != NULL && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* path = (const char*)sqlite3_column_text(stmt, 1);
+        if (path == NULL) {
+            continue;
+        }
+        if (*count == capacity) {
+            BinRef* grown = realloc(bins, capacity * 2 * sizeof(BinRef));
+            if (grown == NULL) {
+                break;
+            }
+            bins = grown;
+            capacity *= 2;
+        }
+        bins[*count].id = sqlite3_column_int(stmt, 0);
+        bins[*count].path = strdup(path);
+        (*count)++;
+    }
+    if (stmt != NULL) {
+        sqlite3_reset(stmt);
+    }
+    return bins;
+}
+
+static void free_bins(BinRef* bins, int count) {
+    for (int i = 0; i < count; i++) {
+        free(bins[i].path);
+    }
+    free(bins);
+}
+
+// Adds the entries of one shard directory as "<shard>/<name>"
+static int read_shard_names(int bin_fd, const char* shard, NameSet* set) {
+    int fd = openat(bin_fd, shard, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        int err = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return err == ENOTDIR || err == ELOOP ? 0 : err;
+    }
+    struct dirent* entry;
+    char name[3 + sizeof(entry->d_name)];
+    int err = 0;
+    while (err == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%s/%s", shard, entry->d_name);
+        if (!name_set_add(set, name)) {
+            err = ENOMEM;
+        }
+    }
+    closedir(dir);
+    return err;
+}
+
+// Reads every entry of path and of its shards into set. A missing bin is an
+// error rather than an empty one: its filesystem may just not be mounted.
+static int read_bin_names(const char* path, NameSet* set) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return errno;
+    }
+    struct dirent* entry;
+    int err = 0;
+    while (err == 0 && (entry = readdir(dir)) != NULL) {
+        if (is_bin_internal(entry->d_name)) {
+            continue;
+        }
+        if (is_shard_name(entry->d_name)) {
+            err = read_shard_names(dirfd(dir), entry->d_name, set);
+        } else if (!name_set_add(set, entry->d_name)) {
+            err = ENOMEM;
+        }
+    }
+    closedir(dir);
+    return err;
+}
+
+typedef struct {
+    int id;
+    char* name;
+} TrackedRow;
+
+// One bin: rows are read before the directory so that anything recycled
+// meanwhile is already on disk, and candidates are re-checked with lstat
+// before their rows go. Returns the stale rows removed, or -1.
+static int fsck_bin(AutoDeleteSystem* system, const BinRef* bin, FILE* out,
+                    int* rows_checked, int* untracked) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_BIN_ROWS);
+    if (stmt == NULL) {
+        return -1;
+    }
+    bind_bin_id(stmt, bin->id);
+    int capacity = 1024;
+    int count = 0;
+    TrackedRow* rows = malloc(capacity * sizeof(TrackedRow));
+    while (rows != NULL && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* name = (const char*)sqlite3_column_text(stmt, 1);
+        if (name == NULL) {
+            continue;
+        }
+        if (count == capacity) {
+            TrackedRow* grown = realloc(rows, capacity * 2 * sizeof(TrackedRow));
+            if (grown == NULL) {
+                break;
+            }
+            rows = grown;
+            capacity *= 2;
+        }
+        rows[count].id = sqlite3_column_int(stmt, 0);
+        rows[count].name = strdup(name);
+        count++;
+    }
+    sqlite3_reset(stmt);
+    if (rows == NULL) {
+        return -1;
+    }
+
+    NameSet names = {0};
+    int err = read_bin_names(bin->path, &names);
+    int removed = 0;
+    if (err != 0) {
+        syslog(LOG_WARNING, "Cannot read recycle bin %s: %s", bin->path, strerror(err));
+        if (out != NULL) {
+            fprintf(out, "Skipped %s: %s\n", bin->path, strerror(err));
+        }
+    } else if (begin_transaction(system)) {
+        sqlite3_stmt* del = get_statement(system, STMT_DELETE_BY_ID_NAME);
+        for (int i = 0; del != NULL && i < count; i++) {
+            if (rows[i].name == NULL || name_set_claim(&names, rows[i].name)) {
+                continue;
+            }
+            struct stat st;
+            char* path = path_join(bin->path, rows[i].name);
+            int present = path == NULL || lstat(path, &st) == 0;
+            free(path);
+            if (present) {
+                continue;
+            }
+            sqlite3_bind_int(del, 1, rows[i].id);
+            sqlite3_bind_text(del, 2, rows[i].name, -1, SQLITE_STATIC);
+            if (sqlite3_step(del) == SQLITE_DONE) {
+                removed += sqlite3_changes(system->db);
+            }
+            sqlite3_reset(del);
+        }
+        if (!commit_transaction(system)) {
+            rollback_transaction(system);
+            removed = -1;
+        }
+
+        for (size_t i = 0; i < names.capacity; i++) {
+            if (names.names[i] != NULL && !names.tracked[i]) {
+                (*untracked)++;
+                if (out != NULL) {
+                    fprintf(out, "Untracked: %s/%s\n", bin->path, names.names[i]);
+                }
+            }
+        }
+    } else {
+        removed = -1;
+    }
+
+    *rows_checked += count;
+    name_set_free(&names);
+    for (int i = 0; i < count; i++) {
+        free(rows[i].name);
+    }
+    free(rows);
+    return removed;
+}
+
+// Drops rows whose recycled copy is gone, in one directory pass per bin,
+// and lists files in the bins that no row refers to (they are left alone)
+char* fsck_bins(AutoDeleteSystem* system, FILE* out) {
+    int bin_count = 0;
+    BinRef* bins = list_bins(system, &bin_count);
+    if (bins == NULL) {
+        return strdup("Error: Memory allocation failed");
+    }
+
+    int rows_checked = 0;
+    int untracked = 0;
+    int removed = 0;
+    char* error = NULL;
+    for (int i = 0; i < bin_count && error == NULL; i++) {
+        if (bins[i].path == NULL) {
+            continue;
+        }
+        int n = fsck_bin(system, &bins[i], out, &rows_checked, &untracked);
+        if (n < 0) {
+            error = format_string("Error reconciling %s: %s", bins[i].path,
+                                  sqlite3_errmsg(system->db));
+        } else {
+            removed += n;
+        }
+    }
+    free_bins(bins, bin_count);
+    system->stats.stale_rows += removed;
+
+    if (error != NULL) {
+        return error;
+    }
+    return format_string("Checked %d rows in %d bins: removed %d stale rows, %d untracked files",
+                         rows_checked, bin_count, removed, untracked);
+}
+
+BinWatch* bin_watch_open(void) {
+    BinWatch* watch = calloc(1, sizeof(BinWatch));
+    if (watch == NULL) {
+        return NULL;
+    }
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0) {
+        free(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+int bin_watch_fd(const BinWatch* watch) {
+    return watch->fd;
+}
+
+static void forget_watch(BinWatch* watch, int index) {
+    free(watch->bins[index].path);
+    watch->bins[index] = watch->bins[--watch->count];
+}
+
+static int add_watch(BinWatch* watch, const char* path, int bin_id, const char* shard) {
+    if (watch->count == watch->capacity) {
+        int capacity = watch->capacity ? watch->capacity * 2 : 4;
+        WatchedBin* grown = realloc(watch->bins, capacity * sizeof(WatchedBin));
+        if (grown == NULL) {
+            return 0;
+        }
+        watch->bins = grown;
+        watch->capacity = capacity;
+    }
+    char* watched = shard[0] ? path_join(path, shard) : strdup(path);
+    if (watched == NULL) {
+        return 0;
+    }
+    int wd = inotify_add_watch(watch->fd, watched, shard[0] ? WATCH_EVENTS : WATCH_BIN_EVENTS);
+    if (wd < 0) {
+        syslog(LOG_WARNING, "Cannot watch %s: %s", watched, strerror(errno));
+        free(watched);
+        return 0;
+    }
+    free(watched);
+    for (int i = 0; i < watch->count; i++) {
+        if (watch->bins[i].wd == wd) {
+            return 1;   // Already watched: inotify hands back the same descriptor
+        }
+    }
+    WatchedBin* bin = &watch->bins[watch->count];
+    bin->wd = wd;
+    bin->bin_id = bin_id;
+    bin->path = strdup(path);
+    snprintf(bin->shard, sizeof(bin->shard), "%s", shard);
+    if (bin->path == NULL) {
+        inotify_rm_watch(watch->fd, wd);
+        return 0;
+    }
+    watch->count++;
+    return 1;
+}
+
+// Watches the top of a bin and every shard already in it; shards created
+// later are picked up from the top's IN_CREATE
+static void watch_bin(BinWatch* watch, const BinRef* bin) {
+    if (!add_watch(watch, bin->path, bin->id, "")) {
+        return;
+    }
+    DIR* dir = opendir(bin->path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (is_shard_name(entry->d_name) && entry->d_type == DT_DIR) {
+            add_watch(watch, bin->path, bin->id, entry->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+// Adds watches for every bin not yet watched; bins on newly used mounts
+// appear after deletes
+void bin_watch_refresh(BinWatch* watch, AutoDeleteSystem* system) {
+    int bin_count = 0;
+    BinRef* bins = list_bins(system, &bin_count);
+    if (bins == NULL) {
+        return;
+    }
+    for (int i = 0; i < bin_count; i++) {
+        int known = bins[i].path == NULL;
+        for (int j = 0; !known && j < watch->count; j++) {
+            known = watch->bins[j].shard[0] == '\0' && strcmp(watch->bins[j].path, bins[i].path) == 0;
+        }
+        if (!known) {
+            watch_bin(watch, &bins[i]);
+        }
+    }
+    free_bins(bins, bin_count);
+}
+
+// A name left a watched bin: drop the row unless the name is back already
+static int forget_name(AutoDeleteSystem* system, const WatchedBin* bin, const char* entry) {
+    char* name = bin->shard[0] ? format_string("%s/%s", bin->shard, entry) : strdup(entry);
+    char* path = name ? path_join(bin->path, name) : NULL;
+    struct stat st;
+    int present = path == NULL || lstat(path, &st) == 0;
+    free(path);
+    if (present) {
+        free(name);
+        return 0;
+    }
+
+    sqlite3_stmt* stmt = get_statement(system, STMT_DELETE_BY_NAME);
+    if (stmt == NULL) {
+        free(name);
+        return 0;
+    }
+    bind_bin_id(stmt, bin->bin_id);
+    sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+    int removed = sqlite3_step(stmt) == SQLITE_DONE ? sqlite3_changes(system->db) : 0;
+    sqlite3_reset(stmt);
+    if (removed > 0) {
+        syslog(LOG_INFO, "%s/%s was removed outside auto_delete, dropping its row", bin->path, name);
+    }
+    free(name);
+    return removed;
+}
+
+// Handles every queued event in one transaction. Purges and restores
+// report their own removals here too, but their rows are gone by then so
+// those lookups find nothing. Returns the rows removed.
+int bin_watch_process(BinWatch* watch, AutoDeleteSystem* system) {
+    char buffer[WATCH_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int removed = 0;
+    int resync = 0;
+    int in_transaction = begin_transaction(system);
+
+    for (;;) {
+        ssize_t len = read(watch->fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) continue;
+            break;
+        }
+        for (char* p = buffer; p < buffer + len; ) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                resync = 1;
+                continue;
+            }
+            int index = -1;
+            for (int i = 0; i < watch->count; i++) {
+                if (watch->bins[i].wd == event->wd) {
+                    index = i;
+                    break;
+                }
+            }
+            if (index < 0) {
+                continue;
+            }
+            WatchedBin* bin = &watch->bins[index];
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // The bin or a shard itself went away; its rows are checked as a whole
+                inotify_rm_watch(watch->fd, event->wd);
+                forget_watch(watch, index);
+                resync = 1;
+            } else if (event->mask & IN_CREATE) {
+                if ((event->mask & IN_ISDIR) && bin->shard[0] == '\0' && event->len > 0 &&
+                    is_shard_name(event->name)) {
+                    add_watch(watch, bin->path, bin->bin_id, event->name);
+                }
+            } else if (event->len > 0 && (bin->shard[0] || !is_bin_internal(event->name))) {
+                removed += forget_name(system, bin, event->name);
+            }
+        }
+    }
+
+    if (in_transaction && !commit_transaction(system)) {
+        syslog(LOG_ERR, "Failed to record removed files: %s", sqlite3_errmsg(system->db));
+        rollback_transaction(system);
+        removed = 0;
+    }
+    system->stats.stale_rows += removed;
+
+    if (resync) {
+        char* result = fsck_bins(system, NULL);
+        if (result != NULL) {
+            syslog(LOG_NOTICE, "Recycle bins changed outside auto_delete: %s", result);
+            free(result);
+        }
+        bin_watch_refresh(watch, system);
+    }
+    return removed;
+}
+
+void bin_watch_close(BinWatch* watch) {
+    if (watch == NULL) {
+        return;
+    }
+    for (int i = 0; i < watch->count; i++) {
+        free(watch->bins[i].path);
+    }
+    free(watch->bins);
+    close(watch->fd);
+    free(watch);
+}
@@ -0,0 +1,574 @@
+/* recycle_bins.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <limits.h>
+#include "auto_delete.h"
+#include "remove_tree.h"
+
+#define COPY_CHUNK_SIZE (1 << 20)
+
+// Decodes the \ooo escapes mountinfo uses for spaces, tabs and newlines
+static void unescape_mount_path(char* path) {
+    char* out = path;
+    for (char* in = path; *in; ) {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' &&
+            in[2] >= '0' && in[2] <= '7' && in[3] >= '0' && in[3] <= '7') {
+            *out++ = (char)(((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0'));
+            in += 4;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+static int load_mounts(AutoDeleteSystem* system) {
+    FILE* file = fopen("/proc/self/mountinfo", "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    char* line = NULL;
+    size_t line_cap = 0;
+    int capacity = 0;
+
+    while (getline(&line, &line_cap, file) != -1) {
+        unsigned major_id, minor_id;
+        char mount_point[PATH_MAX];
+        if (sscanf(line, "%*d %*d %u:%u %*s %4095s", &major_id, &minor_id, mount_point) != 3) {
+            continue;
+        }
+        unescape_mount_path(mount_point);
+
+        if (system->mount_count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            MountEntry* grown = realloc(system->mounts, capacity * sizeof(MountEntry));
+            if (grown == NULL) {
+                break;
+            }
+            system->mounts = grown;
+        }
+        system->mounts[system->mount_count].device = makedev(major_id, minor_id);
+        system->mounts[system->mount_count].mount_point = strdup(mount_point);
+        system->mount_count++;
+    }
+
+    free(line);
+    fclose(file);
+    return system->mount_count > 0;
+}
+
+static int is_path_prefix(const char* prefix, const char* path) {
+    size_t len = strlen(prefix);
+    if (strcmp(prefix, "/") == 0) {
+        return path[0] == '/';
+    }
+    return strncmp(prefix, path, len) == 0 && (path[len] == '/' || path[len] == '\0');
+}
+
+// Mount point holding path: the longest mounted prefix, preferring entries
+// whose device matches (bind mounts share a device, btrfs subvolumes don't
+// report the mountinfo device at all)
+static const char* mount_point_for(AutoDeleteSystem* system, const char* path, dev_t device) {
+    const char* best = NULL;
+    const char* best_same_device = NULL;
+
+    for (int i = 0; i < system->mount_count; i++) {
+        const char* mount_point = system->mounts[i].mount_point;
+        if (mount_point == NULL || !is_path_prefix(mount_point, path)) {
+            continue;
+        }
+        if (best == NULL || strlen(mount_point) >= strlen(best)) {
+            best = mount_point;
+        }
+        if (system->mounts[i].device == device &&
+            (best_same_device == NULL || strlen(mount_point) >= strlen(best_same_device))) {
+            best_same_device = mount_point;
+        }
+    }
+
+    // A longer prefix on another device means path sits below a nested mount
+    if (best_same_device != NULL && strlen(best_same_device) == strlen(best)) {
+        return best_same_device;
+    }
+    return best;
+}
+
+// Creates (or validates) <mount>/.recycle_bin-<uid>. Returns NULL if the
+// mount has no usable bin, e.g. read-only or a root-owned top directory.
+static char* prepare_mount_bin(const char* mount_point) {
+    char* name = format_string("%s%u", MOUNT_BIN_PREFIX, (unsigned)getuid());
+    char* path = name ? path_join(mount_point, name) : NULL;
+    free(name);
+    if (path == NULL) {
+        return NULL;
+    }
+
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        free(path);
+        return NULL;
+    }
+
+    // The top of a shared mount may be world-writable; only trust a real
+    // directory that belongs to us
+    struct stat st;
+    if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+        access(path, W_OK) != 0) {
+        free(path);
+        return NULL;
+    }
+
+    return path;
+}
+
+static int register_bin(AutoDeleteSystem* system, const char* path, const char* mount_point,
+                        dev_t device) {
+    sqlite3_stmt* stmt = get_statement(system, STMT_INSERT_BIN);
+    if (stmt == NULL) {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, mount_point, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)device);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        return 0;
+    }
+
+    stmt = get_statement(system, STMT_SELECT_BIN_ID);
+    if (stmt == NULL) {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    int id = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        id = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    return id;
+}
+
+static const RecycleBin* add_bin(AutoDeleteSystem* system, const char* mount_point,
+                                 char* path, int id) {
+    RecycleBin* grown = realloc(system->bins, (system->bin_count + 1) * sizeof(RecycleBin));
+    if (grown == NULL) {
+        free(path);
+        return NULL;
+    }
+    system->bins = grown;
+
+    RecycleBin* bin = &system->bins[system->bin_count++];
+    bin->mount_point = strdup(mount_point);
+    bin->path = path;
+    bin->id = id;
+    return bin;
+}
+
+static const RecycleBin* home_bin(AutoDeleteSystem* system) {
+    if (system->bin_count > 0) {
+        return &system->bins[0];
+    }
+
+    struct stat st;
+    const char* mount_point = NULL;
+    if (load_mounts(system) && stat(system->recycle_bin, &st) == 0) {
+        mount_point = mount_point_for(system, system->recycle_bin, st.st_dev);
+    }
+    return add_bin(system, mount_point ? mount_point : "", strdup(system->recycle_bin), 0);
+}
+
+// Bin that abs_path can be renamed into: the home bin when the file is on
+// the same mount, otherwise the bin at the top of the file's mount. Falls
+// back to the home bin (reached by copying) when that mount has none.
+const RecycleBin* find_recycle_bin(AutoDeleteSystem* system, const char* abs_path) {
+    const RecycleBin* home = home_bin(system);
+    if (home == NULL) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (lstat(abs_path, &st) != 0 || system->mount_count == 0) {
+        return home;
+    }
+
+    const char* mount_point = mount_point_for(system, abs_path, st.st_dev);
+    if (mount_point == NULL) {
+        return home;
+    }
+
+    for (int i = 0; i < system->bin_count; i++) {
+        if (strcmp(system->bins[i].mount_point, mount_point) == 0) {
+            return system->bins[i].path ? &system->bins[i] : home;
+        }
+    }
+
+    char* path = prepare_mount_bin(mount_point);
+    int id = 0;
+    if (path != NULL) {
+        id = register_bin(system, path, mount_point, st.st_dev);
+        if (id == 0) {
+            free(path);
+            path = NULL;
+        }
+    }
+
+    // add_bin may move the array, so re-read the home entry afterwards
+    const RecycleBin* bin = add_bin(system, mount_point, path, id);
+    return (bin && bin->path) ? bin : &system->bins[0];
+}
+
+char* recycled_location(AutoDeleteSystem* system, const char* bin_path, const char* recycled_name) {
+    return path_join(bin_path ? bin_path : system->recycle_bin, recycled_name);
+}
+
+// "<shard>/<seq>", both hex. Multiplicative hashing spreads consecutive
+// sequence numbers evenly over the BIN_SHARDS directories.
+char* shard_recycled_name(long long seq) {
+    unsigned shard = (unsigned)(((unsigned long long)seq * 0x9E3779B97F4A7C15ULL) >> 56);
+    return format_string("%02x/%llx", shard % BIN_SHARDS, (unsigned long long)seq);
+}
+
+int is_shard_name(const char* name) {
+    return isxdigit((unsigned char)name[0]) && !isupper((unsigned char)name[0]) &&
+           isxdigit((unsigned char)name[1]) && !isupper((unsigned char)name[1]) && name[2] == '\0';
+}
+
+// move_path into a sharded name, creating the shard directory on first use
+int move_into_bin(const char* src, const char* dst) {
+    int err = move_path(src, dst);
+    if (err != ENOENT || access(src, F_OK) != 0) {
+        return err;
+    }
+    char* shard = get_dirname(dst);
+    if (shard == NULL) {
+        return ENOMEM;
+    }
+    err = mkdir(shard, 0700) != 0 && errno != EEXIST ? errno : 0;
+    free(shard);
+    return err != 0 ? err : move_path(src, dst);
+}
+
+void free_recycle_bins(AutoDeleteSystem* system) {
+    for (int i = 0; i < system->mount_count; i++) {
+        free(system->mounts[i].mount_point);
+    }
+    for (int i = 0; i < system->bin_count; i++) {
+        free(system->bins[i].mount_point);
+        free(system->bins[i].path);
+    }
+    free(system->mounts);
+    free(system->bins);
+    system->mounts = NULL;
+    system->bins = NULL;
+    system->mount_count = 0;
+    system->bin_count = 0;
+}
+
+// Gives dst the owner, extended attributes (ACLs among them) and mode of
+// src, so a copy across devices restores like a renamed file would. What an
+// unprivileged caller cannot set (another owner, security.* names) is
+// skipped: the copy is then owned by the caller, as cp would leave it.
+static void copy_attributes(const char* src, const char* dst, const struct stat* st) {
+    if (lchown(dst, st->st_uid, st->st_gid) != 0) {
+        // EPERM unless root; the copy keeps the caller as owner
+    }
+
+    ssize_t list_size = llistxattr(src, NULL, 0);
+    char* names = list_size > 0 ? malloc(list_size) : NULL;
+    if (names != NULL) {
+        list_size = llistxattr(src, names, list_size);
+        char* value = NULL;
+        for (ssize_t pos = 0; pos < list_size; pos += strlen(names + pos) + 1) {
+            const char* name = names + pos;
+            ssize_t value_size = lgetxattr(src, name, NULL, 0);
+            if (value_size < 0) {
+                continue;
+            }
+            char* grown = realloc(value, value_size ? value_size : 1);
+            if (grown == NULL) {
+                break;
+            }
+            value = grown;
+            value_size = lgetxattr(src, name, value, value_size);
+            if (value_size >= 0) {
+                lsetxattr(dst, name, value, value_size, 0);
+            }
+        }
+        free(value);
+        free(names);
+    }
+
+    // After the chown, which clears set-id bits, and past the umask
+    if (!S_ISLNK(st->st_mode)) {
+        chmod(dst, st->st_mode & 07777);
+    }
+}
+
+// Copies a regular file with copy_file_range, which stays in the kernel
+// (and can reflink) where the filesystems allow it, and read/write otherwise.
+// Owner and xattrs follow (see copy_attributes). Returns 0 or an errno; a
+// partial destination is removed.
+int copy_file(const char* src, const char* dst) {
+    int in_fd = open(src, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (in_fd < 0) {
+        return errno;
+    }
+
+    struct stat st;
+    if (fstat(in_fd, &st) != 0) {
+        int err = errno;
+        close(in_fd);
+        return err;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(in_fd);
+        return EXDEV;
+    }
+
+    int out_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+    if (out_fd < 0) {
+        int err = errno;
+        close(in_fd);
+        return err;
+    }
+
+    int err = 0;
+    int use_copy_range = 1;
+    char* buffer = NULL;
+    off_t remaining = st.st_size;
+
+    while (remaining > 0) {
+        ssize_t copied;
+        if (use_copy_range) {
+            copied = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0);
+            if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                               errno == EOPNOTSUPP)) {
+                use_copy_range = 0;
+                continue;
+            }
+        } else {
+            if (buffer == NULL && (buffer = malloc(COPY_CHUNK_SIZE)) == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            copied = read(in_fd, buffer, COPY_CHUNK_SIZE);
+            for (ssize_t written = 0; copied > 0 && written < copied; ) {
+                ssize_t n = write(out_fd, buffer + written, copied - written);
+                if (n < 0) {
+                    copied = -1;
+                    break;
+                }
+                written += n;
+            }
+        }
+        if (copied < 0) {
+            err = errno;
+            break;
+        }
+        if (copied == 0) {
+            break;
+        }
+        remaining -= copied;
+    }
+    free(buffer);
+
+    if (err == 0) {
+        copy_attributes(src, dst, &st);
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        futimens(out_fd, times);
+    }
+    close(in_fd);
+    if (close(out_fd) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        unlink(dst);
+    }
+    return err;
+}
+
+static int copy_symlink(const char* src, const char* dst) {
+    char target[PATH_MAX];
+    ssize_t len = readlink(src, target, sizeof(target) - 1);
+    if (len < 0) {
+        return errno;
+    }
+    target[len] = '\0';
+    return symlink(target, dst) == 0 ? 0 : errno;
+}
+
+// Copies anything but a directory: regular files through copy_file, and
+// symlinks, FIFOs, sockets and device nodes recreated as such. A device
+// node needs CAP_MKNOD; without it the error fails the move.
+static int copy_node(const char* src, const char* dst, const struct stat* st) {
+    if (S_ISREG(st->st_mode)) {
+        return copy_file(src, dst);
+    }
+    if (S_ISLNK(st->st_mode)) {
+        int err = copy_symlink(src, dst);
+        if (err == 0) {
+            copy_attributes(src, dst, st);
+        }
+        return err;
+    }
+    if (S_ISFIFO(st->st_mode) || S_ISSOCK(st->st_mode) ||
+        S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode)) {
+        if (mknod(dst, st->st_mode, st->st_rdev) != 0) {
+            return errno;
+        }
+        copy_attributes(src, dst, st);
+        struct timespec times[2] = { st->st_atim, st->st_mtim };
+        utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
+        return 0;
+    }
+    return EOPNOTSUPP;
+}
+
+// Recreates the tree at src under dst, every entry through copy_node.
+// Returns 0 or the first errno.
+static int copy_tree(const char* src, const char* dst, const struct stat* st) {
+    // Stay writable while filling it; the real mode is applied at the end
+    if (mkdir(dst, 0700) != 0) {
+        return errno;
+    }
+    DIR* dir = opendir(src);
+    if (dir == NULL) {
+        return errno;
+    }
+
+    int err = 0;
+    struct dirent* entry;
+    while (err == 0 && (entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        char* child_src = path_join(src, name);
+        char* child_dst = path_join(dst, name);
+        struct stat child_st;
+        if (child_src == NULL || child_dst == NULL) {
+            err = ENOMEM;
+        } else if (lstat(child_src, &child_st) != 0) {
+            err = errno;
+        } else if (S_ISDIR(child_st.st_mode)) {
+            err = copy_tree(child_src, child_dst, &child_st);
+        } else {
+            err = copy_node(child_src, child_dst, &child_st);
+        }
+        free(child_src);
+        free(child_dst);
+    }
+    closedir(dir);
+
+    copy_attributes(src, dst, st);
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
+    return err;
+}
+
+// rename(), or copy + remove when src and dst are on different filesystems.
+// Directory trees are copied file by file, so each file still goes through
+// copy_file_range; src is only removed once all of it was copied. Never
+// replaces an existing dst. Returns 0 or an errno.
+int move_path(const char* src, const char* dst) {
+    int rc = renameat2(AT_FDCWD, src, AT_FDCWD, dst, RENAME_NOREPLACE);
+    if (rc != 0 && (errno == EINVAL || errno == ENOSYS)) {
+        // Filesystems (or kernels) without RENAME_NOREPLACE: check, accepting
+        // the small race
+        struct stat existing;
+        if (lstat(dst, &existing) == 0) {
+            return EEXIST;
+        }
+        rc = rename(src, dst);
+    }
+    if (rc == 0) {
+        return 0;
+    }
+    if (errno != EXDEV) {
+        return errno;
+    }
+
+    struct stat st;
+    if (lstat(src, &st) != 0) {
+        return errno;
+    }
+
+    int err;
+    if (S_ISDIR(st.st_mode)) {
+        err = copy_tree(src, dst, &st);
+        if (err != 0) {
+            remove_tree(dst, 0);
+            return err;
+        }
+        return remove_tree(src, 0);
+    }
+
+    err = copy_node(src, dst, &st);
+    if (err != 0) {
+        return err;
+    }
+    if (unlink(src) != 0) {
+        err = errno;
+        unlink(dst);
+        return err;
+    }
+    return 0;
+}
+
+static long long directory_usage(int parent_fd, const char* name) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    DIR* dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return 0;
+    }
+
+    long long total = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* child = entry->d_name;
+        if (child[0] == '.' && (child[1] == '\0' || (child[1] == '.' && child[2] == '\0'))) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), child, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        total += (long long)st.st_blocks * 512;
+        if (S_ISDIR(st.st_mode)) {
+            total += directory_usage(dirfd(dir), child);
+        }
+    }
+
+    closedir(dir);
+    return total;
+}
+
+// Bytes allocated on disk to path, including everything below it for a
+// directory. This is what removing it gives back, unlike st_size.
+long long disk_usage(const char* path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return 0;
+    }
+    long long total = (long long)st.st_blocks * 512;
+    if (S_ISDIR(st.st_mode)) {
+        total += directory_usage(AT_FDCWD, path);
+    }
+    return total;
+}
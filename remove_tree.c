@@ -0,0 +1,462 @@
+/* remove_tree.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include "remove_tree.h"
+
+#define DENTS_BUFFER_SIZE 65536
+#define MIN_FD_BUDGET 16
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// One directory in a tree being removed. A node stays alive (with its fd
+// open, so children can be reached with *at() calls) until every child has
+// been removed; the last child to finish removes the parent.
+typedef struct TreeNode {
+    struct TreeNode* parent;   // NULL for a submitted root
+    struct TreeNode* root;
+    int fd;
+    atomic_int pending;        // unfinished children, +1 while being scanned
+    atomic_int error;          // first errno in the tree (root only)
+    int* status;               // where the root reports its result
+    char name[];               // relative to parent, absolute for a root
+} TreeNode;
+
+typedef struct {
+    pthread_mutex_t lock;
+    TreeNode** items;
+    int head;
+    int tail;
+    int capacity;
+} WorkQueue;
+
+typedef struct {
+    RemovePool* pool;
+    int index;
+} WorkerArgs;
+
+struct RemovePool {
+    int threads;
+    pthread_t* workers;
+    WorkerArgs* args;
+    WorkQueue* queues;
+    atomic_int queued;         // nodes sitting in any queue
+    atomic_int idle;           // workers waiting on work_ready
+    atomic_int roots_pending;  // submitted trees not finished yet
+    atomic_int fds;            // nodes queued or holding a directory fd
+    int fd_budget;             // most nodes allowed in fds at once
+    atomic_uint next_queue;
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t all_done;
+};
+
+static int queue_push(WorkQueue* queue, TreeNode* node) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->capacity) {
+        int new_capacity = queue->capacity ? queue->capacity * 2 : 64;
+        TreeNode** grown = realloc(queue->items, new_capacity * sizeof(TreeNode*));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&queue->lock);
+            return 0;
+        }
+        queue->items = grown;
+        queue->capacity = new_capacity;
+    }
+    queue->items[queue->tail++] = node;
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+// The owner works depth-first from the back of its own queue ...
+static TreeNode* queue_pop(WorkQueue* queue) {
+    TreeNode* node = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head) {
+        node = queue->items[--queue->tail];
+        if (queue->tail == queue->head) {
+            queue->head = queue->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return node;
+}
+
+// ... while thieves take from the front, where the shallower (larger)
+// subtrees are
+static TreeNode* queue_steal(WorkQueue* queue) {
+    TreeNode* node = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head) {
+        node = queue->items[queue->head++];
+        if (queue->tail == queue->head) {
+            queue->head = queue->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return node;
+}
+
+static void record_error(TreeNode* node, int err) {
+    int expected = 0;
+    atomic_compare_exchange_strong(&node->root->error, &expected, err);
+}
+
+static TreeNode* take_work(RemovePool* pool, int index) {
+    TreeNode* node = queue_pop(&pool->queues[index]);
+    for (int i = 1; node == NULL && i < pool->threads; i++) {
+        node = queue_steal(&pool->queues[(index + i) % pool->threads]);
+    }
+    if (node != NULL) {
+        atomic_fetch_sub(&pool->queued, 1);
+    }
+    return node;
+}
+
+// Drops one reference on node; whoever drops the last one removes the
+// directory and walks up to release its parent the same way.
+static void finish_node(RemovePool* pool, TreeNode* node) {
+    while (node != NULL && atomic_fetch_sub(&node->pending, 1) == 1) {
+        TreeNode* parent = node->parent;
+
+        if (node->fd >= 0) {
+            close(node->fd);
+        }
+        int parent_fd = parent ? parent->fd : AT_FDCWD;
+        if (unlinkat(parent_fd, node->name, AT_REMOVEDIR) != 0 && errno != ENOENT) {
+            record_error(node, errno);
+        }
+
+        atomic_fetch_sub(&pool->fds, 1);
+
+        if (parent == NULL) {
+            *node->status = atomic_load(&node->error);
+            free(node);
+            if (atomic_fetch_sub(&pool->roots_pending, 1) == 1) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->all_done);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            return;
+        }
+
+        free(node);
+        node = parent;
+    }
+}
+
+static void push_work(RemovePool* pool, int index, TreeNode* node) {
+    if (!queue_push(&pool->queues[index], node)) {
+        // Out of memory: leave the subtree in place, but release the node
+        // so its parent (and the tree's waiter) still completes
+        record_error(node, ENOMEM);
+        finish_node(pool, node);
+        return;
+    }
+    atomic_fetch_add(&pool->queued, 1);
+    if (atomic_load(&pool->idle) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work_ready);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static TreeNode* new_node(TreeNode* parent, const char* name, size_t name_len) {
+    TreeNode* node = malloc(sizeof(TreeNode) + name_len + 1);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->parent = parent;
+    node->root = parent ? parent->root : node;
+    node->fd = -1;
+    atomic_init(&node->pending, 1);
+    atomic_init(&node->error, 0);
+    node->status = NULL;
+    memcpy(node->name, name, name_len);
+    node->name[name_len] = '\0';
+    return node;
+}
+
+// Removes the subtree name below parent_fd on the calling thread, holding
+// one fd per level; used once the pool's descriptor budget is spent
+static void remove_inline(TreeNode* node, int parent_fd, const char* name) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        record_error(node, errno);
+        return;
+    }
+    DIR* dir = fdopendir(fd);
+    if (dir == NULL) {
+        record_error(node, errno);
+        close(fd);
+        return;
+    }
+
+    for (;;) {
+        errno = 0;
+        struct dirent* entry = readdir(dir);
+        if (entry == NULL) {
+            if (errno != 0) {
+                record_error(node, errno);
+            }
+            break;
+        }
+        const char* child = entry->d_name;
+        if (child[0] == '.' && (child[1] == '\0' || (child[1] == '.' && child[2] == '\0'))) {
+            continue;
+        }
+        if (entry->d_type != DT_DIR) {
+            if (unlinkat(fd, child, 0) == 0 || errno == ENOENT) {
+                continue;
+            }
+            if (errno != EISDIR) {
+                record_error(node, errno);
+                continue;
+            }
+        }
+        remove_inline(node, fd, child);
+    }
+    closedir(dir);
+
+    if (unlinkat(parent_fd, name, AT_REMOVEDIR) != 0 && errno != ENOENT) {
+        record_error(node, errno);
+    }
+}
+
+// Unlinks every non-directory entry of node and queues its subdirectories
+static void scan_directory(RemovePool* pool, int index, TreeNode* node, char* buffer) {
+    int parent_fd = node->parent ? node->parent->fd : AT_FDCWD;
+    node->fd = openat(parent_fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (node->fd < 0) {
+        record_error(node, errno);
+        finish_node(pool, node);
+        return;
+    }
+
+    for (;;) {
+        long nread = syscall(SYS_getdents64, node->fd, buffer, DENTS_BUFFER_SIZE);
+        if (nread < 0) {
+            record_error(node, errno);
+            break;
+        }
+        if (nread == 0) {
+            break;
+        }
+
+        for (long pos = 0; pos < nread; ) {
+            struct linux_dirent64* entry = (struct linux_dirent64*)(buffer + pos);
+            pos += entry->d_reclen;
+
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            // DT_UNKNOWN entries are tried as files; EISDIR tells us otherwise
+            if (entry->d_type != DT_DIR) {
+                if (unlinkat(node->fd, name, 0) == 0 || errno == ENOENT) {
+                    continue;
+                }
+                if (errno != EISDIR) {
+                    record_error(node, errno);
+                    continue;
+                }
+            }
+
+            if (atomic_fetch_add(&pool->fds, 1) >= pool->fd_budget) {
+                atomic_fetch_sub(&pool->fds, 1);
+                remove_inline(node, node->fd, name);
+                continue;
+            }
+            TreeNode* child = new_node(node, name, strlen(name));
+            if (child == NULL) {
+                atomic_fetch_sub(&pool->fds, 1);
+                record_error(node, ENOMEM);
+                continue;
+            }
+            atomic_fetch_add(&node->pending, 1);
+            push_work(pool, index, child);
+        }
+    }
+
+    finish_node(pool, node);
+}
+
+static void* worker_main(void* arg) {
+    WorkerArgs* args = (WorkerArgs*)arg;
+    RemovePool* pool = args->pool;
+    char* buffer = malloc(DENTS_BUFFER_SIZE);
+
+    for (;;) {
+        TreeNode* node = take_work(pool, args->index);
+        if (node != NULL) {
+            if (buffer == NULL) {
+                record_error(node, ENOMEM);
+                finish_node(pool, node);
+            } else {
+                scan_directory(pool, args->index, node, buffer);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        atomic_fetch_add(&pool->idle, 1);
+        if (atomic_load(&pool->queued) == 0) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->idle, 1);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+RemovePool* remove_pool_create(int threads) {
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > REMOVE_MAX_THREADS) {
+        threads = REMOVE_MAX_THREADS;
+    }
+
+    // Every directory with unfinished children holds an fd open. The pool
+    // keeps to half the soft limit and leaves the rest to the caller.
+    int fd_budget = MIN_FD_BUDGET;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        rlim_t half = limit.rlim_cur == RLIM_INFINITY ? INT_MAX / 2 : limit.rlim_cur / 2;
+        if (half > INT_MAX / 2) {
+            half = INT_MAX / 2;
+        }
+        if ((int)half > fd_budget) {
+            fd_budget = (int)half;
+        }
+    }
+
+    RemovePool* pool = calloc(1, sizeof(RemovePool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->threads = threads;
+    pool->fd_budget = fd_budget;
+    pool->workers = calloc(threads, sizeof(pthread_t));
+    pool->args = calloc(threads, sizeof(WorkerArgs));
+    pool->queues = calloc(threads, sizeof(WorkQueue));
+    if (pool->workers == NULL || pool->args == NULL || pool->queues == NULL) {
+        free(pool->workers);
+        free(pool->args);
+        free(pool->queues);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pool->args[i].pool = pool;
+        pool->args[i].index = i;
+        if (pthread_create(&pool->workers[i], NULL, worker_main, &pool->args[i]) != 0) {
+            pool->threads = i;
+            break;
+        }
+    }
+    if (pool->threads == 0) {
+        remove_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+int remove_pool_submit(RemovePool* pool, const char* path, int* status) {
+    TreeNode* root = new_node(NULL, path, strlen(path));
+    if (root == NULL) {
+        *status = ENOMEM;
+        return 0;
+    }
+    root->status = status;
+    *status = 0;
+
+    atomic_fetch_add(&pool->roots_pending, 1);
+    atomic_fetch_add(&pool->fds, 1);
+    unsigned index = atomic_fetch_add(&pool->next_queue, 1) % pool->threads;
+    push_work(pool, index, root);
+    return 1;
+}
+
+void remove_pool_wait(RemovePool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->roots_pending) > 0) {
+        pthread_cond_wait(&pool->all_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void remove_pool_destroy(RemovePool* pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->threads; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    for (int i = 0; i < pool->threads; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].items);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool->workers);
+    free(pool->args);
+    free(pool->queues);
+    free(pool);
+}
+
+int remove_tree(const char* path, int threads) {
+    RemovePool* pool = remove_pool_create(threads);
+    if (pool == NULL) {
+        return ENOMEM;
+    }
+
+    int status;
+    remove_pool_submit(pool, path, &status);
+    remove_pool_wait(pool);
+    remove_pool_destroy(pool);
+    return status;
+}
@@ -0,0 +1,23 @@
+#ifndef REMOVE_TREE_H
+#define REMOVE_TREE_H
+
+#define REMOVE_MAX_THREADS 16  // Upper bound on workers per pool
+
+typedef struct RemovePool RemovePool;
+
+// Worker pool that deletes directory trees in parallel. Subdirectories are
+// queued per worker and idle workers steal them, so one large tree is
+// spread across all threads. threads <= 0 means one per online CPU.
+RemovePool* remove_pool_create(int threads);
+
+// Queues path (a directory) for recursive removal. *status is set to 0 or
+// the first errno hit inside that tree once remove_pool_wait returns.
+int remove_pool_submit(RemovePool* pool, const char* path, int* status);
+
+void remove_pool_wait(RemovePool* pool);
+void remove_pool_destroy(RemovePool* pool);
+
+// Convenience wrapper: removes one tree and returns 0 or an errno
+int remove_tree(const char* path, int threads);
+
+#endif
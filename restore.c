@@ -0,0 +1,563 @@
+/* restore.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "auto_delete.h"
+
+#define RESTORE_MAX_THREADS 8  // Upper bound on parallel moves in a bulk restore
+
+typedef enum {
+    RESTORE_FAILED,     // Row stays
+    RESTORE_DONE,
+    RESTORE_STALE       // Nothing left in the bin; row is dropped
+} RestoreStatus;
+
+typedef struct {
+    int id;
+    char* original_path;
+    char* directory;
+    char* recycled_path;
+    int compressed;
+    int directory_error;   // From creating the parent directories
+    char* message;
+    RestoreStatus status;
+} RestoreEntry;
+
+// Entries sorted by original path; group g is entries[starts[g] .. starts[g + 1])
+typedef struct {
+    RestoreEntry* entries;
+    int* starts;
+    int group_count;
+    atomic_int next_group;
+} RestoreJob;
+
+static int load_entry(AutoDeleteSystem* system, int file_id, RestoreEntry* entry) {
+    memset(entry, 0, sizeof(*entry));
+    entry->id = file_id;
+    entry->status = RESTORE_FAILED;
+
+    sqlite3_stmt* stmt = get_statement(system, STMT_SELECT_BY_ID);
+    if (stmt == NULL) {
+        entry->message = format_string("Error preparing SQL: %s", sqlite3_errmsg(system->db));
+        return 0;
+    }
+    sqlite3_bind_int(stmt, 1, file_id);
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        sqlite3_reset(stmt);
+        entry->message = format_string("Error: No file with ID %d in recycle bin", file_id);
+        return 0;
+    }
+
+    const char* original_path = (const char*)sqlite3_column_text(stmt, 0);
+    const char* recycled_name = (const char*)sqlite3_column_text(stmt, 1);
+    const char* bin_path = (const char*)sqlite3_column_text(stmt, 2);
+    const char* codec = (const char*)sqlite3_column_text(stmt, 3);
+    entry->original_path = strdup(original_path ? original_path : "");
+    entry->recycled_path = recycled_location(system, bin_path, recycled_name ? recycled_name : "");
+    entry->compressed = codec != NULL && strcmp(codec, CODEC_GZIP) == 0;
+    sqlite3_reset(stmt);
+
+    entry->directory = entry->original_path ? get_dirname(entry->original_path) : NULL;
+    if (entry->directory == NULL || entry->recycled_path == NULL) {
+        entry->message = strdup("Error: Memory allocation failed");
+        return 0;
+    }
+    return 1;
+}
+
+static void free_entry(RestoreEntry* entry) {
+    free(entry->original_path);
+    free(entry->directory);
+    free(entry->recycled_path);
+    free(entry->message);
+}
+
+// mkdir -p. Returns 0 or an errno.
+static int create_parents(const char* directory) {
+    struct stat st;
+    if (stat(directory, &st) == 0) {
+        return S_ISDIR(st.st_mode) ? 0 : ENOTDIR;
+    }
+
+    char* path = strdup(directory);
+    if (path == NULL) {
+        return ENOMEM;
+    }
+    int err = 0;
+    for (char* p = path + 1; err == 0; p++) {
+        if (*p != '/' && *p != '\0') {
+            continue;
+        }
+        char saved = *p;
+        *p = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            err = errno;
+        }
+        *p = saved;
+        if (saved == '\0') {
+            break;
+        }
+    }
+    free(path);
+    return err;
+}
+
+// Moves one entry back to its original path, or next to it with a
+// "_restored" suffix if something else took the name. Touches no database
+// state, so several can run at once.
+static void restore_entry(RestoreEntry* entry) {
+    struct stat st;
+    if (lstat(entry->recycled_path, &st) != 0) {
+        entry->status = RESTORE_STALE;
+        entry->message = format_string("Error: File %s no longer exists in recycle bin",
+                                       entry->original_path);
+        return;
+    }
+    // A deduplicated file may share its inode with the store and other rows
+    int shared_inode = S_ISREG(st.st_mode) && st.st_nlink > 1;
+
+    char* target_path = strdup(entry->original_path);
+    if (target_path != NULL && lstat(target_path, &st) == 0) {
+        char* name = strrchr(target_path, '/');
+        name = name ? name + 1 : target_path;
+        char* last_dot = strrchr(name, '.');
+        char* new_path;
+        if (last_dot != NULL && last_dot != name) {
+            *last_dot = '\0';
+            new_path = format_string("%s_restored.%s", target_path, last_dot + 1);
+        } else {
+            new_path = format_string("%s_restored", target_path);
+        }
+        free(target_path);
+        target_path = new_path;
+    }
+    if (target_path == NULL) {
+        entry->message = strdup("Error: Memory allocation failed");
+        return;
+    }
+
+    int err;
+    if (entry->compressed) {
+        err = decompress_file(entry->recycled_path, target_path);
+        if (err == 0) {
+            unlink(entry->recycled_path);
+        }
+    } else if (shared_inode) {
+        err = copy_file(entry->recycled_path, target_path);
+        if (err == 0) {
+            unlink(entry->recycled_path);
+        }
+    } else {
+        err = move_path(entry->recycled_path, target_path);
+    }
+
+    if (err != 0) {
+        entry->message = format_string("Error restoring file: %s", strerror(err));
+    } else {
+        entry->status = RESTORE_DONE;
+        entry->message = format_string("File restored to %s", target_path);
+    }
+    free(target_path);
+}
+
+// The compression worker may have swapped the file for a .gz copy after
+// the row was loaded. Once any swap in flight has committed (it holds the
+// write lock until then), reloads the row of an entry whose file is missing
+// and tries again if it now names another file.
+static void retry_swapped(AutoDeleteSystem* system, RestoreEntry* entry) {
+    struct stat st;
+    if (entry->status == RESTORE_DONE || entry->directory_error != 0 ||
+        lstat(entry->recycled_path, &st) == 0 || !begin_transaction(system)) {
+        return;
+    }
+    RestoreEntry current;
+    int loaded = load_entry(system, entry->id, &current);
+    commit_transaction(system);
+
+    if (loaded && (current.compressed != entry->compressed ||
+                   strcmp(current.recycled_path, entry->recycled_path) != 0)) {
+        free(entry->recycled_path);
+        free(entry->message);
+        entry->recycled_path = current.recycled_path;
+        entry->compressed = current.compressed;
+        entry->message = NULL;
+        entry->status = RESTORE_FAILED;
+        current.recycled_path = NULL;
+        restore_entry(entry);
+    }
+    free_entry(&current);
+}
+
+// Versions of one original path, newest first, run in order so they never
+// race each other for the original name
+static void restore_group(RestoreJob* job, int group) {
+    for (int i = job->starts[group]; i < job->starts[group + 1]; i++) {
+        RestoreEntry* entry = &job->entries[i];
+        if (entry->directory_error != 0) {
+            entry->message = format_string("Error: Could not create directory %s: %s",
+                                           entry->directory, strerror(entry->directory_error));
+        } else {
+            restore_entry(entry);
+        }
+    }
+}
+
+static void* restore_worker(void* arg) {
+    RestoreJob* job = arg;
+    int group;
+    while ((group = atomic_fetch_add(&job->next_group, 1)) < job->group_count) {
+        restore_group(job, group);
+    }
+    return NULL;
+}
+
+// By directory, then original path, then newest first
+static int compare_entries(const void* a, const void* b) {
+    const RestoreEntry* x = a;
+    const RestoreEntry* y = b;
+    int cmp = strcmp(x->directory, y->directory);
+    if (cmp == 0) {
+        cmp = strcmp(x->original_path, y->original_path);
+    }
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (x->id < y->id) - (x->id > y->id);
+}
+
+static void run_job(RestoreJob* job) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > RESTORE_MAX_THREADS) {
+        threads = RESTORE_MAX_THREADS;
+    }
+    if (threads > job->group_count) {
+        threads = job->group_count;
+    }
+
+    pthread_t workers[RESTORE_MAX_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&workers[started], NULL, restore_worker, job) != 0) {
+            break;
+        }
+    }
+    restore_worker(job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+// Restores ids[0..count): rows are loaded up front and sorted by target
+// directory, each missing directory is created once, and the moves run on
+// a thread pool. Cross-filesystem moves copy with
+// copy_file_range (see move_path). The rows are then removed in one
+// transaction. Per-file messages go to out and errors.
+char* restore_ids(AutoDeleteSystem* system, const int* ids, int count, FILE* out, FILE* errors) {
+    RestoreEntry* entries = calloc(count, sizeof(RestoreEntry));
+    int* done_ids = malloc(count * sizeof(int));
+    int* starts = malloc((count + 1) * sizeof(int));
+    if (entries == NULL || done_ids == NULL || starts == NULL) {
+        free(entries);
+        free(done_ids);
+        free(starts);
+        return strdup("Error: Memory allocation failed");
+    }
+
+    int failed_count = 0;
+    int loaded = 0;
+    for (int i = 0; i < count; i++) {
+        if (load_entry(system, ids[i], &entries[loaded])) {
+            loaded++;
+        } else {
+            fprintf(errors, "%s\n", entries[loaded].message);
+            free_entry(&entries[loaded]);
+            failed_count++;
+        }
+    }
+
+    qsort(entries, loaded, sizeof(RestoreEntry), compare_entries);
+    RestoreJob job = { .entries = entries, .starts = starts, .group_count = 0 };
+    atomic_init(&job.next_group, 0);
+    int directory_error = 0;
+    for (int i = 0; i < loaded; i++) {
+        if (i == 0 || strcmp(entries[i].directory, entries[i - 1].directory) != 0) {
+            directory_error = create_parents(entries[i].directory);
+        }
+        entries[i].directory_error = directory_error;
+        if (i == 0 || strcmp(entries[i].original_path, entries[i - 1].original_path) != 0) {
+            starts[job.group_count++] = i;
+        }
+    }
+    starts[job.group_count] = loaded;
+    if (job.group_count > 0) {
+        run_job(&job);
+    }
+
+    int restored_count = 0;
+    int done_count = 0;
+    for (int i = 0; i < loaded; i++) {
+        RestoreEntry* entry = &entries[i];
+        retry_swapped(system, entry);
+        if (entry->status == RESTORE_DONE) {
+            fprintf(out, "%s\n", entry->message);
+            restored_count++;
+            system->stats.files_restored++;
+        } else {
+            fprintf(errors, "%s\n", entry->message ? entry->message : "Error: Memory allocation failed");
+            failed_count++;
+        }
+        if (entry->status != RESTORE_FAILED) {
+            done_ids[done_count++] = entry->id;
+        }
+        free_entry(entry);
+    }
+    free(entries);
+    free(starts);
+
+    int rows_removed = delete_rows(system, done_ids, done_count);
+    free(done_ids);
+    if (!rows_removed) {
+        return format_string("Error removing restored rows: %s", sqlite3_errmsg(system->db));
+    }
+
+    if (failed_count == 0) {
+        return format_string("Restored %d files", restored_count);
+    }
+    return format_string("Restored %d files, failed to restore %d files", restored_count, failed_count);
+}
+
+char* restore_file(AutoDeleteSystem* system, int file_id) {
+    RestoreEntry entry;
+    if (!load_entry(system, file_id, &entry)) {
+        char* message = entry.message;
+        entry.message = NULL;
+        free_entry(&entry);
+        return message;
+    }
+
+    int err = create_parents(entry.directory);
+    if (err != 0) {
+        char* message = format_string("Error: Could not create directory %s: %s",
+                                      entry.directory, strerror(err));
+        free_entry(&entry);
+        return message;
+    }
+
+    restore_entry(&entry);
+    retry_swapped(system, &entry);
+    if (entry.status == RESTORE_DONE) {
+        system->stats.files_restored++;
+    }
+    if (entry.status != RESTORE_FAILED) {
+        delete_rows(system, &entry.id, 1);
+    }
+
+    char* message = entry.message;
+    entry.message = NULL;
+    free_entry(&entry);
+    return message;
+}
+
+// "./sub//dir/" becomes "sub/dir"; NULL for paths that would leave the
+// directory or name it as a whole
+static char* entry_path(const char* path) {
+    char* normal = malloc(strlen(path) + 1);
+    if (normal == NULL) {
+        return NULL;
+    }
+    size_t length = 0;
+    const char* p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        const char* end = strchrnul(p, '/');
+        size_t part = end - p;
+        if (part == 2 && p[0] == '.' && p[1] == '.') {
+            free(normal);
+            return NULL;
+        }
+        if (part > 0 && !(part == 1 && p[0] == '.')) {
+            if (length > 0) {
+                normal[length++] = '/';
+            }
+            memcpy(normal + length, p, part);
+            length += part;
+        }
+        p = end;
+    }
+    normal[length] = '\0';
+    if (length == 0) {
+        free(normal);
+        return NULL;
+    }
+    return normal;
+}
+
+// Restores paths (relative to the recycled directory file_id), each with
+// everything below it, found through the directory's manifest. The row
+// stays for the rest of the tree; the restored entries leave its manifest
+// and their bytes leave its size.
+char* restore_entries(AutoDeleteSystem* system, int file_id, char** paths, int count, FILE* out,
+                      FILE* errors) {
+    RestoreEntry dir;
+    if (!load_entry(system, file_id, &dir)) {
+        char* message = dir.message;
+        dir.message = NULL;
+        free_entry(&dir);
+        return message;
+    }
+    Manifest manifest;
+    char* error = NULL;
+    if (!load_manifest(system, file_id, dir.recycled_path, &manifest, &error)) {
+        free_entry(&dir);
+        return error;
+    }
+
+    char** wanted = calloc(count, sizeof(char*));
+    RestoreStatus* status = calloc(count, sizeof(RestoreStatus));
+    long long* usage = calloc(count, sizeof(long long));
+    int* owner = malloc((manifest.count > 0 ? manifest.count : 1) * sizeof(int));
+    unsigned char* drop = calloc(manifest.count > 0 ? manifest.count : 1, 1);
+    if (wanted == NULL || status == NULL || usage == NULL || owner == NULL || drop == NULL) {
+        free(wanted);
+        free(status);
+        free(usage);
+        free(owner);
+        free(drop);
+        free_manifest(&manifest);
+        free_entry(&dir);
+        return strdup("Error: Memory allocation failed");
+    }
+    for (int p = 0; p < count; p++) {
+        wanted[p] = entry_path(paths[p]);
+        status[p] = RESTORE_FAILED;
+        if (wanted[p] == NULL) {
+            fprintf(errors, "Error: %s is not a path inside directory %d\n", paths[p], file_id);
+        }
+    }
+
+    // Each entry belongs to the first path equal to it or above it
+    ManifestReader reader;
+    manifest_reader_init(&reader, manifest.data, manifest.length);
+    int* owned = calloc(count, sizeof(int));
+    long long entry_count = 0;
+    for (; owned != NULL && entry_count < manifest.count && manifest_next(&reader); entry_count++) {
+        owner[entry_count] = -1;
+        for (int p = 0; p < count && owner[entry_count] < 0; p++) {
+            size_t length = wanted[p] ? strlen(wanted[p]) : 0;
+            if (length > 0 && strncmp(reader.path, wanted[p], length) == 0 &&
+                (reader.path[length] == '\0' || reader.path[length] == '/')) {
+                owner[entry_count] = p;
+                owned[p] += strcmp(reader.path, wanted[p]) == 0 ? 1 : 0;
+                usage[p] += reader.usage;
+            }
+        }
+    }
+    manifest_reader_free(&reader);
+
+    int restored_count = 0;
+    int failed_count = 0;
+    for (int p = 0; p < count; p++) {
+        if (wanted[p] == NULL) {
+            failed_count++;
+            continue;
+        }
+        if (owned == NULL || owned[p] == 0) {
+            // Either not in the tree, or part of a path restored above it
+            int covered = 0;
+            for (int q = 0; q < p && owned != NULL; q++) {
+                size_t length = wanted[q] ? strlen(wanted[q]) : 0;
+                covered |= length > 0 && owned[q] > 0 && strncmp(wanted[p], wanted[q], length) == 0 &&
+                           wanted[p][length] == '/';
+            }
+            if (!covered) {
+                fprintf(errors, "Error: %s is not in directory %d\n", wanted[p], file_id);
+                failed_count++;
+            }
+            continue;
+        }
+
+        RestoreEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.id = file_id;
+        entry.status = RESTORE_FAILED;
+        entry.original_path = path_join(dir.original_path, wanted[p]);
+        entry.recycled_path = path_join(dir.recycled_path, wanted[p]);
+        entry.directory = entry.original_path ? get_dirname(entry.original_path) : NULL;
+        int err = entry.directory && entry.recycled_path ? create_parents(entry.directory) : ENOMEM;
+        if (err != 0) {
+            entry.message = format_string("Error: Could not create directory %s: %s",
+                                          entry.directory ? entry.directory : "", strerror(err));
+        } else {
+            restore_entry(&entry);
+        }
+        status[p] = entry.status;
+        if (entry.status == RESTORE_DONE) {
+            fprintf(out, "%s\n", entry.message);
+            restored_count++;
+            system->stats.files_restored++;
+        } else {
+            fprintf(errors, "%s\n", entry.message ? entry.message : "Error: Memory allocation failed");
+            failed_count++;
+        }
+        free_entry(&entry);
+    }
+
+    // Entries that went back (or were gone already) leave the manifest
+    long long freed = 0;
+    int changed = 0;
+    for (long long i = 0; i < entry_count; i++) {
+        drop[i] = owner[i] >= 0 && status[owner[i]] != RESTORE_FAILED;
+        changed |= drop[i];
+    }
+    for (int p = 0; p < count; p++) {
+        freed += status[p] != RESTORE_FAILED ? usage[p] : 0;
+    }
+
+    char* result = NULL;
+    Manifest kept;
+    if (changed && entry_count == manifest.count && filter_manifest(&manifest, drop, &kept)) {
+        sqlite3_stmt* stmt = NULL;
+        int ok = begin_transaction(system) && store_manifest(system, file_id, &kept) &&
+                 (stmt = get_statement(system, STMT_SHRINK_ENTRY)) != NULL;
+        if (ok) {
+            sqlite3_bind_int(stmt, 1, file_id);
+            sqlite3_bind_int64(stmt, 2, freed);
+            ok = sqlite3_step(stmt) == SQLITE_DONE;
+            sqlite3_reset(stmt);
+        }
+        if (!ok || !commit_transaction(system)) {
+            result = format_string("Error updating directory %d: %s", file_id,
+                                   sqlite3_errmsg(system->db));
+            rollback_transaction(system);
+        }
+        free_manifest(&kept);
+    } else if (changed) {
+        result = format_string("Error updating the manifest of directory %d", file_id);
+    }
+
+    for (int p = 0; p < count; p++) {
+        free(wanted[p]);
+    }
+    free(wanted);
+    free(status);
+    free(usage);
+    free(owner);
+    free(owned);
+    free(drop);
+    free_manifest(&manifest);
+    free_entry(&dir);
+    if (result != NULL) {
+        return result;
+    }
+    if (failed_count == 0) {
+        return format_string("Restored %d entries from directory %d", restored_count, file_id);
+    }
+    return format_string("Restored %d entries from directory %d, failed to restore %d entries",
+                         restored_count, file_id, failed_count);
+}
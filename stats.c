@@ -0,0 +1,98 @@
+/* stats.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "auto_delete.h"
+
+// Upper bounds of the finite purge latency buckets, in seconds
+static const double latency_bounds[LATENCY_BUCKETS] = {
+    0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 30, 120
+};
+
+double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void record_purge_latency(EngineStats* stats, double seconds) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS && seconds > latency_bounds[bucket]) {
+        bucket++;
+    }
+    stats->purge_latency[bucket]++;
+    stats->purge_seconds += seconds;
+}
+
+static int query_int64(AutoDeleteSystem* system, const char* sql, long long bind,
+                       long long* value) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(system->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    if (sqlite3_bind_parameter_count(stmt) > 0) {
+        sqlite3_bind_int64(stmt, 1, bind);
+    }
+    int ok = sqlite3_step(stmt) == SQLITE_ROW;
+    if (ok) {
+        *value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+static void write_metric(FILE* out, const char* name, const char* type, long long value) {
+    fprintf(out, "# TYPE auto_delete_%s %s\nauto_delete_%s %lld\n", name, type, name, value);
+}
+
+// Writes the counters and the current queue state in the Prometheus text
+// format, one sample per line. Returns 0 if the database could not be read.
+int write_stats(AutoDeleteSystem* system, FILE* out) {
+    const EngineStats* stats = &system->stats;
+    time_t now = wall_clock_now();
+    long long queued = 0;
+    long long overdue = 0;
+    long long bytes = 0;
+    if (!query_int64(system, "SELECT COUNT(*) FROM deleted_files", 0, &queued) ||
+        !query_int64(system, "SELECT COUNT(*) FROM deleted_files WHERE scheduled_deletion <= ?1",
+                     now, &overdue) ||
+        !query_int64(system, "SELECT total_bytes FROM bin_usage WHERE id = 0", 0, &bytes)) {
+        return 0;
+    }
+    time_t deadline = 0;
+    next_deadline(system, &deadline);
+
+    write_metric(out, "daemon_up", "gauge", stats->started != 0);
+    write_metric(out, "daemon_start_time_seconds", "gauge", (long long)stats->started);
+    write_metric(out, "files_recycled_total", "counter", stats->files_recycled);
+    write_metric(out, "files_restored_total", "counter", stats->files_restored);
+    write_metric(out, "files_purged_total", "counter", stats->files_purged);
+    write_metric(out, "bytes_purged_total", "counter", stats->bytes_purged);
+    write_metric(out, "purge_failures_total", "counter", stats->purge_failures);
+    write_metric(out, "purge_deferrals_total", "counter", stats->purge_deferrals);
+    write_metric(out, "files_evicted_total", "counter", stats->files_evicted);
+    write_metric(out, "bytes_evicted_total", "counter", stats->bytes_evicted);
+    write_metric(out, "evict_failures_total", "counter", stats->evict_failures);
+    write_metric(out, "stale_rows_removed_total", "counter", stats->stale_rows);
+    write_metric(out, "sqlite_busy_waits_total", "counter", stats->busy_waits);
+    write_metric(out, "queue_files", "gauge", queued);
+    write_metric(out, "queue_overdue_files", "gauge", overdue);
+    write_metric(out, "queue_bytes", "gauge", bytes);
+    write_metric(out, "next_deadline_seconds", "gauge", (long long)deadline);
+    write_metric(out, "reclaim_pending_bytes", "gauge",
+                 reclaim_pending_bytes(system->reclaimer, NULL));
+
+    fprintf(out, "# TYPE auto_delete_purge_duration_seconds histogram\n");
+    long long cumulative = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        cumulative += stats->purge_latency[i];
+        fprintf(out, "auto_delete_purge_duration_seconds_bucket{le=\"%g\"} %lld\n",
+                latency_bounds[i], cumulative);
+    }
+    cumulative += stats->purge_latency[LATENCY_BUCKETS];
+    fprintf(out, "auto_delete_purge_duration_seconds_bucket{le=\"+Inf\"} %lld\n", cumulative);
+    fprintf(out, "auto_delete_purge_duration_seconds_sum %.6f\n", stats->purge_seconds);
+    fprintf(out, "auto_delete_purge_duration_seconds_count %lld\n", stats->purge_runs);
+    return 1;
+}
@@ -0,0 +1,522 @@
+/* system_daemon.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pwd.h>
+#include <grp.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/fsuid.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include "auto_delete.h"
+#include "daemon.h"
+
+// System mode: one root daemon serves every user with a ~/.recycle_bin.
+// Each user's next deadline sits in one min-heap behind a single timer.
+// When a user comes due, a worker is forked that drops to that user's
+// credentials, purges and evicts, and reports the new next deadline back
+// over a pipe. The root process itself never opens a user's database.
+
+#define SYSTEM_MAX_WORKERS 4        // Users purged at the same time
+#define SYSTEM_RESCAN_INTERVAL 300  // Seconds between looks for new bins
+#define SYSTEM_MAX_EVENTS 64
+
+enum { EVENT_SIGNAL, EVENT_TIMER, EVENT_RESCAN, EVENT_WAKEUP, EVENT_RESULT };
+
+typedef struct {
+    uid_t uid;
+    gid_t gid;
+    char* name;
+    char* home;
+    char* wakeup_path;
+    int wakeup_fd;
+    time_t deadline;        // 0 when nothing is queued
+    time_t pending;         // Wakeups that arrived while a worker ran
+    int heap_index;         // -1 when not in the heap
+    pid_t worker;           // 0 when idle
+    int result_fd;
+    int active;             // Bin found in the latest scan
+} UserBin;
+
+typedef struct {
+    UserBin* users;
+    int user_count;
+    int user_capacity;
+    int* heap;              // Indexes into users, ordered by deadline
+    int heap_count;
+    int running;
+    int epoll_fd;
+    int timer_fd;
+    long long quota_bytes;  // Either limit makes every wakeup an eviction check
+    long long min_free_bytes;
+} Scheduler;
+
+static uint64_t event_tag(int type, int index) {
+    return ((uint64_t)type << 32) | (uint32_t)index;
+}
+
+static void heap_swap(Scheduler* s, int a, int b) {
+    int user_a = s->heap[a];
+    s->heap[a] = s->heap[b];
+    s->heap[b] = user_a;
+    s->users[s->heap[a]].heap_index = a;
+    s->users[s->heap[b]].heap_index = b;
+}
+
+static time_t heap_key(const Scheduler* s, int position) {
+    return s->users[s->heap[position]].deadline;
+}
+
+static void heap_fix(Scheduler* s, int position) {
+    while (position > 0 && heap_key(s, (position - 1) / 2) > heap_key(s, position)) {
+        heap_swap(s, position, (position - 1) / 2);
+        position = (position - 1) / 2;
+    }
+    for (;;) {
+        int smallest = position;
+        int left = 2 * position + 1;
+        int right = left + 1;
+        if (left < s->heap_count && heap_key(s, left) < heap_key(s, smallest)) {
+            smallest = left;
+        }
+        if (right < s->heap_count && heap_key(s, right) < heap_key(s, smallest)) {
+            smallest = right;
+        }
+        if (smallest == position) {
+            return;
+        }
+        heap_swap(s, position, smallest);
+        position = smallest;
+    }
+}
+
+static void heap_remove(Scheduler* s, int user) {
+    int position = s->users[user].heap_index;
+    if (position < 0) {
+        return;
+    }
+    s->users[user].heap_index = -1;
+    s->heap_count--;
+    if (position < s->heap_count) {
+        s->heap[position] = s->heap[s->heap_count];
+        s->users[s->heap[position]].heap_index = position;
+        heap_fix(s, position);
+    }
+}
+
+// Queues user for deadline, or moves it earlier if already queued.
+// Users with a worker running keep the deadline until it reports.
+static void schedule_user(Scheduler* s, int user, time_t deadline) {
+    UserBin* u = &s->users[user];
+    if (deadline == 0 || !u->active) {
+        return;
+    }
+    if (u->worker != 0) {
+        if (u->pending == 0 || deadline < u->pending) {
+            u->pending = deadline;
+        }
+        return;
+    }
+    if (u->heap_index >= 0) {
+        if (deadline < u->deadline) {
+            u->deadline = deadline;
+            heap_fix(s, u->heap_index);
+        }
+        return;
+    }
+    u->deadline = deadline;
+    u->heap_index = s->heap_count;
+    s->heap[s->heap_count++] = user;
+    heap_fix(s, u->heap_index);
+}
+
+// Binds the user's wakeup socket with the user's filesystem credentials, so
+// the socket belongs to them and nothing in their home is touched as root
+static int open_user_wakeup(const UserBin* u) {
+    setfsgid(u->gid);
+    setfsuid(u->uid);
+    int fd = open_wakeup_socket(u->wakeup_path);
+    setfsuid(0);
+    setfsgid(0);
+    return fd;
+}
+
+static int find_user(const Scheduler* s, uid_t uid) {
+    for (int i = 0; i < s->user_count; i++) {
+        if (s->users[i].uid == uid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void deactivate_user(Scheduler* s, int user) {
+    UserBin* u = &s->users[user];
+    heap_remove(s, user);
+    if (u->wakeup_fd >= 0) {
+        close(u->wakeup_fd);
+        u->wakeup_fd = -1;
+    }
+    u->active = 0;
+}
+
+// Finds every account whose home holds a recycle bin it owns. New bins are
+// due at once, to catch up on whatever expired before we saw them.
+static void scan_users(Scheduler* s) {
+    for (int i = 0; i < s->user_count; i++) {
+        s->users[i].active = -s->users[i].active;   // -1: not yet seen in this scan
+    }
+
+    setpwent();
+    struct passwd* pw;
+    while ((pw = getpwent()) != NULL) {
+        if (pw->pw_dir == NULL || pw->pw_dir[0] != '/') {
+            continue;
+        }
+        char* bin = path_join(pw->pw_dir, ".recycle_bin");
+        struct stat st;
+        int owned = bin != NULL && lstat(bin, &st) == 0 && S_ISDIR(st.st_mode) &&
+                    st.st_uid == pw->pw_uid;
+        if (!owned) {
+            free(bin);
+            continue;
+        }
+
+        int user = find_user(s, pw->pw_uid);
+        if (user >= 0 && s->users[user].active != 0) {
+            s->users[user].active = 1;
+            free(bin);
+            continue;
+        }
+        if (user < 0) {
+            if (s->user_count == s->user_capacity) {
+                int capacity = s->user_capacity ? s->user_capacity * 2 : 16;
+                UserBin* users = realloc(s->users, capacity * sizeof(UserBin));
+                int* heap = realloc(s->heap, capacity * sizeof(int));
+                if (users != NULL) s->users = users;
+                if (heap != NULL) s->heap = heap;
+                if (users == NULL || heap == NULL) {
+                    free(bin);
+                    break;
+                }
+                s->user_capacity = capacity;
+            }
+            user = s->user_count++;
+            memset(&s->users[user], 0, sizeof(UserBin));
+            s->users[user].heap_index = -1;
+            s->users[user].wakeup_fd = -1;
+            s->users[user].result_fd = -1;
+        }
+
+        UserBin* u = &s->users[user];
+        free(u->name);
+        free(u->home);
+        free(u->wakeup_path);
+        u->uid = pw->pw_uid;
+        u->gid = pw->pw_gid;
+        u->name = strdup(pw->pw_name);
+        u->home = strdup(pw->pw_dir);
+        u->wakeup_path = path_join(bin, "wakeup.sock");
+        free(bin);
+        if (u->name == NULL || u->home == NULL || u->wakeup_path == NULL) {
+            continue;
+        }
+
+        u->wakeup_fd = open_user_wakeup(u);
+        if (u->wakeup_fd >= 0) {
+            struct epoll_event ev = { .events = EPOLLIN, .data.u64 = event_tag(EVENT_WAKEUP, user) };
+            epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, u->wakeup_fd, &ev);
+        }
+        u->active = 1;
+        syslog(LOG_INFO, "Serving recycle bin of %s", u->name);
+        schedule_user(s, user, wall_clock_now());
+    }
+    endpwent();
+
+    for (int i = 0; i < s->user_count; i++) {
+        if (s->users[i].active < 0) {
+            syslog(LOG_INFO, "Recycle bin of %s is gone", s->users[i].name);
+            deactivate_user(s, i);
+        }
+    }
+}
+
+// Closes every descriptor but keep. A worker inherits the scheduler's,
+// among them other users' wakeup sockets and their workers' pipes.
+static void close_other_fds(int keep) {
+    if ((keep == 0 || close_range(0, keep - 1, 0) == 0) && close_range(keep + 1, ~0U, 0) == 0) {
+        return;
+    }
+    // Kernels before 5.9
+    int max_fd = (int)sysconf(_SC_OPEN_MAX);
+    for (int fd = 0; fd < max_fd; fd++) {
+        if (fd != keep) {
+            close(fd);
+        }
+    }
+}
+
+// Runs in the forked worker: become the user, purge, evict and write the
+// next deadline (0 for none) to result_fd
+static void run_worker(const UserBin* u, int result_fd) {
+    sigset_t signals;
+    sigfillset(&signals);
+    sigprocmask(SIG_UNBLOCK, &signals, NULL);
+    closelog();
+    close_other_fds(result_fd);
+    openlog(DAEMON_NAME, LOG_PID, LOG_DAEMON);
+    if (initgroups(u->name, u->gid) != 0 || setgid(u->gid) != 0 || setuid(u->uid) != 0) {
+        syslog(LOG_ERR, "Cannot switch to %s: %s", u->name, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    setenv("HOME", u->home, 1);
+    setenv("USER", u->name, 1);
+    setenv("LOGNAME", u->name, 1);
+
+    AutoDeleteSystem system;
+    if (!init_system(&system)) {
+        syslog(LOG_ERR, "Could not open the recycle bin of %s", u->name);
+        _exit(EXIT_FAILURE);
+    }
+    init_purge_budget(&system);
+    run_purge(&system);
+    run_eviction(&system);
+    create_missing_path_index(&system);
+    update_path_index(&system, -1);
+
+    time_t next = 0;
+    int64_t deadline = next_deadline(&system, &next) ? (int64_t)next : 0;
+    if (deadline != 0 && deadline <= wall_clock_now() && system.budget.resume_at != 0) {
+        deadline = system.budget.resume_at;
+    }
+    cleanup_system(&system);
+    ssize_t written = write(result_fd, &deadline, sizeof(deadline));
+    _exit(written == sizeof(deadline) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void start_worker(Scheduler* s, int user) {
+    UserBin* u = &s->users[user];
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        syslog(LOG_ERR, "pipe failed: %s", strerror(errno));
+        schedule_user(s, user, wall_clock_now() + RETRY_INTERVAL);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        syslog(LOG_ERR, "fork failed: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        schedule_user(s, user, wall_clock_now() + RETRY_INTERVAL);
+        return;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        run_worker(u, fds[1]);
+    }
+    close(fds[1]);
+
+    u->worker = pid;
+    u->result_fd = fds[0];
+    u->pending = 0;
+    s->running++;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = event_tag(EVENT_RESULT, user) };
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, u->result_fd, &ev);
+}
+
+// A worker finished (or died): requeue its user for whatever is next
+static void finish_worker(Scheduler* s, int user) {
+    UserBin* u = &s->users[user];
+    int64_t deadline = 0;
+    ssize_t n = read(u->result_fd, &deadline, sizeof(deadline));
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, u->result_fd, NULL);
+    close(u->result_fd);
+    u->result_fd = -1;
+    waitpid(u->worker, NULL, 0);
+    u->worker = 0;
+    s->running--;
+
+    time_t now = wall_clock_now();
+    if (n != sizeof(deadline)) {
+        deadline = now + RETRY_INTERVAL;
+    } else if (deadline != 0 && deadline <= now) {
+        // Rows still due after a purge are ones that failed (deferred ones
+        // come back with the budget's resume time); don't spin on them
+        deadline = now + RETRY_INTERVAL;
+    }
+    schedule_user(s, user, (time_t)deadline);
+    schedule_user(s, user, u->pending);
+    u->pending = 0;
+}
+
+static void read_wakeups(Scheduler* s, int user) {
+    UserBin* u = &s->users[user];
+    int64_t deadline;
+    while (recv(u->wakeup_fd, &deadline, sizeof(deadline), 0) == sizeof(deadline)) {
+        schedule_user(s, user, (time_t)deadline);
+    }
+    // The bin just grew; with a limit set, check it now rather than at expiry
+    if (s->quota_bytes > 0 || s->min_free_bytes > 0) {
+        schedule_user(s, user, wall_clock_now());
+    }
+}
+
+// Starts workers for every user that is due, up to SYSTEM_MAX_WORKERS,
+// then arms the timer for the earliest deadline left
+static void dispatch(Scheduler* s) {
+    time_t now = wall_clock_now();
+    while (s->heap_count > 0 && s->running < SYSTEM_MAX_WORKERS && heap_key(s, 0) <= now) {
+        int user = s->heap[0];
+        heap_remove(s, user);
+        start_worker(s, user);
+    }
+    // A full pool leaves due users in the heap; a finishing worker re-dispatches
+    time_t next = s->heap_count > 0 ? heap_key(s, 0) : 0;
+    if (next != 0 && next <= now) {
+        next = s->running < SYSTEM_MAX_WORKERS ? now : 0;
+    }
+    arm_timer(s->timer_fd, next);
+}
+
+static long long env_limit(const char* name) {
+    const char* value = getenv(name);
+    long long bytes = 0;
+    return value != NULL && parse_size(value, &bytes) ? bytes : 0;
+}
+
+int run_system_daemon(void) {
+    if (geteuid() != 0) {
+        fprintf(stderr, "Error: --system must run as root\n");
+        return EXIT_FAILURE;
+    }
+    daemonize();
+
+    Scheduler s;
+    memset(&s, 0, sizeof(s));
+    s.quota_bytes = env_limit(QUOTA_ENV);
+    s.min_free_bytes = env_limit(MIN_FREE_ENV);
+
+    // The workers apply the log level too, through init_system
+    const char* log_level = getenv(LOG_LEVEL_ENV);
+    int level = DEFAULT_LOG_LEVEL;
+    if (log_level != NULL && !parse_log_level(log_level, &level)) {
+        level = DEFAULT_LOG_LEVEL;
+    }
+    setlogmask(LOG_UPTO(level));
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    s.timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    int rescan_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    s.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || s.timer_fd < 0 || rescan_fd < 0 || s.epoll_fd < 0) {
+        syslog(LOG_ERR, "Could not set up event loop: %s", strerror(errno));
+        closelog();
+        return EXIT_FAILURE;
+    }
+
+    struct itimerspec rescan = {
+        .it_interval = { .tv_sec = SYSTEM_RESCAN_INTERVAL },
+        .it_value = { .tv_sec = SYSTEM_RESCAN_INTERVAL },
+    };
+    timerfd_settime(rescan_fd, 0, &rescan, NULL);
+
+    int watched[] = { signal_fd, s.timer_fd, rescan_fd };
+    int types[] = { EVENT_SIGNAL, EVENT_TIMER, EVENT_RESCAN };
+    for (int i = 0; i < 3; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = event_tag(types[i], 0) };
+        epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, watched[i], &ev);
+    }
+
+    syslog(LOG_NOTICE, "System-wide auto-delete daemon started");
+    scan_users(&s);
+    dispatch(&s);
+
+    int running = 1;
+    while (running || s.running > 0) {
+        struct epoll_event events[SYSTEM_MAX_EVENTS];
+        int n = epoll_wait(s.epoll_fd, events, SYSTEM_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int type = (int)(events[i].data.u64 >> 32);
+            int index = (int)(uint32_t)events[i].data.u64;
+            uint64_t expirations;
+
+            if (type == EVENT_SIGNAL) {
+                struct signalfd_siginfo info;
+                while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                    if (info.ssi_signo == SIGHUP) {
+                        scan_users(&s);
+                    } else {
+                        syslog(LOG_NOTICE, "Received signal %d, waiting for workers",
+                               info.ssi_signo);
+                        running = 0;
+                    }
+                }
+            } else if (type == EVENT_TIMER) {
+                // ECANCELED (clock change) needs nothing more than the re-arm below
+                if (read(s.timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN &&
+                    errno != ECANCELED) {
+                    syslog(LOG_ERR, "timer read failed: %s", strerror(errno));
+                }
+            } else if (type == EVENT_RESCAN) {
+                if (read(rescan_fd, &expirations, sizeof(expirations)) > 0) {
+                    scan_users(&s);
+                }
+            } else if (type == EVENT_WAKEUP) {
+                read_wakeups(&s, index);
+            } else if (type == EVENT_RESULT) {
+                finish_worker(&s, index);
+            }
+        }
+
+        if (running) {
+            dispatch(&s);
+        }
+    }
+
+    syslog(LOG_NOTICE, "System-wide daemon shutting down");
+    for (int i = 0; i < s.user_count; i++) {
+        UserBin* u = &s.users[i];
+        if (u->wakeup_fd >= 0) {
+            close(u->wakeup_fd);
+            setfsgid(u->gid);
+            setfsuid(u->uid);
+            unlink(u->wakeup_path);
+            setfsuid(0);
+            setfsgid(0);
+        }
+        free(u->name);
+        free(u->home);
+        free(u->wakeup_path);
+    }
+    free(s.users);
+    free(s.heap);
+    close(rescan_fd);
+    close(s.timer_fd);
+    close(signal_fd);
+    close(s.epoll_fd);
+    closelog();
+    return EXIT_SUCCESS;
+}